@@ -3,8 +3,10 @@
 #include "ztimer.h"
 #include "analyze.hpp"
 #include "bitscan.hpp"
+#include "hybrid.hpp"
 #include "simple-timer.hpp"
 #ifdef __AVX2__
+#include "batch.hpp"
 #include "fastscancount_avx2.h"
 #include "fastscancount_avx2b.h"
 #endif
@@ -13,6 +15,8 @@
 #endif
 #include "linux-perf-events-wrapper.h"
 #include "maropuparser.h"
+#include "merge.hpp"
+#include "pigeonhole.hpp"
 
 #include <algorithm>
 #include <cstdint>
@@ -54,6 +58,9 @@ constexpr size_t MAX_QUERIES = 2; // 100;
 constexpr bool PRINT_ALL = true;
 constexpr bool do_analyze = false;
 
+/* the number of threads used by the parallel (intra-query) algorithms */
+constexpr size_t PARALLEL_THREADS = 4;
+
 /////////////////////
 // all mode params //
 /////////////////////
@@ -327,10 +334,12 @@ void demo_data(const std::vector<std::vector<uint32_t>>& data,
   // aux data for bitscan
   LoggingTimer timer_aux_bitscan("bitscan aux creation", csv_mode ? nullptr : stdout);
   auto bitscan_aux32 = fastscancount::get_all_aux_bitscan<uint32_t>(data);
+  auto bitscan_aux8 = fastscancount::get_all_aux_bitscan<uint8_t>(data);
   if (!csv_mode) timer_aux_bitscan.printElapsed();
 
   auto avx2b_aux32 = fastscancount::implb::get_all_aux<uint32_t>(data);
   auto avx2b_aux16 = fastscancount::implb::get_all_aux<uint16_t>(data);
+  fastscancount::hybrid_aux<uint16_t> hybrid_aux16(avx2b_aux16, bitscan_aux32);
 
   std::vector<const std::vector<uint32_t>*> data_ptrs;
   std::vector<const std::vector<uint32_t>*> range_ptrs;
@@ -377,6 +386,8 @@ void demo_data(const std::vector<std::vector<uint32_t>>& data,
 
       // BENCHTEST(scancount, "baseline scancount", elapsed);
       BENCHTEST(fastscancount::fastscancount, "cache-sensitive scancount", elapsed_fast);
+      BENCHTEST(pigeonhole_scancount, "pigeonhole scancount", dummy);
+      BENCHTEST(merge_scancount, "merge scancount", dummy);
 
       // BENCHTEST(bitscan_fake2,  "bitscan_fake2", dummy, bitscan_aux32, query_elem);
 
@@ -387,6 +398,10 @@ void demo_data(const std::vector<std::vector<uint32_t>>& data,
 
       // BENCHTEST((fastscancount_avx2b<uint32_t, fastscancount::record_hits_asm_branchy32>), "AVX2B ASM branchy    32b", elapsed_avx2b32,  avx2b_aux32, query_elem);
       BENCHTEST((fastscancount_avx2b<uint16_t, fastscancount::record_hits_asm_branchy16>), "AVX2B ASM branchy    16b", elapsed_avx2b16, avx2b_aux16, query_elem);
+      BENCHTEST((fastscancount_avx2b_fused<uint16_t, fastscancount::record_hits_asm_fused16>), "AVX2B ASM fused      16b", dummy, avx2b_aux16, query_elem);
+      BENCHTEST((fastscancount_avx2b_auto<uint16_t, fastscancount::record_hits_asm_branchy16, fastscancount::record_hits_asm_fused16>), "AVX2B ASM auto       16b", dummy, avx2b_aux16, query_elem);
+      BENCHTEST((fastscancount_avx2b_parallel<uint16_t, fastscancount::record_hits_asm_branchy16>), "AVX2B ASM 16b parallel", dummy, avx2b_aux16, query_elem, PARALLEL_THREADS);
+      BENCHTEST(bitscan_avx2, "bitscan_avx2", dummy, bitscan_aux32, query_elem);
       // BENCHTEST((fastscancount_avx2b<uint16_t, fastscancount::record_hits_asm_branchyB >), "AVX2B ASM branchy      B", elapsed_avx2b16b, avx2b_aux16, query_elem);
 
       // BENCHTEST((fastscancount_avx2b<uint32_t, fastscancount::record_hits_asm_branchless32>), "AVX2B ASM branchless 32b", dummy, avx2b_aux32, query_elem);
@@ -395,10 +410,27 @@ void demo_data(const std::vector<std::vector<uint32_t>>& data,
   #ifdef __AVX512F__
       BENCHTEST(bitscan_avx512,     "bitscan_avx512", elapsed_bitscan, bitscan_aux32, query_elem);
       BENCHTEST(bitscan_avx512_asm, "bitscan_avx512_asm", elapsed_bitscan_asm, bitscan_aux32, query_elem);
-      // BENCHTEST(fastscancount_avx512, "AVX512-based scancount", elapsed_avx512, range_size_avx512, range_ptrs);
+      BENCHTEST(bitscan_avx512,     "bitscan_avx512 8b", dummy, bitscan_aux8, query_elem);
+      BENCHTEST(fastscancount_avx512, "AVX512-based scancount", elapsed_avx512, range_size_avx512, range_ptrs);
+      BENCHTEST((fastscancount_avx2b<uint16_t, fastscancount::record_hits_avx512<uint16_t>>), "AVX2B AVX-512 scatter 16b", dummy, avx2b_aux16, query_elem);
+      BENCHTEST((hybrid_scancount<uint16_t, fastscancount::record_hits_asm_branchy16, bitscan_avx512<uint32_t>>), "hybrid bitscan/AVX2B", dummy, hybrid_aux16, query_elem);
   #endif
     }
 
+#ifdef __AVX2__
+    if (!csv_mode) {
+      // all the queries for this threshold as a single batch, spread across all cores
+      std::vector<std::vector<uint32_t>> batch_queries(queries.begin(), queries.begin() + qcount);
+      std::vector<uint8_t> batch_thresholds(qcount, threshold);
+      WallClockTimer tm;
+      scancount_batch(batch_queries, batch_thresholds,
+          avx2b_engine<uint16_t, fastscancount::record_hits_asm_branchy16>(avx2b_aux16));
+      double batch_us = tm.split();
+      std::cout << "AVX2B batch of " << qcount << " queries on " << worker_pool::default_pool().size()
+          << " threads: " << std::setprecision(0) << (qcount / (batch_us / 1e6)) << " QPS\n";
+    }
+#endif
+
     std::cout << std::fixed;
     if (!csv_mode) {
 #define ELAPSEDOUT(var) std::setprecision(0) << (sum_total/(var/1e3)) \
@@ -446,6 +478,32 @@ void demo_data(const std::vector<std::vector<uint32_t>>& data,
 
   }
 
+#ifdef __AVX2__
+  if (!csv_mode && threshold_stop > threshold_start) {
+    // the whole threshold range from one counting pass per query, against a pass per threshold
+    std::vector<uint8_t> thresholds;
+    for (size_t threshold = threshold_start; threshold <= threshold_stop; threshold++) {
+      thresholds.push_back(threshold);
+    }
+    std::vector<std::vector<uint32_t>> multi;
+    WallClockTimer tm;
+    for (size_t qid = 0; qid < qcount; ++qid) {
+      fastscancount_avx2b_multi<uint16_t, fastscancount::record_hits_asm_branchy16>(
+          {}, multi, thresholds, avx2b_aux16, queries[qid]);
+    }
+    double multi_us = tm.split();
+    for (size_t qid = 0; qid < qcount; ++qid) {
+      for (auto threshold : thresholds) {
+        fastscancount_avx2b<uint16_t, fastscancount::record_hits_asm_branchy16>(
+            {}, answer, threshold, avx2b_aux16, queries[qid]);
+      }
+    }
+    double single_us = tm.split();
+    std::cout << "AVX2B " << thresholds.size() << " thresholds in one pass: " << std::setprecision(1)
+        << (multi_us / 1e3) << " ms, a pass per threshold: " << (single_us / 1e3) << " ms\n";
+  }
+#endif
+
   std::cout << std::flush;
 }
 
@@ -505,7 +563,9 @@ void demo_random(size_t N, size_t length, size_t array_count, size_t threshold)
   // aux data for bitscan
   LoggingTimer timer_aux_bitscan("bitscan aux creation", csv_mode ? nullptr : stdout);
   auto bitscan_aux32 = fastscancount::get_all_aux_bitscan<uint32_t>(data);
+  auto bitscan_aux8 = fastscancount::get_all_aux_bitscan<uint8_t>(data);
   timer_aux_bitscan.printElapsed();
+  fastscancount::hybrid_aux<uint16_t> hybrid_aux16(avx2b_aux16, bitscan_aux32);
 
   // query definition composed of all the arrays
   std::vector<uint32_t> query_elem(data.size());
@@ -522,6 +582,8 @@ void demo_random(size_t N, size_t length, size_t array_count, size_t threshold)
 
   // BENCH_LOOP(scancount, "baseline scancount", elapsed);
   BENCH_LOOP(fastscancount::fastscancount, "fastscancount", elapsed_fast);
+  BENCH_LOOP(pigeonhole_scancount, "pigeonhole", dummy);
+  BENCH_LOOP(merge_scancount, "merge", dummy);
 
   // BENCH_LOOP(bitscan_scalar, "bitscan_scalar", dummy, bitscan_aux32, query_elem);
   // BENCH_LOOP(bitscan_fake,  "bitscan_fake", dummy, bitscan_aux32, query_elem);
@@ -535,6 +597,11 @@ void demo_random(size_t N, size_t length, size_t array_count, size_t threshold)
 
   // BENCH_LOOP((fastscancount_avx2b<uint32_t, fastscancount::record_hits_asm_branchy32>), "AVX2B ASM branchy    32b", elapsed_avx2bb, avx2b_aux32, query_elem);
   BENCH_LOOP((fastscancount_avx2b<uint16_t, fastscancount::record_hits_asm_branchy16>), "AVX2B ASM branchy    16b", elapsed_avx2b16, avx2b_aux16, query_elem);
+  BENCH_LOOP((fastscancount_avx2b_fused<uint16_t, fastscancount::record_hits_asm_fused16>), "AVX2B ASM fused      16b", dummy, avx2b_aux16, query_elem);
+  BENCH_LOOP((fastscancount_avx2b_auto<uint16_t, fastscancount::record_hits_asm_branchy16, fastscancount::record_hits_asm_fused16>), "AVX2B ASM auto       16b", dummy, avx2b_aux16, query_elem);
+  BENCH_LOOP((fastscancount_avx2b_parallel<uint16_t, fastscancount::record_hits_asm_branchy16>), "AVX2B ASM 16b parallel", dummy, avx2b_aux16, query_elem, PARALLEL_THREADS);
+  BENCH_LOOP((fastscancount_avx2b_wide<uint16_t, fastscancount::record_hits_asm_branchy16w>), "AVX2B ASM 16b wide ctrs", dummy, avx2b_aux16, query_elem);
+  BENCH_LOOP(bitscan_avx2, "bitscan_avx2", dummy, bitscan_aux32, query_elem);
   // BENCH_LOOP((fastscancount_avx2b<uint16_t, fastscancount::record_hits_asm_branchyB >), "AVX2B ASM branchy      B", dummy, avx2b_aux16, query_elem);
 
   // BENCH_LOOP((fastscancount_avx2b<uint32_t, fastscancount::record_hits_asm_branchless32>), "AVX2B ASM branchless 32b", dummy, avx2b_aux32, query_elem);
@@ -544,7 +611,10 @@ void demo_random(size_t N, size_t length, size_t array_count, size_t threshold)
 #ifdef __AVX512F__
   BENCH_LOOP(bitscan_avx512,  "bitscan_avx512", dummy, bitscan_aux32, query_elem);
   BENCH_LOOP(bitscan_avx512_asm,  "bitscan_avx512_asm", dummy, bitscan_aux32, query_elem);
+  BENCH_LOOP(bitscan_avx512,  "bitscan_avx512 8b", dummy, bitscan_aux8, query_elem);
   BENCH_LOOP(fastscancount_avx512, "AVX512-based scancount", elapsed_avx512, range_size_avx512, range_ptrs);
+  BENCH_LOOP((fastscancount_avx2b<uint16_t, fastscancount::record_hits_avx512<uint16_t>>), "AVX2B AVX-512 scatter 16b", dummy, avx2b_aux16, query_elem);
+  BENCH_LOOP((hybrid_scancount<uint16_t, fastscancount::record_hits_asm_branchy16, bitscan_avx512<uint32_t>>), "hybrid bitscan/AVX2B", dummy, hybrid_aux16, query_elem);
 #endif
 
   std::cout << std::fixed;
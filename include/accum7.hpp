@@ -1,12 +1,14 @@
 #ifndef ACCUM7_H_
 #define ACCUM7_H_
 
+#include "common.h"
 #include "compressed-bitmap.hpp"
 
 #include <array>
 #include <vector>
 
 namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
 
 template <typename T, typename B>
 struct traits_base {
@@ -72,6 +74,7 @@ class accumulator {
 
 public:
     static constexpr size_t max = (size_t)1 << B;
+    static constexpr size_t bit_count = B;
 
     accumulator(size_t initial = 0) : bits{}, sat{} {
         T ones = traits::not_(T{});
@@ -182,10 +185,18 @@ public:
         return ret;
     }
 
-    T get_saturated() {
+    T get_saturated() const {
         return sat;
     }
 
+    /**
+     * The bit planes of the counters: bit b of every counter is in element b.
+     * Once a counter saturates its bits keep counting (mod 2^B).
+     */
+    const std::array<T,B>& get_bits() const {
+        return bits;
+    }
+
     void operator=(const this_t& rhs) {
         for (size_t b = 0; b < bits.size(); b++) {
             bits[b] = rhs.bits[b];
@@ -194,6 +205,7 @@ public:
     }
 };
 
-}
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
 
 #endif
@@ -0,0 +1,143 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include "common.h"
+
+#include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+#include <sys/mman.h>
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+/**
+ * One contiguous region of memory holding a whole index, e.g., the rewritten data
+ * and aux tables of all the arrays for the AVX2B algorithm, rather than a few
+ * allocations per array. Blocks are placed at offsets worked out before the arena
+ * is allocated, each aligned to alignment bytes.
+ *
+ * The region is backed by 2 MB pages if possible: explicit huge pages (MAP_HUGETLB)
+ * if the system has reserved some, otherwise transparent huge pages (MADV_HUGEPAGE),
+ * so touching many arrays during a query needs few dTLB entries. Everything is
+ * freed at once when the arena is destroyed.
+ *
+ * An arena can be moved but not copied, and moving it doesn't move the memory, so
+ * pointers into it stay valid.
+ */
+class index_arena {
+public:
+  static constexpr size_t alignment = 64;
+  static constexpr size_t huge_page_size = size_t{2} << 20;
+
+  /* how the memory of an arena is backed */
+  enum class backing { none, huge_pages, transparent_huge_pages, normal_pages };
+
+  index_arena() = default;
+
+  /* allocate an arena of the given size, which is zero filled */
+  explicit index_arena(size_t size) : bytes{size} {
+    if (size == 0) {
+      return;
+    }
+#ifdef MAP_HUGETLB
+    if (size >= huge_page_size) {
+      mapped = round_up(size, huge_page_size);
+      void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        base = static_cast<char*>(p);
+        how = backing::huge_pages;
+        return;
+      }
+    }
+#endif
+    // transparent huge pages need 2 MB aligned addresses, so map an extra huge page
+    // and trim the ends, unless the arena is too small for huge pages anyway
+    const size_t slop = size >= huge_page_size ? huge_page_size : 0;
+    mapped = round_up(size, slop ? huge_page_size : 4096) + slop;
+    void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    base = static_cast<char*>(p);
+    how = backing::normal_pages;
+    if (slop) {
+      char* aligned = reinterpret_cast<char*>(round_up(reinterpret_cast<uintptr_t>(base), huge_page_size));
+      const size_t head = aligned - base, tail = slop - head;
+      if (head) {
+        munmap(base, head);
+      }
+      if (tail) {
+        munmap(aligned + mapped - slop, tail);
+      }
+      base = aligned;
+      mapped -= slop;
+#ifdef MADV_HUGEPAGE
+      if (madvise(base, mapped, MADV_HUGEPAGE) == 0) {
+        how = backing::transparent_huge_pages;
+      }
+#endif
+    }
+  }
+
+  index_arena(const index_arena&) = delete;
+  index_arena& operator=(const index_arena&) = delete;
+
+  index_arena(index_arena&& o) noexcept { swap(o); }
+
+  index_arena& operator=(index_arena&& o) noexcept {
+    index_arena old{std::move(o)};
+    swap(old);
+    return *this;
+  }
+
+  ~index_arena() {
+    if (base) {
+      munmap(base, mapped);
+    }
+  }
+
+  /* the offset to place a block at which starts at or after offset, see alignment */
+  static size_t align(size_t offset) {
+    return round_up(offset, alignment);
+  }
+
+  /* a pointer to the block at the given offset */
+  template <typename U>
+  U* at(size_t offset) const {
+    assert(offset % alignof(U) == 0);
+    assert(offset <= bytes);
+    return reinterpret_cast<U*>(base + offset);
+  }
+
+  size_t size() const { return bytes; }
+
+  backing get_backing() const { return how; }
+
+private:
+  static size_t round_up(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+  }
+
+  void swap(index_arena& o) noexcept {
+    std::swap(base, o.base);
+    std::swap(bytes, o.bytes);
+    std::swap(mapped, o.mapped);
+    std::swap(how, o.how);
+  }
+
+  char* base = nullptr;
+  size_t bytes = 0;
+  /* the size of the mapping, rounded up to whole pages */
+  size_t mapped = 0;
+  backing how = backing::none;
+};
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
+
+#endif
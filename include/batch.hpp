@@ -0,0 +1,168 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "query-context.hpp"
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+/**
+ * A fixed pool of worker threads, each optionally pinned to its own CPU and
+ * each owning a query_context which is reused across all the tasks it runs.
+ */
+class worker_pool {
+public:
+  using task_fn = std::function<void(size_t index, query_context& ctx)>;
+
+  explicit worker_pool(size_t thread_count = std::thread::hardware_concurrency(), bool pin = true);
+
+  ~worker_pool();
+
+  worker_pool(const worker_pool&) = delete;
+  worker_pool& operator=(const worker_pool&) = delete;
+
+  size_t size() const {
+    return workers.size();
+  }
+
+  /**
+   * Call task(i, ctx) for every i in [0, count), spreading the calls across
+   * the workers, and return when all calls have finished. If any call throws,
+   * the first exception is rethrown here once all workers are done.
+   */
+  void run(size_t count, const task_fn& task);
+
+  /**
+   * A lazily created pool with one pinned worker per hardware thread.
+   */
+  static worker_pool& default_pool();
+
+private:
+  void worker_loop(size_t id, bool pin);
+
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<query_context>> contexts;
+
+  std::mutex run_mutex; // serializes calls to run()
+  std::mutex mutex;     // protects the fields below
+  std::condition_variable work_cv, done_cv;
+  const task_fn* task = nullptr;
+  size_t task_count = 0;
+  size_t generation = 0;
+  size_t active = 0;
+  bool stopping = false;
+  std::exception_ptr error;
+
+  std::atomic<size_t> next{0};
+};
+
+/**
+ * An engine runs one query, writing the hits to out using the scratch memory
+ * in ctx.
+ */
+using batch_engine = std::function<void(const std::vector<uint32_t>& query, uint8_t threshold,
+                                        std::vector<uint32_t>& out, query_context& ctx)>;
+
+/**
+ * Run a batch of queries on the given pool, returning the hits for each query,
+ * in the same order as the queries. The i-th query uses thresholds[i].
+ *
+ * Queries which are identical (the same arrays, in any order, and the same
+ * threshold) are only computed once.
+ */
+std::vector<std::vector<uint32_t>> scancount_batch(worker_pool& pool,
+                                                   const std::vector<std::vector<uint32_t>>& queries,
+                                                   const std::vector<uint8_t>& thresholds,
+                                                   const batch_engine& engine);
+
+/**
+ * As above, using the default pool.
+ */
+inline std::vector<std::vector<uint32_t>> scancount_batch(const std::vector<std::vector<uint32_t>>& queries,
+                                                          const std::vector<uint8_t>& thresholds,
+                                                          const batch_engine& engine) {
+  return scancount_batch(worker_pool::default_pool(), queries, thresholds, engine);
+}
+
+/**
+ * An engine which runs the AVX2B algorithm with kernel K over the given aux data,
+ * which must outlive the engine.
+ */
+template <typename T, kernel_fn<T> K>
+batch_engine avx2b_engine(const implb::all_aux_t<T>& aux) {
+  return [&aux](const std::vector<uint32_t>& query, uint8_t threshold,
+                std::vector<uint32_t>& out, query_context& ctx) {
+    fastscancount_avx2b<T, K>({}, out, threshold, aux, query, ctx);
+  };
+}
+
+/**
+ * A version of the AVX2B algorithm which splits the chunks of a single query into
+ * range_count contiguous ranges and counts them as tasks on the given pool. Each
+ * task builds the aux data for its own range (and the chunk before it, for its
+ * overshoot) and counts it with the scratch memory of the worker running it, so
+ * nothing is set up per query but the output of each range. The per-range results
+ * are concatenated in order, so the output is the same as the single-threaded
+ * version.
+ *
+ * This must not be called from a task running on the same pool.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b_parallel(const data_ptrs &, std::vector<uint32_t> &out,
+                                  uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                                  const std::vector<uint32_t>& query, size_t range_count,
+                                  worker_pool& pool) {
+
+  out.clear();
+
+  // the chunks which the query's arrays span, as dynamic_aux::build works out
+  uint32_t largest = 0;
+  for (auto q : query) {
+    largest = std::max(largest, all_aux_info.aux_data.at(q).largest);
+  }
+  const size_t chunk_count = div_up(largest + 1, (uint32_t)all_aux_info.chunk_size);
+  range_count = std::max((size_t)1, std::min(range_count, chunk_count));
+
+  // the first range goes straight to out
+  std::vector<std::vector<uint32_t>> range_out(range_count - 1);
+  pool.run(range_count, [&](size_t r, query_context& ctx) {
+    _mm256_zeroupper();
+    const size_t start_chunk = chunk_count * r / range_count, end_chunk = chunk_count * (r + 1) / range_count;
+    auto& dyn_aux = ctx.dyn_aux<T>();
+    dyn_aux.build(all_aux_info, query, start_chunk ? start_chunk - 1 : 0, end_chunk);
+    assert(dyn_aux.chunk_count() == chunk_count);
+    auto& rout = r == 0 ? out : range_out[r - 1];
+    fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, rout, threshold, start_chunk, end_chunk, ctx.avx2b);
+  });
+
+  for (auto& rout : range_out) {
+    out.insert(out.end(), rout.begin(), rout.end());
+  }
+}
+
+/**
+ * As above, using the default pool.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b_parallel(const data_ptrs &data, std::vector<uint32_t> &out,
+                                  uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                                  const std::vector<uint32_t>& query, size_t range_count) {
+  fastscancount_avx2b_parallel<T, K>(data, out, threshold, all_aux_info, query, range_count,
+                                     worker_pool::default_pool());
+}
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
+
+#endif
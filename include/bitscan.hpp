@@ -8,6 +8,8 @@
 
 #include <stddef.h>
 #include <inttypes.h>
+#include <any>
+#include <array>
 #include <vector>
 #include <bitset>
 
@@ -15,12 +17,26 @@
 
 
 namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+#ifndef CHUNKS_PER_PASS
+#define CHUNKS_PER_PASS 512
+#endif
 
 template <typename T>
 struct bitscan_all_aux {
   uint32_t largest; // the largest value found in any array
   std::vector<compressed_bitmap<T>> bitmaps;
 
+  /*
+   * Tuning knobs, which don't affect the results and can be changed between queries:
+   * the number of chunks counted in each pass over the query's arrays (which sets the
+   * size of the accumulator array), and how far ahead of the current element, in bytes,
+   * the element arrays are prefetched. The asm kernels use their own fixed prefetch.
+   */
+  size_t chunks_per_pass = CHUNKS_PER_PASS;
+  size_t prefetch_distance = 256;
+
   bitscan_all_aux(uint32_t largest) : largest{largest} {}
 
   size_t get_chunk_count() const {
@@ -29,6 +45,29 @@ struct bitscan_all_aux {
 };
 
 
+/* the widest accumulators the bitscan functions use, enough for any uint8_t threshold */
+constexpr size_t bitscan_max_width = 8;
+
+/**
+ * Scratch memory for the bitscan functions, kept across queries to avoid allocating
+ * it every time: see query_context. The type of the accumulators depends on the
+ * instruction set and on their width, which depends on the threshold, so there is
+ * one vector of them for each width.
+ */
+template <typename T>
+struct bitscan_scratch {
+  std::vector<const compressed_bitmap<T>*> bitmaps;
+  std::vector<const T*> eptrs;
+  std::array<std::any, bitscan_max_width + 1> accums;
+
+  /* the accumulators of type A, which are width bits wide */
+  template <typename A>
+  std::vector<A>& accums_for(size_t width) {
+    auto ret = std::any_cast<std::vector<A>>(&accums.at(width));
+    return ret ? *ret : accums[width].template emplace<std::vector<A>>();
+  }
+};
+
 template <typename T>
 HEDLEY_NEVER_INLINE
 bitscan_all_aux<T> get_all_aux_bitscan(const all_data& data) {
@@ -136,6 +175,114 @@ void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out,
                 uint8_t threshold, const bitscan_all_aux<T>& aux_info,
                 const std::vector<uint32_t>& query);
 
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i]
+ * is the count for out[i]. The same goes for the other bitscan functions which
+ * take a counts argument.
+ */
+template <typename T>
+void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query);
+
+/**
+ * As above, but only return the hits in [lo, hi). Only the chunks which overlap
+ * the window are counted, and the hits are trimmed to the window at either end.
+ * The same goes for the other bitscan functions which take lo and hi.
+ */
+template <typename T>
+void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template <typename T>
+void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                bitscan_scratch<T>& scratch);
+
+#ifdef __AVX2__
+
+/** a 512-bit chunk as a pair of AVX2 vectors */
+struct m256x2 {
+    __m256i lo, hi;
+};
+
+inline void store(void *p, m256x2 v) {
+    _mm256_storeu_si256(static_cast<__m256i *>(p), v.lo);
+    _mm256_storeu_si256(static_cast<__m256i *>(p) + 1, v.hi);
+}
+
+/**
+ * The bitscan algorithm using AVX2 only: each chunk is handled as two 256-bit
+ * halves.
+ */
+template <typename T>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query);
+
+/* as above, using the given scratch memory rather than allocating it */
+template <typename T>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, bitscan_scratch<T>& scratch);
+
+template <typename T>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template <typename T>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template <typename T>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                bitscan_scratch<T>& scratch);
+
+struct m256_traits : traits_base<m256x2, m256_traits> {
+    using T = m256x2;
+
+    static T xor_(const T& l, const T& r) {
+        return {_mm256_xor_si256(l.lo, r.lo), _mm256_xor_si256(l.hi, r.hi)};
+    }
+
+    static T and_(const T& l, const T& r) {
+        return {_mm256_and_si256(l.lo, r.lo), _mm256_and_si256(l.hi, r.hi)};
+    }
+
+    static T or_(const T& l, const T& r) {
+        return {_mm256_or_si256(l.lo, r.lo), _mm256_or_si256(l.hi, r.hi)};
+    }
+
+    static T not_(const T& v) {
+        auto ones = _mm256_set1_epi32(-1);
+        return {_mm256_xor_si256(v.lo, ones), _mm256_xor_si256(v.hi, ones)};
+    }
+
+    static bool test(const T& v, size_t idx) {
+        fastbitset<512> bitset;
+        fastscancount::store(&bitset, v);
+        return bitset.test(idx);
+    }
+
+    static size_t size() {
+        return 512;
+    }
+
+    static bool zero(const T& v) {
+        auto both = _mm256_or_si256(v.lo, v.hi);
+        return _mm256_testz_si256(both, both);
+    }
+
+    // add2 and add3 (the carry-save adders) come from traits_base
+};
+#endif
+
 #ifdef __AVX512F__
 
 inline fastbitset<512> to_bitset(__m512i v) {
@@ -150,10 +297,40 @@ void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
                 uint8_t threshold, const bitscan_all_aux<T>& aux_info,
                 const std::vector<uint32_t>& query);
 
+/* as above, using the given scratch memory rather than allocating it */
+template <typename T>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, bitscan_scratch<T>& scratch);
+
+template <typename T>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template <typename T>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template <typename T>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<T>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                bitscan_scratch<T>& scratch);
+
 void bitscan_avx512_asm(const data_ptrs &, std::vector<uint32_t> &out,
         uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
         const std::vector<uint32_t>& query);
 
+void bitscan_avx512_asm(const data_ptrs &, std::vector<uint32_t> &out,
+        uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+        const std::vector<uint32_t>& query, bitscan_scratch<uint32_t>& scratch);
+
+void bitscan_avx512_asm(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+        uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+        const std::vector<uint32_t>& query);
+
 struct m512_traits {
     using T = __m512i;
 
@@ -214,6 +391,7 @@ struct m512_traits {
 
 
 
+} // namespace FASTSCANCOUNT_ISA
 } // namespace fastscancount
 
 
@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <stddef.h>
 
+#include <algorithm>
 #include <vector>
 
 // #define DEBUGB 1
@@ -14,10 +16,32 @@
 #define DBG(...)
 #endif
 
+/*
+ * The engines in dispatch.hpp are each built with the flags for their own instruction
+ * set, so the inline functions and templates in the algorithm headers are compiled
+ * several times, with different flags, into different object files. The headers put
+ * them in an inline namespace named by FASTSCANCOUNT_ISA, which the Makefile sets for
+ * each engine's files (e.g., fastscancount::avx2), so the copies have different names
+ * and the linker can't pick the wrong one. The Makefile does the same for the copies
+ * of anything from other headers, e.g., std::vector, with isa-rename.sh. Everything
+ * else is built for MARCH, in fastscancount::march.
+ */
+#ifndef FASTSCANCOUNT_ISA
+#define FASTSCANCOUNT_ISA march
+#endif
+
 using data_array = std::vector<uint32_t>;
 using all_data = std::vector<data_array>;
 using data_ptrs = std::vector<const data_array *>;
 
+/* an element and the number of arrays it occurs in */
+struct scored_hit {
+  uint32_t id;
+  uint32_t count;
+
+  bool operator==(const scored_hit& o) const { return id == o.id && count == o.count; }
+};
+
 /* calculates p / q, rounded up, both p and q must be non-negative */
 template <typename T>
 inline T div_up(T p, T q) {
@@ -58,6 +82,15 @@ static inline uint32_t get_smallest_max(const std::vector<std::vector<uint32_t>>
   return smallest;
 }
 
+/**
+ * Remove the hits from out[begin, end) which are outside [lo, hi), where the
+ * hits in that part of out are in increasing order.
+ */
+inline void trim_hits(std::vector<uint32_t>& out, size_t begin, uint32_t lo, uint32_t hi) {
+  out.erase(std::lower_bound(out.begin() + begin, out.end(), hi), out.end());
+  out.erase(out.begin() + begin, std::lower_bound(out.begin() + begin, out.end(), lo));
+}
+
 template <typename T>
 struct minispan {
   T* begin;
@@ -68,6 +101,11 @@ struct minispan {
     return begin[i];
   }
 
+  T& operator[](size_t i) {
+    assert(i < size());
+    return begin[i];
+  }
+
   size_t size() const { return size_; }
 
   template <typename C>
@@ -76,6 +114,17 @@ struct minispan {
   }
 };
 
+/**
+ * Resize v to at least n elements, but never shrink it, so that scratch memory
+ * reused across queries only allocates while it grows.
+ */
+template <typename V>
+inline void grow(V& v, size_t n) {
+  if (v.size() < n) {
+    v.resize(n);
+  }
+}
+
 /**
  * Return the alignmetn of the given pointer, i.e,. the largest power
  * of which the address is a multiple.
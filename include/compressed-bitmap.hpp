@@ -3,6 +3,7 @@
 
 #include "fastbitset.hpp"
 #include "hedley.h"
+#include "simd-support.hpp"
 
 #include <immintrin.h>
 #include <inttypes.h>
@@ -19,6 +20,11 @@ template<> struct control_for<uint32_t> { using type = uint16_t; };
 
 /**
  * Compressed bitmap using T as the element type.
+ *
+ * Each 512-bit chunk is split into sizeof(T) * 8 bit subchunks: the control word
+ * for the chunk has a bit set for each non-empty subchunk, and only the non-empty
+ * subchunks are stored in elements. Byte elements (with 64-bit control words)
+ * are smaller for sparse data, where most non-empty subchunks have a single bit.
  */
 template <typename T>
 struct compressed_bitmap {
@@ -33,6 +39,10 @@ struct compressed_bitmap {
     std::vector<control_type> control;
     std::vector<T> elements;
 
+    /* the index in elements of the first element of every offset_stride-th chunk */
+    static constexpr size_t offset_stride = 64;
+    std::vector<uint32_t> chunk_offsets;
+
     compressed_bitmap(const std::vector<uint32_t>& array, uint32_t largest = -1);
 
     /**
@@ -56,6 +66,46 @@ struct compressed_bitmap {
 
     chunk_type expand(size_t idx, const T*& eptr) const;
 
+    /**
+     * The index in elements of the first element of the given chunk, i.e., where
+     * an element pointer should start to expand chunks from idx onwards.
+     */
+    size_t element_offset(size_t idx) const {
+        assert(idx < chunk_count());
+        size_t offset = chunk_offsets[idx / offset_stride];
+        for (size_t c = idx - idx % offset_stride; c < idx; c++) {
+            offset += __builtin_popcountl(control[c]);
+        }
+        return offset;
+    }
+
+#ifdef __AVX2__
+    /**
+     * Expand one chunk into its low and high 256-bit halves, given its index and an
+     * element pointer (which will be updated by this call).
+     */
+    HEDLEY_ALWAYS_INLINE
+    void expand256(size_t idx, const T*& eptr, __m256i& lo, __m256i& hi) const {
+        assert(idx < chunk_count());
+        assert(eptr >= elements.data());
+        if constexpr (sizeof(T) == 4) {
+            assert(eptr + 16 <= elements.data() + elements.capacity());
+            uint32_t mask = control[idx];
+            uint32_t lo_mask = mask & 0xFF, hi_mask = mask >> 8;
+            lo = expand_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(eptr)), lo_mask);
+            eptr += __builtin_popcount(lo_mask);
+            hi = expand_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(eptr)), hi_mask);
+            eptr += __builtin_popcount(hi_mask);
+        } else {
+            // no cheap byte expand in AVX2, so go through the scalar version
+            auto chunk = expand(idx, eptr);
+            static_assert(sizeof(chunk) == 2 * sizeof(__m256i));
+            lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&chunk));
+            hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&chunk) + 1);
+        }
+    }
+#endif
+
 #ifdef __AVX512F__
     /**
      * Expand one chunk given its index and an element pointer (which will be udpated by this call).
@@ -70,11 +120,26 @@ struct compressed_bitmap {
         //             elements.data() + elements.size(), elements.data() + elements.capacity());
         //     assert(false);
         // }
-        auto mask = _load_mask16(const_cast<control_type *>(control.data()) + idx);
-        auto data = _mm512_loadu_si512(eptr);
-        auto expanded = _mm512_maskz_expand_epi32(mask, data);
-        eptr += __builtin_popcountl(mask);
-        return expanded;
+        if constexpr (sizeof(T) == 1) {
+#ifdef __AVX512VBMI2__
+            __mmask64 mask = control[idx];
+            auto data = _mm512_loadu_si512(eptr);
+            auto expanded = _mm512_maskz_expand_epi8(mask, data);
+            eptr += __builtin_popcountl(mask);
+            return expanded;
+#else
+            // no byte expand without VBMI2, so go through the scalar version
+            auto chunk = expand(idx, eptr);
+            static_assert(sizeof(chunk) == sizeof(__m512i));
+            return _mm512_loadu_si512(&chunk);
+#endif
+        } else {
+            auto mask = _load_mask16(const_cast<control_type *>(control.data()) + idx);
+            auto data = _mm512_loadu_si512(eptr);
+            auto expanded = _mm512_maskz_expand_epi32(mask, data);
+            eptr += __builtin_popcountl(mask);
+            return expanded;
+        }
     }
 #endif
 
@@ -0,0 +1,242 @@
+#ifndef COUNT_PLANES_H_
+#define COUNT_PLANES_H_
+
+#include "arena.hpp"
+#include "common.h"
+#include "hedley.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <immintrin.h>
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+/**
+ * Precomputed counters for a group of arrays which are often queried together, e.g.,
+ * a fixed set of base terms which most queries add a few terms to, laid out in the
+ * same chunks as the AVX2B aux data.
+ *
+ * For each chunk where any array of the group has elements, the plane for the chunk
+ * holds the number of arrays of the group containing each element of the chunk's
+ * range, one byte per element. A query containing the whole group then adds the plane
+ * to its counters at the start of each chunk rather than counting the group's arrays,
+ * see fastscancount_avx2b_planes.
+ *
+ * A plane takes a byte per element of the domain for each chunk the group spans, so
+ * planes only pay off for groups whose arrays are dense and often queried.
+ */
+struct count_planes {
+  /* no plane for this chunk, since the group has no elements in it */
+  static constexpr uint32_t no_plane = std::numeric_limits<uint32_t>::max();
+
+  /* the arrays in the group, sorted */
+  std::vector<uint32_t> group;
+
+  /* the largest element of any array in the group */
+  uint32_t largest;
+
+  size_t chunk_size;
+
+  /* for each chunk, the index of its plane, or no_plane */
+  std::vector<uint32_t> plane_index;
+
+  /* for each chunk, the number of arrays of the group with elements in its range */
+  std::vector<uint32_t> chunk_bound;
+
+  /* for each chunk, the total number of elements of the group in its range */
+  std::vector<uint32_t> chunk_elements;
+
+  /* the planes, each chunk_size bytes */
+  index_arena planes;
+
+  size_t chunk_count() const {
+    return plane_index.size();
+  }
+
+  const uint8_t* plane(size_t chunk) const {
+    assert(plane_index[chunk] != no_plane);
+    return planes.at<uint8_t>(plane_index[chunk] * chunk_size);
+  }
+
+  /* add the counts for the given chunk to counters, which holds its first counter */
+  template <typename C>
+  HEDLEY_ALWAYS_INLINE
+  void add_to(size_t chunk, C* counters) const {
+    if (plane_index[chunk] == no_plane) {
+      return;
+    }
+    const uint8_t* p = plane(chunk);
+    for (size_t i = 0; i < chunk_size; i += 32) {
+      __m256i counts = _mm256_load_si256((const __m256i *)(p + i));
+      if constexpr (sizeof(C) == 1) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(counters + i));
+        _mm256_storeu_si256((__m256i *)(counters + i), _mm256_add_epi8(c, counts));
+      } else {
+        static_assert(sizeof(C) == 2, "8 or 16-bit counters");
+        __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(counts));
+        __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(counts, 1));
+        __m256i c0 = _mm256_loadu_si256((const __m256i *)(counters + i));
+        __m256i c1 = _mm256_loadu_si256((const __m256i *)(counters + i + 16));
+        _mm256_storeu_si256((__m256i *)(counters + i), _mm256_add_epi16(c0, lo));
+        _mm256_storeu_si256((__m256i *)(counters + i + 16), _mm256_add_epi16(c1, hi));
+      }
+    }
+  }
+};
+
+/**
+ * Build the planes for the given group of arrays of data, with the chunk size of the
+ * AVX2B aux data they will be used with. The group must have between 2 and 255 arrays.
+ */
+HEDLEY_NEVER_INLINE
+inline count_planes get_count_planes(const all_data& data, std::vector<uint32_t> group,
+                                     size_t chunk_size) {
+  if (chunk_size == 0 || chunk_size % 64 != 0) {
+    throw std::invalid_argument("bad AVX2B chunk size " + std::to_string(chunk_size));
+  }
+  std::sort(group.begin(), group.end());
+  group.erase(std::unique(group.begin(), group.end()), group.end());
+  if (group.size() < 2 || group.size() > std::numeric_limits<uint8_t>::max()) {
+    throw std::invalid_argument("bad group size " + std::to_string(group.size()));
+  }
+  if (group.back() >= data.size()) {
+    throw std::invalid_argument("no array " + std::to_string(group.back()));
+  }
+
+  count_planes ret;
+  ret.chunk_size = chunk_size;
+  ret.largest = 0;
+  const size_t chunk_count = div_up(get_largest(data) + 1, (uint32_t)chunk_size);
+  ret.chunk_bound.assign(chunk_count, 0);
+  ret.chunk_elements.assign(chunk_count, 0);
+  for (auto a : group) {
+    uint32_t last_chunk = -1;
+    for (auto e : data[a]) {
+      uint32_t chunk = e / chunk_size;
+      ret.chunk_bound[chunk] += chunk != last_chunk;
+      ret.chunk_elements[chunk]++;
+      last_chunk = chunk;
+    }
+    if (!data[a].empty()) {
+      ret.largest = std::max(ret.largest, data[a].back());
+    }
+  }
+
+  uint32_t plane_count = 0;
+  ret.plane_index.resize(chunk_count);
+  for (size_t c = 0; c < chunk_count; c++) {
+    ret.plane_index[c] = ret.chunk_elements[c] ? plane_count++ : count_planes::no_plane;
+  }
+
+  // the arena is zero filled
+  ret.planes = index_arena{plane_count * chunk_size};
+  for (auto a : group) {
+    for (auto e : data[a]) {
+      uint32_t chunk = e / chunk_size;
+      ret.planes.at<uint8_t>(ret.plane_index[chunk] * chunk_size)[e % chunk_size]++;
+    }
+  }
+
+  ret.group = std::move(group);
+  return ret;
+}
+
+/**
+ * The planes of the largest group which sorted_query contains, or null if it
+ * contains none of them.
+ */
+inline const count_planes* find_planes(const std::vector<count_planes>& planes,
+                                       const std::vector<uint32_t>& sorted_query) {
+  const count_planes* ret = nullptr;
+  for (auto& p : planes) {
+    if ((!ret || p.group.size() > ret->group.size())
+        && std::includes(sorted_query.begin(), sorted_query.end(), p.group.begin(), p.group.end())) {
+      ret = &p;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Find groups of arrays worth building planes for in a log of queries: a group is
+ * the largest set of arrays contained in at least min_share of the queries, found
+ * greedily by adding the most frequent arrays first. Each further group is found the
+ * same way among the queries which don't contain the earlier ones, up to max_groups
+ * groups with at least min_size arrays each.
+ */
+inline std::vector<std::vector<uint32_t>> find_hot_groups(const std::vector<std::vector<uint32_t>>& log,
+                                                          double min_share, size_t max_groups,
+                                                          size_t min_size = 4) {
+  std::vector<std::vector<uint32_t>> queries;
+  for (auto& q : log) {
+    queries.push_back(q);
+    std::sort(queries.back().begin(), queries.back().end());
+  }
+  const size_t min_count = std::max<size_t>(1, min_share * log.size());
+
+  std::vector<std::vector<uint32_t>> groups;
+  while (groups.size() < max_groups && queries.size() >= min_count) {
+    std::vector<std::pair<size_t, uint32_t>> freq; // (count, array)
+    {
+      std::vector<uint32_t> all;
+      for (auto& q : queries) {
+        // each query counts once for each array, even if it has it more than once
+        std::unique_copy(q.begin(), q.end(), std::back_inserter(all));
+      }
+      std::sort(all.begin(), all.end());
+      for (size_t i = 0, j; i < all.size(); i = j) {
+        for (j = i; j < all.size() && all[j] == all[i]; j++) {}
+        if (j - i >= min_count) {
+          freq.push_back({j - i, all[i]});
+        }
+      }
+      std::sort(freq.begin(), freq.end(), [](auto& a, auto& b) { return a.first > b.first; });
+    }
+
+    // the queries which contain the group so far
+    std::vector<const std::vector<uint32_t>*> containing;
+    for (auto& q : queries) {
+      containing.push_back(&q);
+    }
+    std::vector<uint32_t> group;
+    for (auto& f : freq) {
+      if (group.size() == std::numeric_limits<uint8_t>::max()) {
+        break;
+      }
+      std::vector<const std::vector<uint32_t>*> next;
+      for (auto q : containing) {
+        if (std::binary_search(q->begin(), q->end(), f.second)) {
+          next.push_back(q);
+        }
+      }
+      if (next.size() >= min_count) {
+        group.push_back(f.second);
+        containing.swap(next);
+      }
+    }
+
+    if (group.size() < min_size) {
+      break;
+    }
+    std::sort(group.begin(), group.end());
+    queries.erase(std::remove_if(queries.begin(), queries.end(), [&](auto& q) {
+      return std::includes(q.begin(), q.end(), group.begin(), group.end());
+    }), queries.end());
+    groups.push_back(std::move(group));
+  }
+  return groups;
+}
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef DISPATCH_H_
+#define DISPATCH_H_
+
+#include "common.h"
+
+#include <memory>
+#include <vector>
+
+namespace fastscancount {
+
+struct merge_scratch;
+struct pigeonhole_scratch;
+
+/* the instruction sets we have engines for, from least to most capable */
+enum class isa { scalar, avx2, avx512, avx512vbmi2 };
+
+const char* isa_name(isa target);
+
+/**
+ * The most capable instruction set the running CPU (and OS) supports, using cpuid.
+ */
+isa detect_isa();
+
+/**
+ * The tuning parameters of the engines. Each engine only uses some of them and
+ * leaves the others 0.
+ */
+struct tuning {
+  /* the AVX2B chunk size, in elements */
+  size_t chunk_size;
+  /* the bitscan chunks per pass */
+  size_t chunks_per_pass;
+  /* how far ahead the bitscan loop or the AVX2B kernels prefetch, in bytes */
+  size_t prefetch_distance;
+
+  bool operator==(const tuning& o) const {
+    return chunk_size == o.chunk_size && chunks_per_pass == o.chunks_per_pass
+        && prefetch_distance == o.prefetch_distance;
+  }
+};
+
+/**
+ * A scancount engine over a fixed set of arrays, compiled for one instruction set.
+ *
+ * Each engine is built in its own object file with the flags for its instruction set
+ * (see the Makefile), so one binary can hold engines for several instruction sets and
+ * pick one at runtime with make_engine. An engine keeps scratch memory across queries,
+ * so it must only be used by one thread at a time, and once it has seen queries as large
+ * as the ones it gets it runs them without allocating.
+ *
+ * All the engines count in chunks, so sparse queries over a large domain are routed
+ * to merge_scancount instead, see prefer_merge, and queries where a few short arrays
+ * bound the hits to pigeonhole_scancount, see prefer_pigeonhole.
+ */
+class engine {
+public:
+  engine();
+  virtual ~engine();
+
+  /* the instruction set this engine was compiled for */
+  virtual isa target() const = 0;
+
+  virtual const char* name() const = 0;
+
+  /**
+   * Write the elements which occur in more than threshold of the arrays given by query
+   * (indexes into the data the engine was built for) to out, in increasing order.
+   */
+  virtual void scancount(const std::vector<uint32_t>& query, uint8_t threshold,
+                         std::vector<uint32_t>& out) = 0;
+
+  /**
+   * Precompute counts for groups of arrays which are often queried together, e.g.,
+   * found with find_hot_groups, replacing any earlier groups. Queries containing a
+   * group then don't count its arrays. Engines which can't do this ignore the groups.
+   */
+  virtual void set_hot_groups(const std::vector<std::vector<uint32_t>>&) {}
+
+  /* the current tuning parameters */
+  virtual tuning get_tuning() const { return {}; }
+
+  /**
+   * Change the tuning parameters, e.g., to ones found by autotune() earlier on the
+   * same host. Throws if this engine doesn't support them. Changing the AVX2B chunk
+   * size rebuilds the index, which is slow.
+   */
+  virtual void set_tuning(const tuning& t) { check_tuning(t); }
+
+  /* the small set of configurations autotune() chooses from */
+  virtual std::vector<tuning> tuning_candidates() const { return {get_tuning()}; }
+
+  /**
+   * Time each of the tuning_candidates() over the sample queries and keep the fastest,
+   * which is returned. Meant to be called once at startup with a sample of real
+   * queries, which should be large enough to take a few milliseconds.
+   */
+  virtual tuning autotune(const std::vector<std::vector<uint32_t>>& sample, uint8_t threshold);
+
+protected:
+  void check_tuning(const tuning& t) const;
+
+  /**
+   * If merge_scancount or pigeonhole_scancount is expected to be faster for this query
+   * than the engine's own algorithm, run it and return true.
+   */
+  bool route_sparse(const all_data& data, const std::vector<uint32_t>& query, uint8_t threshold,
+                    std::vector<uint32_t>& out);
+
+private:
+  data_ptrs sparse_ptrs;
+  /* pointers so this header needn't include merge.hpp and pigeonhole.hpp */
+  std::unique_ptr<merge_scratch> merge;
+  std::unique_ptr<pigeonhole_scratch> pigeonhole;
+};
+
+/**
+ * Make the engine for the given instruction set over data, which must outlive the engine.
+ * Throws if the running CPU doesn't support target.
+ */
+std::unique_ptr<engine> make_engine(const all_data& data, isa target);
+
+/**
+ * Make the fastest engine the running CPU supports.
+ */
+inline std::unique_ptr<engine> make_engine(const all_data& data) {
+  return make_engine(data, detect_isa());
+}
+
+/* the per-instruction set factories, each in its own object file */
+std::unique_ptr<engine> make_scalar_engine(const all_data& data);
+std::unique_ptr<engine> make_avx2_engine(const all_data& data);
+std::unique_ptr<engine> make_avx512_engine(const all_data& data);
+std::unique_ptr<engine> make_avx512vbmi2_engine(const all_data& data);
+
+} // namespace fastscancount
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdexcept>
 #include <string>
 #include <assert.h>
 
@@ -94,6 +95,15 @@ public:
         return ret;
     }
 
+    /**
+     * The count bits starting at from as an integer, for count smaller than the
+     * block size: the bits can't straddle a block boundary.
+     */
+    unsigned long extract(size_t from, size_t count) const {
+        assert(count < block_bits && from % count == 0);
+        return (block_at(from) >> (from % block_bits)) & ((((block_t)1) << count) - 1);
+    }
+
     template <size_t NEW>
     fastbitset<NEW> subset(size_t from) {
         assert(from % block_bits == 0);
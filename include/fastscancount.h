@@ -7,9 +7,12 @@
 #include <cstring>
 #include <vector>
 
+#include "scratch.hpp"
+
 // credit: implementation and design by Nathan Kurz and Daniel Lemire
 
 namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
 
 namespace {
 
@@ -49,32 +52,38 @@ uint32_t *natefastscancount_finalcheck(uint8_t *counters, size_t &it,
   it = i;
   return out;
 }
-} // namespace
 
-void fastscancount(const std::vector<const std::vector<uint32_t>*> &data,
-                   std::vector<uint32_t> &out, uint8_t threshold) {
+// if counts is not null, the final count for each hit is appended to it
+void fastscancount_impl(const std::vector<const std::vector<uint32_t>*> &data,
+                        std::vector<uint32_t> &out, std::vector<uint32_t> *counts,
+                        uint8_t threshold, scan_scratch &scratch) {
   size_t cache_size = 65536;
   size_t range = cache_size;
-  std::vector<uint8_t> counters(cache_size);
+  grow(scratch.counters, cache_size);
+  auto &counters = scratch.counters;
   size_t ds = data.size();
-  out.resize( 4 * range); // let us add lots of capacity
-  uint32_t *output = out.data();
-  uint32_t *initout = out.data();
-  std::vector<size_t> iters(ds);
+  // the hits go to a scratch buffer which keeps its size across queries, so it
+  // is only zero filled when it grows
+  auto &hits = scratch.hits;
+  grow(hits, 4 * range); // let us add lots of capacity
+  uint32_t *output = hits.data();
+  uint32_t *initout = hits.data();
+  scratch.iters.assign(ds, 0);
+  auto &iters = scratch.iters;
   size_t countsofar = 0;
   uint32_t largest = 0;
   for (size_t c = 0; c < ds; c++) {
-    if (largest < (*data[c])[data[c]->size() - 1])
-      largest = (*data[c])[data[c]->size() - 1];
+    if (!data[c]->empty() && largest < data[c]->back())
+      largest = data[c]->back();
   }
-  // we are assuming that all vectors in data are non-empty
-  for (size_t start = 0; start < largest; start += range) {
+  // empty arrays are skipped below, since they start out exhausted
+  for (size_t start = 0; start <= largest; start += range) {
     // make sure that the capacity is sufficient
     countsofar = output - initout;
-    if (out.size() - countsofar < range) {
-      out.resize(out.size() + 4 * range);
-      initout = out.data();
-      output = out.data() + countsofar;
+    if (hits.size() - countsofar < range) {
+      hits.resize(hits.size() + 4 * range);
+      initout = hits.data();
+      output = hits.data() + countsofar;
     }
     memset(counters.data(), 0, range);
     for (size_t c = 0; c < ds; c++) {
@@ -94,10 +103,51 @@ void fastscancount(const std::vector<const std::vector<uint32_t>*> &data,
       }
       iters[c] = it; // store it for next round
     }
+    if (counts) {
+      // hits are recorded when their counter reaches the threshold, so the
+      // final counts are only known once the whole range has been counted
+      for (uint32_t *hit = initout + countsofar; hit != output; hit++) {
+        counts->push_back(counters[*hit - start]);
+      }
+    }
   }
-  countsofar = output - initout;
-  out.resize(countsofar);
+  out.assign(initout, output);
+}
+} // namespace
+
+/**
+ * Uses the scratch memory given, which must not be used by another thread at the
+ * same time, rather than allocating it.
+ */
+void fastscancount(const std::vector<const std::vector<uint32_t>*> &data,
+                   std::vector<uint32_t> &out, uint8_t threshold, scan_scratch &scratch) {
+  fastscancount_impl(data, out, nullptr, threshold, scratch);
+}
+
+void fastscancount(const std::vector<const std::vector<uint32_t>*> &data,
+                   std::vector<uint32_t> &out, uint8_t threshold) {
+  scan_scratch scratch;
+  fastscancount(data, out, threshold, scratch);
+}
+
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i]
+ * is the count for out[i].
+ */
+void fastscancount(const std::vector<const std::vector<uint32_t>*> &data,
+                   std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                   uint8_t threshold, scan_scratch &scratch) {
+  counts.clear();
+  fastscancount_impl(data, out, &counts, threshold, scratch);
+}
+
+void fastscancount(const std::vector<const std::vector<uint32_t>*> &data,
+                   std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                   uint8_t threshold) {
+  scan_scratch scratch;
+  fastscancount(data, out, counts, threshold, scratch);
 }
+} // namespace FASTSCANCOUNT_ISA
 } // namespace fastscancount
 
 #endif
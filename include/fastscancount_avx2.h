@@ -15,7 +15,10 @@
 #include <cstring>
 #include <vector>
 
+#include "scratch.hpp"
+
 namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
 namespace impla {
 // credit: implementation and design by Travis Downs
 static inline size_t find_next_gt(uint8_t *array, const size_t size,
@@ -45,7 +48,7 @@ static inline size_t find_next_gt(uint8_t *array, const size_t size,
 
 void populate_hits_avx(std::vector<uint8_t> &counters, size_t range,
                        size_t threshold, size_t start,
-                       std::vector<uint32_t> &out) {
+                       std::vector<uint32_t> &out, std::vector<uint32_t> *counts) {
   uint8_t *array = counters.data();
   // printf("start: %zu end: %zu\n", start, start + range);
   size_t ro = range;
@@ -54,6 +57,9 @@ void populate_hits_avx(std::vector<uint8_t> &counters, size_t range,
     if (next == SIZE_MAX)
       break;
     out.push_back(start + next);
+    if (counts) {
+      counts->push_back(array[next]);
+    }
     range -= (next + 1);
     array += (next + 1);
     start += (next + 1);
@@ -77,27 +83,18 @@ void update_counters_final(const uint32_t *&it_, const uint32_t *end,
   }
   it_ = end;
 }
-} // namespace
-
-void fastscancount_avx2(const std::vector<const std::vector<uint32_t>*> &data,
-                        std::vector<uint32_t> &out, uint8_t threshold) {
 
-  using namespace impla;
+// if counts is not null, the count for each hit is appended to it
+void fastscancount_avx2_impl(const std::vector<const std::vector<uint32_t>*> &data,
+                             std::vector<uint32_t> &out, std::vector<uint32_t> *counts,
+                             uint8_t threshold, scan_scratch &scratch) {
   const size_t cache_size = 40000;
-  std::vector<uint8_t> counters(cache_size);
+  grow(scratch.counters, cache_size);
+  auto &counters = scratch.counters;
   out.clear();
-  const size_t dsize = data.size();
-
-  struct data_info {
-    const uint32_t *cur; // current pointer into data
-    const uint32_t *end; // pointer to end
-    uint32_t last;       // value of last element
-    data_info(const uint32_t *cur, const uint32_t *end, uint32_t last)
-        : cur{cur}, end{end}, last{last} {}
-  };
-
-  std::vector<data_info> iter_data;
-  iter_data.reserve(dsize);
+
+  auto &iter_data = scratch.cursors;
+  iter_data.clear();
   for (auto &d : data) {
     iter_data.emplace_back(d->data(), d->data() + d->size(), d->back());
   }
@@ -124,9 +121,44 @@ void fastscancount_avx2(const std::vector<const std::vector<uint32_t>*> &data,
       }
     }
 
-    populate_hits_avx(counters, cache_size, threshold, start, out);
+    populate_hits_avx(counters, cache_size, threshold, start, out, counts);
   }
 }
+} // namespace
+
+/**
+ * Uses the scratch memory given, which must not be used by another thread at the
+ * same time, rather than allocating it.
+ */
+void fastscancount_avx2(const std::vector<const std::vector<uint32_t>*> &data,
+                        std::vector<uint32_t> &out, uint8_t threshold, scan_scratch &scratch) {
+  impla::fastscancount_avx2_impl(data, out, nullptr, threshold, scratch);
+}
+
+void fastscancount_avx2(const std::vector<const std::vector<uint32_t>*> &data,
+                        std::vector<uint32_t> &out, uint8_t threshold) {
+  scan_scratch scratch;
+  fastscancount_avx2(data, out, threshold, scratch);
+}
+
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i]
+ * is the count for out[i].
+ */
+void fastscancount_avx2(const std::vector<const std::vector<uint32_t>*> &data,
+                        std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                        uint8_t threshold, scan_scratch &scratch) {
+  counts.clear();
+  impla::fastscancount_avx2_impl(data, out, &counts, threshold, scratch);
+}
+
+void fastscancount_avx2(const std::vector<const std::vector<uint32_t>*> &data,
+                        std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                        uint8_t threshold) {
+  scan_scratch scratch;
+  fastscancount_avx2(data, out, counts, threshold, scratch);
+}
 
+} // namespace FASTSCANCOUNT_ISA
 } // namespace fastscancount
 #endif
@@ -11,17 +11,24 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <stdexcept>
+#include <string>
 #include <type_traits>
 #include <vector>
 
 #include <stdio.h>
 
 #include "hedley.h"
+#include "arena.hpp"
 #include "common.h"
+#include "count-planes.hpp"
+#include "simd-support.hpp"
 
 template <typename T>
 void findM(T& t, const char *name) {
@@ -33,15 +40,26 @@ void findM(T& t, const char *name) {
 }
 
 namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
 // credit: implementation and design by Travis Downs
 
 
+/*
+ * The default chunk size, and the largest one the counters have room for: the
+ * aux data can be built with a smaller chunk size (see get_all_aux), which may
+ * suit CPUs with a smaller L1 or L2.
+ */
 constexpr size_t cache_size = 40000 / 64 * 64;
 constexpr size_t COUNTER_OFFSET = 64;
 constexpr size_t counters_size = COUNTER_OFFSET + cache_size * 2;
 
 static_assert(cache_size % 64 == 0, "should be a multiple of 64");
 
+/*
+ * The kernels' unroll factor, which the rewritten arrays are padded to a multiple of,
+ * so unlike the chunk size and the kernels' prefetch distance it can't be chosen at
+ * runtime. Must be equal to UNROLL in asm-kernels.asm.
+ */
 constexpr size_t unroll = 16;
 
 
@@ -107,13 +125,107 @@ static inline size_t find_next_gt2(uint8_t *array, const size_t size,
 HEDLEY_NEVER_INLINE
 static void populate_hits_avx(uint8_t *array, size_t range,
                        size_t threshold, size_t start,
-                       std::vector<uint32_t> &out) {
+                       std::vector<uint32_t> &out, std::vector<uint32_t> *counts = nullptr) {
   while (true) {
     size_t next = find_next_gt2(array, range, (uint8_t)threshold);
     if (next == SIZE_MAX)
       break;
     uint32_t hit = start + next;
     out.push_back(hit);
+    if (counts) {
+      counts->push_back(array[next]);
+    }
+    range -= (next + 1);
+    array += (next + 1);
+    start += (next + 1);
+  }
+}
+
+/**
+ * Like find_next_gt2, but for 16-bit counters. The comparison is unsigned, so the
+ * full range of threshold values works.
+ */
+static inline size_t find_next_gt16(uint16_t *array, const size_t size,
+                                    const uint16_t threshold) {
+  assert(threshold < UINT16_MAX);
+  size_t vsize = size / 32;
+  __m256i *varray = (__m256i *)array;
+  __m256i *varray_end = varray + vsize * 2;
+  // v > threshold is the same as max(v, threshold + 1) == v
+  const __m256i comprand = _mm256_set1_epi16(threshold + 1);
+  int bits = 0;
+
+  for (__m256i *p = varray; p != varray_end; p += 2) {
+    __m256i v0 = _mm256_loadu_si256(p);
+    __m256i v1 = _mm256_loadu_si256(p + 1);
+    __m256i cmp0 = _mm256_cmpeq_epi16(_mm256_max_epu16(v0, comprand), v0);
+    __m256i cmp1 = _mm256_cmpeq_epi16(_mm256_max_epu16(v1, comprand), v1);
+    // movemask gives us two bits per 16-bit element
+    if ((bits = _mm256_movemask_epi8(cmp0))) {
+      return (p - varray) * 16 + __builtin_ctz(bits) / 2;
+    }
+    if ((bits = _mm256_movemask_epi8(cmp1))) {
+      return (p - varray) * 16 + 16 + __builtin_ctz(bits) / 2;
+    }
+  }
+
+  // tail handling
+  for (size_t i = vsize * 32; i < size; i++) {
+    auto v = array[i];
+    if (v > threshold)
+      return i;
+  }
+
+  return SIZE_MAX;
+}
+
+HEDLEY_NEVER_INLINE
+static void populate_hits_avx(uint16_t *array, size_t range,
+                       size_t threshold, size_t start,
+                       std::vector<uint32_t> &out, std::vector<uint32_t> *counts = nullptr) {
+  while (true) {
+    size_t next = find_next_gt16(array, range, (uint16_t)threshold);
+    if (next == SIZE_MAX)
+      break;
+    uint32_t hit = start + next;
+    out.push_back(hit);
+    if (counts) {
+      counts->push_back(array[next]);
+    }
+    range -= (next + 1);
+    array += (next + 1);
+    start += (next + 1);
+  }
+}
+
+/* find_next_gt for either counter type */
+static inline size_t find_next_gt_any(uint8_t *array, size_t size, size_t threshold) {
+  return find_next_gt2(array, size, (uint8_t)threshold);
+}
+
+static inline size_t find_next_gt_any(uint16_t *array, size_t size, size_t threshold) {
+  return find_next_gt16(array, size, (uint16_t)threshold);
+}
+
+/**
+ * Like populate_hits_avx, but for several thresholds at once: the counters are scanned
+ * for hits at the lowest threshold, and each hit is appended to out[i] for every
+ * threshold i it passes, where levels[c] is the number of thresholds a count of c
+ * passes.
+ */
+template <typename C>
+HEDLEY_NEVER_INLINE
+void populate_hits_multi(C *array, size_t range, size_t lowest, size_t start,
+                         const std::vector<uint32_t>& levels, std::vector<std::vector<uint32_t>>& out) {
+  while (true) {
+    size_t next = find_next_gt_any(array, range, lowest);
+    if (next == SIZE_MAX)
+      break;
+    uint32_t hit = start + next;
+    assert(array[next] < levels.size());
+    for (size_t i = 0, level = levels[array[next]]; i < level; i++) {
+      out[i].push_back(hit);
+    }
     range -= (next + 1);
     array += (next + 1);
     start += (next + 1);
@@ -145,10 +257,14 @@ template <typename T>
 struct aux_view_t {
   const T* data;
   minispan<const aux_chunk_t<T>> chunks;
+  minispan<const uint32_t> range_counts;
 };
 
 /**
  * Auxilliary per-array data for avx2b algo.
+ *
+ * The constructor builds the data in vectors owned by this object, and place() then
+ * moves it into the arena shared by all the arrays, see all_aux_t.
  */
 template <typename T>
 struct avx2b_aux_t {
@@ -158,20 +274,42 @@ struct avx2b_aux_t {
   uint32_t largest;
 
   /* pointer to the re-written data */
-  std::unique_ptr<T[]> data;
+  const T* data;
 
-  /* a vector of how many times the counter increment loop has to run for each cache_size chunk */
-  std::vector<aux_chunk> chunks;
+  /*
+   * How many times the counter increment loop has to run for each chunk, which is 0
+   * for chunks with no elements left to count.
+   */
+  minispan<aux_chunk> chunks;
+
+  /* for each chunk, the number of elements of the array which fall in the chunk's range */
+  minispan<uint32_t> range_counts;
+
+  /* the data, chunks and range counts until they are placed */
+  std::vector<T> staged_data;
+  std::vector<aux_chunk> staged_chunks;
+  std::vector<uint32_t> staged_range_counts;
+
+  /*
+   * The largest overshoot we allow for the last block of a chunk: the overshoot has to
+   * fit in the counters of the next chunk even after dynamic_aux rounds it up to a
+   * multiple of 32 (the chunk size is a multiple of 64, so chunk_size - 32 stays put),
+   * and the rewritten values (which run up to chunk_size + overshoot + COUNTER_OFFSET)
+   * have to fit in T.
+   */
+  static uint32_t overshoot_limit(size_t chunk_size) {
+    return std::min(chunk_size - 32, (size_t)std::numeric_limits<T>::max() + 1 - COUNTER_OFFSET - chunk_size);
+  }
 
-  avx2b_aux_t(const data_array& array, uint32_t global_largest) {
+  avx2b_aux_t(const data_array& array, uint32_t global_largest, size_t chunk_size = cache_size) {
 
-    assert(!array.empty());  // some bugs with empty arrays
-    this->largest = array.back();
+    this->largest = array.empty() ? 0 : array.back();
 
     size_t pos = 0;
-    size_t chunk_count = div_up(global_largest + 1, (uint32_t)cache_size);
+    size_t chunk_count = div_up(global_largest + 1, (uint32_t)chunk_size);
     DBG(printf("chunk_count: %zu\n", chunk_count));
     size_t c = 0;
+    const uint32_t limit = overshoot_limit(chunk_size);
 
     // we rewrite the data into this vector
     std::vector<T> rewritten;
@@ -189,13 +327,16 @@ struct avx2b_aux_t {
     };
     std::vector<rw_meta> meta;
 
-    for (uint32_t rstart = 0; rstart <= global_largest; rstart += cache_size, c++) {
-      // striding by the unroll factor, look for the point in the array where
-      // the current element falls outside of the range, this is where we transition
-      // in the branch free loop
-      uint32_t rend = rstart + cache_size; // exclusive
+    for (uint32_t rstart = 0; rstart <= global_largest; rstart += chunk_size, c++) {
+      // striding by the unroll factor from the first element not written yet, look for
+      // the point in the array where the current element falls outside of the range,
+      // this is where we transition in the branch free loop
+      uint32_t rend = rstart + chunk_size; // exclusive
       size_t spos = pos;
-      while (pos < array.size() && array.at(pos) < rend) {
+
+      staged_range_counts.push_back(std::lower_bound(array.begin(), array.end(), rend)
+                           - std::lower_bound(array.begin(), array.end(), rstart));
+      while (pos < array.size() && array[pos] < rend) {
         pos += unroll;
       }
 
@@ -203,37 +344,35 @@ struct avx2b_aux_t {
         pos = array.size();
       }
 
-      // TODO: do we need limit of >= 1 loops for branchy?
-      size_t loops = std::max(1ul, div_up(pos - spos, unroll));  // round up
-
-      // I heard you like asserts
-      assert(spos < pos || (spos == pos && pos == array.size()));
-      if (spos < array.size()) {
-        assert(spos % unroll == 0);
-        assert(array.at(spos) >= rstart);
-        if (pos < array.size()) {
-          assert(pos % unroll == 0);
-          assert(array.at(pos) >= rend);
-          assert(spos + loops * unroll == pos);
-          assert((pos - spos) % unroll == 0);
+      // the last element in the last block for this chunk defines the overshoot
+      uint32_t overshoot = 0;
+      if (pos > spos && array[pos - 1] >= rend) {
+        overshoot = array[pos - 1] - rend + 1;
+        if (overshoot > limit) {
+          // there is a gap in the array after this chunk, so rather than counting past
+          // the next chunk, cut the block at the end of the range and pad it with filler
+          pos = std::lower_bound(array.begin() + spos, array.begin() + pos, rend) - array.begin();
+          overshoot = 0;
         }
       }
-      // unless we hit the single (forced) chunk case, the last block should be in the range of this chunk
-      assert(array.at(pos - unroll) < rend || pos - unroll == spos);
 
-      assert(loops < std::numeric_limits<uint32_t>::max());
+      // no loops at all if every element in the range was already counted in the
+      // overshoot of the last chunk (or there are none), dynamic_aux leaves those out
+      size_t loops = div_up(pos - spos, unroll);  // round up
 
-      uint32_t last = array.at(pos - 1); // check the last element in the last block for this chunk, this defines the overshoot
-      assert(last > rstart || spos == pos);
-      uint32_t overshoot = last < rend ? 0 : last - rend + 1;
-      assert(overshoot < cache_size); // this could happen for real data, need to fix "extended overshoot" to solve it
+      // I heard you like asserts
+      assert(spos <= pos);
+      assert(spos == array.size() || array.at(spos) >= rstart);
+      assert(pos == array.size() || array.at(pos) >= rend);
+      assert(overshoot <= limit);
+      assert(loops < std::numeric_limits<uint32_t>::max());
 
       size_t rw_index = rewritten.size();
       for (size_t i = spos; i < pos; i++) {
         uint32_t val = array.at(i) + COUNTER_OFFSET;
         assert(val >= rstart);
 
-        // rebase the value to be relative to rstart (i.e., in the range [0, cache_size] + COUNTER_OFFSET)
+        // rebase the value to be relative to rstart (i.e., in the range [0, chunk_size + overshoot) + COUNTER_OFFSET)
         val -= rstart;
         assert(val <= std::numeric_limits<T>::max());
         assert(val == (T)val);
@@ -244,7 +383,6 @@ struct avx2b_aux_t {
       ssize_t filler_count = loops * unroll - (pos - spos); // amount extra we have to write
       filler_total += filler_count;
       assert(filler_count >= 0);
-      assert(filler_count == 0 || pos == array.size());
 
       // fill out the block with zeros for any filler elements - because of COUNTER_OFFSET
       // zeros write to an ignored part of the array and hence serve as no ops
@@ -254,27 +392,67 @@ struct avx2b_aux_t {
       size_t written_count = rewritten.size() - rw_index;
       assert(loops * unroll == written_count);
       meta.push_back({rw_index, (uint32_t)loops, overshoot});
-      DBG(printf("AUX - chunk: %zu a[%zu]: %u to a[%zu] : %u iters: %zu "
+      DBG(printf("AUX - chunk: %zu a[%zu] to a[%zu] iters: %zu "
           "wreal: %zu wfill: %zu oshoot: %5du rstart %du\n",
-          c, spos, array[spos], pos - 1, array[pos - 1], loops,
+          c, spos, pos, loops,
           written_count - filler_count, filler_count, overshoot, rstart);)
     }
 
     assert(chunk_count == c);
     assert(meta.size() == chunk_count);
 
-    data.reset(new T[rewritten.size()]);
-    std::copy(rewritten.begin(), rewritten.end(), data.get());
+    DBG(printf("Filler %%%7.4f\n", 100.0 * filler_total / rewritten.size()));
+
+    staged_data.assign(rewritten.begin(), rewritten.end());
 
-    chunks.reserve(chunk_count);
+    staged_chunks.reserve(chunk_count);
 
     for (auto& m : meta) {
-      auto sptr = data.get() + m.rw_index;
+      auto sptr = staged_data.data() + m.rw_index;
       // DBG(printf("sptr: %p send: %p\n", sptr, sptr + unroll * m.iter_count);)
-      chunks.push_back({sptr, m.iter_count, m.overshoot});
+      staged_chunks.push_back({sptr, m.iter_count, m.overshoot});
     }
 
-    DBG(printf("Filler %%%7.4f\n", 100.0 * filler_total / rewritten.size()));
+    data = staged_data.data();
+    chunks = minispan<aux_chunk>::from(staged_chunks);
+    range_counts = minispan<uint32_t>::from(staged_range_counts);
+  }
+
+  /* the space needed in the arena, starting from an aligned offset */
+  size_t arena_bytes() const {
+    return index_arena::align(staged_data.size() * sizeof(T))
+         + index_arena::align(staged_chunks.size() * sizeof(aux_chunk))
+         + index_arena::align(staged_range_counts.size() * sizeof(uint32_t));
+  }
+
+  /*
+   * Copy the data to the arena at offset, which is advanced by arena_bytes(), and
+   * free the staged copies.
+   */
+  void place(const index_arena& arena, size_t& offset) {
+    T* new_data = arena.at<T>(offset);
+    std::copy(staged_data.begin(), staged_data.end(), new_data);
+    offset += index_arena::align(staged_data.size() * sizeof(T));
+
+    aux_chunk* new_chunks = arena.at<aux_chunk>(offset);
+    for (size_t c = 0; c < staged_chunks.size(); c++) {
+      auto chunk = staged_chunks[c];
+      chunk.start_ptr = new_data + (chunk.start_ptr - staged_data.data());
+      new_chunks[c] = chunk;
+    }
+    offset += index_arena::align(staged_chunks.size() * sizeof(aux_chunk));
+
+    uint32_t* new_counts = arena.at<uint32_t>(offset);
+    std::copy(staged_range_counts.begin(), staged_range_counts.end(), new_counts);
+    offset += index_arena::align(staged_range_counts.size() * sizeof(uint32_t));
+
+    data = new_data;
+    chunks = {new_chunks, staged_chunks.size()};
+    range_counts = {new_counts, staged_range_counts.size()};
+
+    staged_data = {};
+    staged_chunks = {};
+    staged_range_counts = {};
   }
 
   /**
@@ -284,39 +462,130 @@ struct avx2b_aux_t {
    * the corresponding fields are not modified).
    */
   aux_view get_view() const {
-    return { data.get(), minispan<const aux_chunk>::from(chunks) };
+    return { data, {chunks.begin, chunks.size()}, {range_counts.begin, range_counts.size()} };
   }
 };
 
 template <typename T>
 struct all_aux_t {
   uint32_t largest; // the largest value found in any array
+  size_t chunk_size; // the range of elements counted in each chunk
   std::vector<avx2b_aux_t<T>> aux_data;
 
-  all_aux_t(uint32_t largest) : largest{largest} {}
+  /* holds the data, chunks and range counts of all the arrays, see place() */
+  index_arena arena;
+
+  all_aux_t(uint32_t largest, size_t chunk_size = cache_size) : largest{largest}, chunk_size{chunk_size} {}
+
+  /*
+   * The largest overshoot of any chunk of any array, which is always at most
+   * chunk_size - 32 since blocks which would overshoot further are cut short.
+   */
+  uint32_t max_overshoot() const {
+    uint32_t ret = 0;
+    for (auto& aux : aux_data) {
+      for (size_t c = 0; c < aux.chunks.size(); c++) {
+        ret = std::max(ret, aux.chunks[c].overshoot);
+      }
+    }
+    return ret;
+  }
+
+  /*
+   * Move the aux data of all the arrays into one arena, in order, so the whole
+   * index is in one region of memory which is freed in one go.
+   */
+  void place() {
+    size_t total = 0;
+    for (auto& aux : aux_data) {
+      total += aux.arena_bytes();
+    }
+    arena = index_arena{total};
+    size_t offset = 0;
+    for (auto& aux : aux_data) {
+      aux.place(arena, offset);
+    }
+    assert(offset == total);
+  }
 };
 
 /**
  * Auxillary data specific to a query, calculated dynamically based
  * on the aux data from the input arrays.
+ *
+ * An object can be rebuilt for another query with build(), which reuses
+ * the storage from earlier queries, so once it has seen a query at least
+ * as large it doesn't allocate.
  */
 template <typename T>
 struct dynamic_aux {
   using aux_chunk = aux_chunk_t<T>;
   using aux_view = aux_view_t<T>;
 
+  static_assert(sizeof(aux_chunk) == 16 && offsetof(aux_chunk, iter_count) == 8
+      && offsetof(aux_chunk, overshoot) == 12, "build_tile depends on the aux_chunk layout");
+
+  /* the number of chunks build_tile handles at once, one per 32-bit lane */
+  static constexpr size_t tile_chunks = 8;
+
   uint32_t largest;
+  size_t chunk_size;
+
+  /*
+   * One flat buffer holding stride entries for each chunk: the aux_chunk of each array
+   * in the query with anything to count in the chunk, followed by a copy of the last
+   * one, so the kernels are passed aux_begin(chunk) and aux_end(chunk).
+   */
+  std::vector<aux_chunk> aux;
+  size_t stride;
+
+  /* for each chunk, the number of arrays with anything to count in it */
+  std::vector<uint32_t> chunk_arrays;
 
-  std::vector<std::vector<aux_chunk>> aux;
   std::vector<uint32_t> max_overshoot;
 
-  HEDLEY_NEVER_INLINE
+  /*
+   * For each chunk, the number of arrays in the query with at least one element in
+   * the chunk's range: no counter in the chunk can be larger, so chunks where this
+   * is no more than the threshold can't have any hits.
+   */
+  std::vector<uint32_t> chunk_bound;
+
+  /* for each chunk, the total number of elements of the query's arrays in its range */
+  std::vector<uint32_t> chunk_elements;
+
+  /* the number of arrays in the query */
+  size_t array_count;
+
+  /* scratch space for build() */
+  std::vector<aux_view> views;
+
+  dynamic_aux() : largest{0}, chunk_size{cache_size}, stride{1}, array_count{0} {}
+
   dynamic_aux(const implb::all_aux_t<T>& all_aux_info, const std::vector<uint32_t>& query) {
+    build(all_aux_info, query);
+  }
+
+  void build(const implb::all_aux_t<T>& all_aux_info, const std::vector<uint32_t>& query) {
+    build(all_aux_info, query, 0, SIZE_MAX);
+  }
+
+  /**
+   * Build only the aux data for chunks [start_chunk, end_chunk), so the cost depends
+   * on the number of chunks built rather than the whole domain. The other chunks
+   * must not be used. The chunks span at least min_largest, e.g., for the largest
+   * element of arrays counted some other way.
+   *
+   * The per-array chunk tables are transposed into the per-chunk lists tile_chunks
+   * chunks at a time, see build_tile, and any chunks left over one at a time.
+   */
+  HEDLEY_NEVER_INLINE
+  void build(const implb::all_aux_t<T>& all_aux_info, const std::vector<uint32_t>& query,
+             size_t start_chunk, size_t end_chunk, uint32_t min_largest = 0) {
 
       /* extract the relevant aux_info arrays based on the given query */
-    std::vector<aux_view> views;
-    uint32_t largest = 0;
-    views.reserve(query.size());
+    uint32_t largest = min_largest;
+    views.clear();
     for (auto i : query) {
       assert(i < all_aux_info.aux_data.size());
       auto& aux_data = all_aux_info.aux_data[i];
@@ -324,63 +593,174 @@ struct dynamic_aux {
       largest = largest >= aux_data.largest ? largest : aux_data.largest;
     }
     this->largest = largest;
+    this->chunk_size = all_aux_info.chunk_size;
 
     size_t dsize = views.size();
-    size_t chunks_needed = div_up(largest + 1, (uint32_t)cache_size);
+    this->array_count = dsize;
+    this->stride = dsize + 1;
+    size_t chunks_needed = div_up(largest + 1, (uint32_t)chunk_size);
     DBG(printf("chunks_needed: %zu\n", chunks_needed);)
 
-    size_t pfdistance = std::min((size_t)30, dsize);
-
     for (auto& v : views) {
       assert(chunks_needed <= v.chunks.size());
     }
 
-    for (size_t chunk = 0; chunk < chunks_needed; chunk++) {
-      for (size_t i = 0; i < pfdistance; i++) {
-        _mm_prefetch(&views[i].chunks[chunk], _MM_HINT_T0);
-      }
+    // resize rather than clear so that the storage is kept across queries
+    aux.resize(chunks_needed * stride);
+    chunk_arrays.resize(chunks_needed);
+    max_overshoot.resize(chunks_needed);
+    chunk_bound.resize(chunks_needed);
+    chunk_elements.resize(chunks_needed);
+
+    end_chunk = std::min(end_chunk, chunks_needed);
+    size_t chunk = start_chunk;
+    for (; chunk + tile_chunks <= end_chunk; chunk += tile_chunks) {
+      build_tile(chunk);
+    }
+    for (; chunk < end_chunk; chunk++) {
+      build_chunk(chunk);
+    }
+  }
 
-      aux.emplace_back(dsize + 1);
+  /* the number of chunks spanned by this query */
+  size_t chunk_count() const {
+    return chunk_arrays.size();
+  }
+
+  const aux_chunk* aux_begin(size_t chunk) const {
+    return aux.data() + chunk * stride;
+  }
+
+  /* the copy of the last aux_chunk in the chunk, which the kernels stop at */
+  const aux_chunk* aux_end(size_t chunk) const {
+    return aux_begin(chunk) + chunk_arrays[chunk];
+  }
+
+  /* false if no array has anything to count in the given chunk, so the kernel must not be run */
+  bool have_work(size_t chunk) const {
+    return chunk_arrays[chunk] != 0;
+  }
 
-      auto& thisaux = aux.back();
-      // auto& ptr = start_ptr.back();
-      uint32_t maxo = 0;
+private:
+  /* write the copy of the last aux_chunk after the others, given their number */
+  void finish_chunk(size_t chunk, uint32_t n) {
+    aux_chunk* row = aux.data() + chunk * stride;
+    row[n] = n ? row[n - 1] : aux_chunk{nullptr, 0, 0};
+    chunk_arrays[chunk] = n;
+  }
 
-      for (size_t i = 0; i < dsize - pfdistance; ++i) {
-        assert(chunk < views[i].chunks.size());
-        auto info = views[i].chunks[chunk];
-        _mm_prefetch(&views[i + pfdistance].chunks[chunk], _MM_HINT_T0);
-        thisaux[i] = info;
-        maxo = maxo > info.overshoot ? maxo : info.overshoot;
+  /*
+   * Build chunks [chunk, chunk + tile_chunks), array by array: the tile of each
+   * array's chunk table is two cache lines read in order, and each of its entries is
+   * appended to its chunk's list (branch free: arrays with no loops in a chunk are
+   * overwritten by the next one, since the kernels can't handle a zero iteration
+   * count). The counts, overshoots, bounds and elements for the tile are all kept in
+   * one vector each, with a chunk per lane.
+   */
+  void build_tile(size_t chunk) {
+    static_assert(tile_chunks == 8, "one chunk per lane");
+    const size_t dsize = views.size();
+    const size_t pfdistance = std::min((size_t)8, dsize);
+    aux_chunk* const rows = aux.data() + chunk * stride;
+
+    // the iteration counts and overshoots come out of the transpose below in the
+    // order 0 2 4 6 1 3 5 7, which we keep until the end: lane l holds chunk
+    // tile_lane[l], and chunk k is in lane_of(k)
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i counts = _mm256_setzero_si256(), maxo = counts, bound = counts, elements = counts;
+    alignas(32) uint32_t lane_counts[tile_chunks] = {};
+    auto lane_of = [](size_t k) { return (k >> 1) + (k & 1) * 4; };
+
+    for (size_t i = 0; i < dsize; i++) {
+      assert(chunk + tile_chunks <= views[i].chunks.size());
+      const aux_chunk* src = views[i].chunks.begin + chunk;
+      const uint32_t* range_counts = views[i].range_counts.begin + chunk;
+      if (i + pfdistance < dsize) {
+        _mm_prefetch(views[i + pfdistance].chunks.begin + chunk, _MM_HINT_T0);
+        _mm_prefetch(views[i + pfdistance].chunks.begin + chunk + 4, _MM_HINT_T0);
       }
 
-      for (size_t i = dsize - pfdistance; i < dsize; ++i) {
-        assert(chunk < views[i].chunks.size());
-        auto info = views[i].chunks[chunk];
-        thisaux[i] = info;
-        maxo = maxo > info.overshoot ? maxo : info.overshoot;
+      // append each entry at the current count for its chunk
+      for (size_t k = 0; k < tile_chunks; k++) {
+        _mm_storeu_si128((__m128i *)(rows + k * stride + lane_counts[lane_of(k)]),
+                         _mm_loadu_si128((const __m128i *)(src + k)));
       }
 
-      thisaux[dsize] = thisaux[dsize - 1];
-      DBG(printf("maxo: %du\n", maxo);)
-      max_overshoot.push_back((maxo + 31) & -32);  // round up overshoot so the memset(0) is aligned
+      // two entries per vector: gather the iteration counts and overshoots (the high
+      // two dwords of each entry) into one vector each
+      __m256i a01 = _mm256_loadu_si256((const __m256i *)(src + 0));
+      __m256i a23 = _mm256_loadu_si256((const __m256i *)(src + 2));
+      __m256i a45 = _mm256_loadu_si256((const __m256i *)(src + 4));
+      __m256i a67 = _mm256_loadu_si256((const __m256i *)(src + 6));
+      __m256i h0 = _mm256_unpackhi_epi32(a01, a23);    // i0 i2 o0 o2 | i1 i3 o1 o3
+      __m256i h1 = _mm256_unpackhi_epi32(a45, a67);    // i4 i6 o4 o6 | i5 i7 o5 o7
+      __m256i iters = _mm256_unpacklo_epi64(h0, h1);   // i0 i2 i4 i6 | i1 i3 i5 i7
+      __m256i over  = _mm256_unpackhi_epi64(h0, h1);   // o0 o2 o4 o6 | o1 o3 o5 o7
+
+      // count += iters != 0
+      counts = _mm256_sub_epi32(counts, _mm256_xor_si256(_mm256_cmpeq_epi32(iters, _mm256_setzero_si256()), ones));
+      _mm256_store_si256((__m256i *)lane_counts, counts);
+      maxo = _mm256_max_epu32(maxo, over);
+
+      // the range counts are in chunk order
+      __m256i rc = _mm256_loadu_si256((const __m256i *)range_counts);
+      bound = _mm256_sub_epi32(bound, _mm256_xor_si256(_mm256_cmpeq_epi32(rc, _mm256_setzero_si256()), ones));
+      elements = _mm256_add_epi32(elements, rc);
+    }
+
+    // back to chunk order, and round up overshoot so the memset(0) is aligned
+    const __m256i to_chunk_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    maxo = _mm256_permutevar8x32_epi32(maxo, to_chunk_order);
+    maxo = _mm256_and_si256(_mm256_add_epi32(maxo, _mm256_set1_epi32(31)), _mm256_set1_epi32(-32));
+    _mm256_storeu_si256((__m256i *)(max_overshoot.data() + chunk), maxo);
+    _mm256_storeu_si256((__m256i *)(chunk_bound.data() + chunk), bound);
+    _mm256_storeu_si256((__m256i *)(chunk_elements.data() + chunk), elements);
+    for (size_t k = 0; k < tile_chunks; k++) {
+      finish_chunk(chunk + k, lane_counts[lane_of(k)]);
+    }
+  }
+
+  /* build a single chunk, as build_tile does */
+  void build_chunk(size_t chunk) {
+    aux_chunk* const row = aux.data() + chunk * stride;
+    uint32_t maxo = 0, bound = 0, elements = 0, n = 0;
+    for (auto& v : views) {
+      auto info = v.chunks[chunk];
+      row[n] = info;
+      n += info.iter_count != 0;
+      maxo = maxo > info.overshoot ? maxo : info.overshoot;
+      bound += v.range_counts[chunk] != 0;
+      elements += v.range_counts[chunk];
     }
+    DBG(printf("maxo: %du\n", maxo);)
+    max_overshoot[chunk] = (maxo + 31) & -32;  // round up overshoot so the memset(0) is aligned
+    chunk_bound[chunk] = bound;
+    chunk_elements[chunk] = elements;
+    finish_chunk(chunk, n);
   }
 };
 
+/**
+ * Build the aux data for all the arrays, with the given chunk size, which must be
+ * a multiple of 64 no larger than cache_size.
+ */
 template <typename T>
 HEDLEY_NEVER_INLINE
-all_aux_t<T> get_all_aux(const all_data& data) {
-  all_aux_t<T> ret{ get_largest(data) };
+all_aux_t<T> get_all_aux(const all_data& data, size_t chunk_size = cache_size) {
+  if (chunk_size == 0 || chunk_size % 64 != 0 || chunk_size > cache_size) {
+    throw std::invalid_argument("bad AVX2B chunk size " + std::to_string(chunk_size));
+  }
+  all_aux_t<T> ret{ get_largest(data), chunk_size };
   auto& aux_array = ret.aux_data;
   aux_array.reserve(data.size());
   for (auto &d : data) {
-    aux_array.emplace_back(d, ret.largest);
+    aux_array.emplace_back(d, ret.largest, chunk_size);
   }
   for (auto& aux : aux_array) {
     // DBG(printf("chunks.size(): %zu\n", aux.chunks.size()));
     assert(aux.chunks.size() == aux_array.front().chunks.size());
   }
+  ret.place();
   return ret;
 }
 
@@ -396,9 +776,9 @@ all_aux_t<T> get_all_aux_reordered(const all_data& data) {
 
   std::vector<uint32_t> contiguous;
   contiguous.reserve(data.size() * data.front().size());
-  for (uint32_t rstart = 0, chunk = 0; rstart <= all.largest; rstart += cache_size, chunk++) {
+  for (uint32_t rstart = 0, chunk = 0; rstart <= all.largest; rstart += all.chunk_size, chunk++) {
     for (auto& aux : all.aux_data) {
-      auto& chunkaux = aux.chunks.at(chunk);
+      auto& chunkaux = aux.chunks[chunk];
       contiguous.insert(contiguous.end(), chunkaux.start_ptr, chunkaux.start_ptr + chunkaux.iter_count * unroll);
     }
   }
@@ -408,9 +788,9 @@ all_aux_t<T> get_all_aux_reordered(const all_data& data) {
   std::copy(contiguous.begin(), contiguous.end(), contigarray);
 
   uint32_t* cur = contigarray;
-  for (uint32_t rstart = 0, chunk = 0; rstart <= all.largest; rstart += cache_size, chunk++) {
+  for (uint32_t rstart = 0, chunk = 0; rstart <= all.largest; rstart += all.chunk_size, chunk++) {
     for (auto& aux : all.aux_data) {
-      auto& chunkaux = aux.chunks.at(chunk);
+      auto& chunkaux = aux.chunks[chunk];
       chunkaux.start_ptr = cur;
       cur += chunkaux.iter_count * unroll;
     }
@@ -424,29 +804,101 @@ all_aux_t<T> get_all_aux_reordered(const all_data& data) {
 
 } // implb namespace
 
-#define counter_base (counters + COUNTER_OFFSET)
-alignas(64) extern uint8_t counters[counters_size];
+/**
+ * The counter block used by the AVX2B algorithm. Kernels write only to the
+ * counters they are passed, so each thread running a query needs its own
+ * context, but any number of threads can run queries concurrently as long
+ * as they use different contexts.
+ *
+ * C is the counter type: uint8_t normally, or uint16_t for queries with
+ * more than 255 arrays or thresholds above 254.
+ *
+ * The object is large (about 80 KB for 8-bit counters) so you probably want
+ * to allocate it on the heap or use default_context().
+ */
+template <typename C>
+struct alignas(64) avx2b_context_t {
+  using counter_type = C;
 
-template <typename T>
+  C counters[counters_size];
+
+  /* the hits recorded by the fused kernels, which keeps its size across queries */
+  std::vector<uint32_t> hits;
+
+  /* the counter for the first element of the current chunk */
+  C* base() { return counters + COUNTER_OFFSET; }
+};
+
+using avx2b_context   = avx2b_context_t<uint8_t>;
+using avx2b_context16 = avx2b_context_t<uint16_t>;
+
+/**
+ * Returns the context for the calling thread, used by the overloads which
+ * don't take an explicit context.
+ */
+template <typename C = uint8_t>
+avx2b_context_t<C>& default_context();
+
+template <> avx2b_context&   default_context<uint8_t>();
+template <> avx2b_context16& default_context<uint16_t>();
+
+/**
+ * A kernel which increments the counters for all the arrays in one chunk. T is
+ * the rewritten element type and C the counter type.
+ */
+template <typename T, typename C = uint8_t>
 using kernel_fn = void (const implb::aux_chunk_t<T>* aux_ptr,
                         const implb::aux_chunk_t<T>* aux_end,
-                        uint32_t range_start);
+                        uint32_t range_start,
+                        C* counters);
 
 using kernel_fn32 = kernel_fn<uint32_t>;
 using kernel_fn16 = kernel_fn<uint16_t>;
 
+/* 16-bit elements with 16-bit counters */
+using kernel_fn16w = kernel_fn<uint16_t, uint16_t>;
+
 extern "C" kernel_fn32 record_hits_asm_branchy32;
 extern "C" kernel_fn16 record_hits_asm_branchy16;
 extern "C" kernel_fn16 record_hits_asm_branchyB;
 extern "C" kernel_fn32 record_hits_asm_branchless32;
 extern "C" kernel_fn16 record_hits_asm_branchless16;
+extern "C" kernel_fn16w record_hits_asm_branchy16w;
+
+/*
+ * The kernels above prefetch 256 bytes ahead in the current array. These variants
+ * prefetch 128 or 512 bytes ahead instead, for autotune to choose from.
+ */
+extern "C" kernel_fn16 record_hits_asm_branchy16_pf128;
+extern "C" kernel_fn16 record_hits_asm_branchy16_pf512;
+extern "C" kernel_fn16w record_hits_asm_branchy16w_pf128;
+extern "C" kernel_fn16w record_hits_asm_branchy16w_pf512;
+
+/**
+ * A kernel which increments the counters like kernel_fn, and also detects hits as it
+ * goes: the index into counters of each element whose counter was equal to threshold
+ * before the increment is appended to hits, and the new end of hits is returned.
+ * Each hit is written to *hits whether or not it is kept, so hits must have room for
+ * one more element than it could need.
+ */
+template <typename T, typename C = uint8_t>
+using fused_kernel_fn = uint32_t* (const implb::aux_chunk_t<T>* aux_ptr,
+                                   const implb::aux_chunk_t<T>* aux_end,
+                                   uint32_t threshold,
+                                   C* counters,
+                                   uint32_t* hits);
 
+extern "C" fused_kernel_fn<uint16_t> record_hits_asm_fused16;
+extern "C" fused_kernel_fn<uint16_t> record_hits_asm_fused16_pf128;
+extern "C" fused_kernel_fn<uint16_t> record_hits_asm_fused16_pf512;
 
-template <typename T>
+
+template <typename T, typename C = uint8_t>
 HEDLEY_NEVER_INLINE
 void record_hits_c(const implb::aux_chunk_t<T>* aux_ptr,
                    const implb::aux_chunk_t<T>* aux_end,
-                   uint32_t range_start) {
+                   uint32_t range_start,
+                   C* counters) {
 #ifndef NDEBUG
   const implb::aux_chunk_t<T>* aux_start = aux_ptr;
 #endif
@@ -459,7 +911,7 @@ void record_hits_c(const implb::aux_chunk_t<T>* aux_ptr,
     for (size_t i = 0; i < unroll; i++) {
       T e = *eptr++;
       assert(e >= COUNTER_OFFSET || e == 0);
-      assert(e < sizeof(counters));
+      assert(e < counters_size);
       ++counters[e];
     }
 
@@ -487,6 +939,58 @@ void record_hits_c(const implb::aux_chunk_t<T>* aux_ptr,
   }
 }
 
+#ifdef __AVX512F__
+/**
+ * A kernel which increments the counters with AVX-512 gather and scatter, one
+ * vector of 16 elements per unroll-sized block. Works with either rewritten
+ * element size. See increment_bytes_avx512 for how lanes which hit the same
+ * counter dword are handled.
+ *
+ * The filler zeros can push counter 0 past 255, which carries into counters 1
+ * to 3, but those are all in the ignored COUNTER_OFFSET region.
+ */
+template <typename T>
+HEDLEY_NEVER_INLINE
+void record_hits_avx512(const implb::aux_chunk_t<T>* aux_ptr,
+                        const implb::aux_chunk_t<T>* aux_end,
+                        uint32_t,
+                        uint8_t* counters) {
+  static_assert(unroll == 16, "one vector per block");
+  for (; aux_ptr != aux_end; aux_ptr++) {
+    const T* eptr = aux_ptr->start_ptr;
+    for (uint32_t i = 0; i < aux_ptr->iter_count; i++, eptr += unroll) {
+      __m512i idx;
+      if constexpr (sizeof(T) == 2) {
+        idx = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)eptr));
+      } else {
+        idx = _mm512_loadu_si512(eptr);
+      }
+      increment_bytes_avx512(counters, idx);
+    }
+  }
+}
+#endif
+
+template <typename T, typename C = uint8_t>
+HEDLEY_NEVER_INLINE
+uint32_t* record_hits_fused_c(const implb::aux_chunk_t<T>* aux_ptr,
+                              const implb::aux_chunk_t<T>* aux_end,
+                              uint32_t threshold,
+                              C* counters,
+                              uint32_t* hits) {
+  for (; aux_ptr != aux_end; aux_ptr++) {
+    const T* eptr = aux_ptr->start_ptr;
+    for (size_t i = 0, n = aux_ptr->iter_count * unroll; i < n; i++) {
+      T e = eptr[i];
+      C c = counters[e];
+      *hits = e;
+      hits += c == threshold;
+      counters[e] = c + 1;
+    }
+  }
+  return hits;
+}
+
 static int zeroint;
 
 HEDLEY_NEVER_INLINE
@@ -584,52 +1088,579 @@ void copymem(T* HEDLEY_RESTRICT dest, const T* HEDLEY_RESTRICT src, size_t count
   }
 }
 
+/**
+ * Zero the counters for one chunk of the given size, using the unrolled version for
+ * the default size.
+ */
+template <typename C>
+void zero_chunk(C* counters, size_t chunk_size) {
+  if (HEDLEY_LIKELY(chunk_size == cache_size)) {
+    memzero<cache_size * sizeof(C)>(counters);
+  } else {
+    memzero(counters, chunk_size * sizeof(C));
+  }
+}
+
+/* count one chunk into ctx.counters with the kernel K, if any arrays have elements in it */
+template <typename T, typename C, kernel_fn<T, C> K>
+HEDLEY_ALWAYS_INLINE
+void count_chunk(const implb::dynamic_aux<T>& dyn_aux, size_t chunk, avx2b_context_t<C>& ctx) {
+  if (!dyn_aux.have_work(chunk)) {
+    return;
+  }
+  uint32_t range_start = chunk * dyn_aux.chunk_size;
+
+  const implb::aux_chunk_t<T>* aux_ptr = dyn_aux.aux_begin(chunk), *aux_end = dyn_aux.aux_end(chunk);
+
+  DBG(printf("chunk %zu range_start: %du iters_left %u first %u\n",
+      chunk, range_start, aux_ptr->iter_count, *aux_ptr->start_ptr);)
+
+  K(aux_ptr, aux_end, range_start, ctx.counters);
+}
+
+/**
+ * Count chunks [start_chunk, end_chunk) of a query with the counters of ctx, leaving
+ * what differs between the variants to three hooks, called in chunk order:
+ *
+ *  - skip(chunk) returns true if the chunk can't have any hits, e.g., because no more
+ *    than threshold arrays have any elements in it (see dynamic_aux::chunk_bound), so
+ *    it needn't be counted. It may depend on the hits found so far.
+ *  - count(chunk, carried) counts the chunk into the counters, which hold the overshoot
+ *    of the previous chunk if carried is true, and start out zero otherwise.
+ *  - find_hits(chunk) looks for hits in the counters of a counted chunk, at ctx.base().
+ *
+ * The chunks are otherwise independent except for the overshoot carried from one chunk
+ * into the next, so if the chunk before a counted chunk was skipped (or is before
+ * start_chunk), it is counted anyway, without looking for hits, when it overshoots.
+ */
+template <typename T, typename C, typename S, typename N, typename F>
+void count_chunks(const implb::dynamic_aux<T>& dyn_aux, size_t start_chunk, size_t end_chunk,
+                  avx2b_context_t<C>& ctx, S&& skip, N&& count, F&& find_hits) {
+
+  assert(start_chunk <= end_chunk && end_chunk <= dyn_aux.chunk_count());
+
+  const size_t chunk_size = dyn_aux.chunk_size;
+  C* const counter_base = ctx.base();
+  memzero(ctx.counters, sizeof(ctx.counters));
+
+  auto carry_overshoot = [&](size_t chunk) {
+    uint32_t overshoot = dyn_aux.max_overshoot[chunk];
+    //printf("overshoot: %u\n", overshoot);
+    assert(overshoot < chunk_size);
+    // memcpy(counters, counters + chunk_size, overshoot);
+    copymem(counter_base, counter_base + chunk_size, overshoot);
+    // memset(counters + overshoot, 0, chunk_size);
+    zero_chunk(counter_base + overshoot, chunk_size);
+    return overshoot;
+  };
+
+  bool prev_counted = start_chunk == 0;
+  uint32_t carried = 0; // the number of counters at the start of the chunk holding overshoot from the last one
+  for (size_t chunk = start_chunk; chunk < end_chunk; chunk++) {
+    if (skip(chunk)) {
+      if (carried) {
+        std::memset(counter_base, 0, carried * sizeof(C));
+        carried = 0;
+      }
+      prev_counted = false;
+      continue;
+    }
+
+    if (!prev_counted && dyn_aux.max_overshoot[chunk - 1]) {
+      // the previous chunk overshoots into this one, so we have to count it after all
+      count(chunk - 1, false);
+      carry_overshoot(chunk - 1);
+      prev_counted = true;
+    }
+
+    count(chunk, prev_counted);
+    find_hits(chunk);
+    carried = carry_overshoot(chunk);
+    prev_counted = true;
+  }
+}
+
+/**
+ * Count and find the hits for chunks [start_chunk, end_chunk) of a query, appending the
+ * hits to out in increasing order, and their counts to counts if it isn't null. See
+ * count_chunks.
+ *
+ * If planes isn't null, the counts for its group of arrays are added to the counters
+ * of each chunk before looking for hits, see count_planes.
+ */
+template <typename T, typename C, kernel_fn<T, C> K>
+void fastscancount_avx2b_chunks(const implb::dynamic_aux<T>& dyn_aux, std::vector<uint32_t> &out,
+                                size_t threshold, size_t start_chunk, size_t end_chunk,
+                                avx2b_context_t<C>& ctx, std::vector<uint32_t> *counts = nullptr,
+                                const count_planes *planes = nullptr) {
+  assert(!planes || (planes->chunk_size == dyn_aux.chunk_size && planes->chunk_count() >= dyn_aux.chunk_count()));
+  assert(threshold < std::numeric_limits<C>::max());
+
+  const size_t chunk_size = dyn_aux.chunk_size;
+  count_chunks(dyn_aux, start_chunk, end_chunk, ctx,
+      [&](size_t chunk) {
+        return dyn_aux.chunk_bound[chunk] + (planes ? planes->chunk_bound[chunk] : 0) <= threshold;
+      },
+      [&](size_t chunk, bool) { count_chunk<T, C, K>(dyn_aux, chunk, ctx); },
+      [&](size_t chunk) {
+        if (planes) {
+          planes->add_to(chunk, ctx.base());
+        }
+        implb::populate_hits_avx(ctx.base(), chunk_size, threshold, chunk * chunk_size, out, counts);
+      });
+}
+
 /**
  * Parameterized on K, the kernel function which does the core counter increment loop.
  *
  * @param query the list of indexes of posting arrays for this query
+ * @param ctx the counters to use, which must not be in use by another thread
  */
 template <typename T, kernel_fn<T> K>
 void fastscancount_avx2b(const data_ptrs &, std::vector<uint32_t> &out,
+                         uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                         const std::vector<uint32_t>& query, avx2b_context& ctx) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
+
+  fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx);
+}
+
+/**
+ * As above, using the default (thread-local) context.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b(const data_ptrs &data, std::vector<uint32_t> &out,
                          uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
                          const std::vector<uint32_t>& query) {
+  fastscancount_avx2b<T, K>(data, out, threshold, all_aux_info, query, default_context());
+}
+
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i] is
+ * the count for out[i].
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                         uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                         const std::vector<uint32_t>& query, avx2b_context& ctx = default_context()) {
 
   _mm256_zeroupper();
 
-  using namespace implb;
-  using aux_chunk = aux_chunk_t<T>;
+  out.clear();
+  counts.clear();
+
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
+
+  fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx, &counts);
+}
+
+/**
+ * Find the hits for several thresholds, which must be in increasing order, from one
+ * counting pass: out[i] gets the hits for thresholds[i], in increasing order. A hit
+ * for a threshold is also a hit for every lower one, so the results are nested: each
+ * is a subset of the ones before it.
+ *
+ * Only the search for hits depends on the threshold, so this costs about as much
+ * as one query at the lowest threshold, see populate_hits_multi.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b_multi(const data_ptrs &data, std::vector<std::vector<uint32_t>> &out,
+                               const std::vector<uint8_t>& thresholds, const implb::all_aux_t<T>& all_aux_info,
+                               const std::vector<uint32_t>& query, avx2b_context& ctx = default_context()) {
+  implb::dynamic_aux<T> dyn_aux;
+  std::vector<uint32_t> levels;
+  fastscancount_avx2b_multi<T, K>(data, out, thresholds, all_aux_info, query, ctx, dyn_aux, levels);
+}
+
+/**
+ * As above, building the dynamic aux data in dyn_aux and the threshold level of each
+ * count in levels, which keep their storage across queries.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b_multi(const data_ptrs &, std::vector<std::vector<uint32_t>> &out,
+                               const std::vector<uint8_t>& thresholds, const implb::all_aux_t<T>& all_aux_info,
+                               const std::vector<uint32_t>& query, avx2b_context& ctx,
+                               implb::dynamic_aux<T>& dyn_aux, std::vector<uint32_t>& levels) {
+
+  if (!std::is_sorted(thresholds.begin(), thresholds.end())) {
+    throw std::invalid_argument("the thresholds must be in increasing order");
+  }
+
+  out.resize(thresholds.size());
+  for (auto& o : out) {
+    o.clear();
+  }
+  if (thresholds.empty()) {
+    return;
+  }
+
+  _mm256_zeroupper();
+
+  // no counter can be larger than the number of arrays
+  levels.resize(query.size() + 1);
+  for (size_t c = 0; c < levels.size(); c++) {
+    levels[c] = std::lower_bound(thresholds.begin(), thresholds.end(), c) - thresholds.begin();
+  }
+
+  dyn_aux.build(all_aux_info, query);
+
+  const size_t chunk_size = dyn_aux.chunk_size, lowest = thresholds.front();
+  count_chunks(dyn_aux, 0, dyn_aux.chunk_count(), ctx,
+      [&](size_t chunk) { return dyn_aux.chunk_bound[chunk] <= lowest; },
+      [&](size_t chunk, bool) { count_chunk<T, uint8_t, K>(dyn_aux, chunk, ctx); },
+      [&](size_t chunk) {
+        implb::populate_hits_multi(ctx.base(), chunk_size, lowest, chunk * chunk_size, levels, out);
+      });
+}
+
+namespace implb {
+
+/* P(X > threshold) for X ~ Poisson(lambda) */
+inline double poisson_tail(double lambda, size_t threshold) {
+  double term = std::exp(-lambda), cdf = 0;
+  for (size_t k = 0; k <= threshold; k++) {
+    cdf += term;
+    term *= lambda / (k + 1);
+    if (k > lambda && term < 1e-12) {
+      break;
+    }
+  }
+  return std::max(0.0, 1 - cdf);
+}
+
+/*
+ * Rough costs, in cycles, for choosing between the fused kernels and the plain ones:
+ * the plain kernels scan every counter of a chunk for hits, while the fused ones pay
+ * a little more for every element, plus the sort of the hits.
+ */
+constexpr double scan_counter_cost   = 1.0 / 32;
+constexpr double fused_element_cost  = 1.0;
+constexpr double fused_hit_cost      = 8;
+
+} // implb namespace
+
+/**
+ * True if fastscancount_avx2b_fused is expected to be faster than the plain algorithm
+ * for this query and threshold, i.e., if the hit rate is low. The expected number of
+ * hits in each chunk comes from treating the counters as Poisson with the chunk's
+ * mean count, which is about right when the arrays are independent.
+ */
+template <typename T>
+bool prefer_fused(const implb::dynamic_aux<T>& dyn_aux, size_t threshold) {
+  double plain = 0, fused = 0;
+  for (size_t chunk = 0; chunk < dyn_aux.chunk_count(); chunk++) {
+    if (dyn_aux.chunk_bound[chunk] <= threshold) {
+      continue; // skipped either way
+    }
+    double elements = dyn_aux.chunk_elements[chunk];
+    double hits = dyn_aux.chunk_size * implb::poisson_tail(elements / dyn_aux.chunk_size, threshold);
+    plain += dyn_aux.chunk_size * implb::scan_counter_cost;
+    fused += elements * implb::fused_element_cost + hits * implb::fused_hit_cost;
+  }
+  return fused < plain;
+}
+
+/**
+ * Like fastscancount_avx2b_chunks, but using a fused kernel FK, which records the hits
+ * as the counters reach the threshold, so the counters don't need to be scanned: the
+ * hits for each chunk are sorted instead. Hits recorded in the overshoot region belong
+ * to the next chunk, so they are carried over along with the counters, when the next
+ * chunk is counted.
+ */
+template <typename T, typename C, fused_kernel_fn<T, C> FK>
+void fastscancount_avx2b_fused_chunks(const implb::dynamic_aux<T>& dyn_aux, std::vector<uint32_t> &out,
+                                      size_t threshold, size_t start_chunk, size_t end_chunk,
+                                      avx2b_context_t<C>& ctx, std::vector<uint32_t> *counts = nullptr) {
+
+  using aux_chunk = implb::aux_chunk_t<T>;
+
+  assert(start_chunk <= end_chunk && end_chunk <= dyn_aux.chunk_count());
+  assert(threshold < std::numeric_limits<C>::max());
+
+  const size_t chunk_size = dyn_aux.chunk_size;
+
+  // Every counter crosses the threshold at most once per chunk, except counter 0 which
+  // the filler elements can wrap around, once per 256 increments. Apart from those, a
+  // chunk records at most one hit per element in its range or its overshoot (at most
+  // one block per array), plus the hits carried from the previous chunk's overshoot.
+  size_t max_elements = 0;
+  for (size_t chunk = start_chunk ? start_chunk - 1 : 0; chunk < end_chunk; chunk++) {
+    max_elements = std::max(max_elements, (size_t)dyn_aux.chunk_elements[chunk]);
+  }
+  const size_t array_count = dyn_aux.array_count + 1;
+  auto& hits = ctx.hits;
+  grow(hits, std::min(2 * (max_elements + array_count * unroll), counters_size)
+             + array_count * unroll / 256 + 2);
+  // the sorted hits of the last chunk counted are [hits.data(), hits_end)
+  uint32_t* hits_end = hits.data();
+
+  /* the hits for the last chunk counted, ignoring the counters before COUNTER_OFFSET */
+  auto chunk_hits = [&]() {
+    return std::make_pair(std::lower_bound(hits.data(), hits_end, (uint32_t)COUNTER_OFFSET),
+                          std::lower_bound(hits.data(), hits_end, (uint32_t)(COUNTER_OFFSET + chunk_size)));
+  };
+
+  /* move the hits in the overshoot region of the last chunk to the start of hits, then count this one */
+  auto count = [&](size_t chunk, bool carried) {
+    size_t carried_hits = 0;
+    if (carried) {
+      for (uint32_t* h = chunk_hits().second; h != hits_end; h++) {
+        hits[carried_hits++] = *h - chunk_size;
+      }
+    }
+    hits_end = hits.data() + carried_hits;
+    if (!dyn_aux.have_work(chunk)) {
+      return;
+    }
+    const aux_chunk* aux_ptr = dyn_aux.aux_begin(chunk), *aux_end = dyn_aux.aux_end(chunk);
+    hits_end = FK(aux_ptr, aux_end, threshold, ctx.counters, hits_end);
+    assert(hits_end < hits.data() + hits.size());
+    std::sort(hits.data(), hits_end);
+  };
+
+  count_chunks(dyn_aux, start_chunk, end_chunk, ctx,
+      [&](size_t chunk) { return dyn_aux.chunk_bound[chunk] <= threshold; },
+      count,
+      [&](size_t chunk) {
+        auto range = chunk_hits();
+        const uint32_t range_start = chunk * chunk_size;
+        for (auto h = range.first; h != range.second; h++) {
+          out.push_back(range_start + *h - COUNTER_OFFSET);
+          if (counts) {
+            counts->push_back(ctx.counters[*h]);
+          }
+        }
+      });
+}
+
+/**
+ * The AVX2B algorithm with a fused kernel FK, e.g., record_hits_asm_fused16, which
+ * detects hits during counting rather than scanning the counters afterwards: see
+ * prefer_fused for when that pays off.
+ */
+template <typename T, fused_kernel_fn<T> FK>
+void fastscancount_avx2b_fused(const data_ptrs &, std::vector<uint32_t> &out,
+                               uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                               const std::vector<uint32_t>& query, avx2b_context& ctx = default_context()) {
+
+  _mm256_zeroupper();
 
   out.clear();
-  const size_t dsize = query.size();
 
-  dynamic_aux dyn_aux(all_aux_info, query);
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
+
+  fastscancount_avx2b_fused_chunks<T, uint8_t, FK>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx);
+}
+
+/**
+ * The AVX2B algorithm using either the plain kernel K or the fused kernel FK,
+ * whichever prefer_fused expects to be faster for this query.
+ */
+template <typename T, kernel_fn<T> K, fused_kernel_fn<T> FK>
+void fastscancount_avx2b_auto(const data_ptrs &, std::vector<uint32_t> &out,
+                              uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query, avx2b_context& ctx = default_context()) {
 
-  memzero(counters, sizeof(counters));
-  for (uint32_t range_start = 0, chunk = 0; range_start <= dyn_aux.largest; range_start += cache_size, chunk++) {
-    uint32_t range_end = range_start + cache_size;
+  _mm256_zeroupper();
 
-    assert(dyn_aux.aux.at(chunk).size() == dsize + 1);
-    const aux_chunk* aux_ptr = dyn_aux.aux.at(chunk).data(), *aux_end = aux_ptr + dsize;
+  out.clear();
 
-    DBG(printf("chunk %du range_start: %du end: %du iters_left %u first %u\n",
-        chunk, range_start, range_end, aux_ptr->iter_count, *aux_ptr->start_ptr);)
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
 
-    K(aux_ptr, aux_end, range_start);
+  if (prefer_fused(dyn_aux, threshold)) {
+    fastscancount_avx2b_fused_chunks<T, uint8_t, FK>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx);
+  } else {
+    fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx);
+  }
+}
 
-    populate_hits_avx(counter_base, cache_size, threshold, range_start, out);
+/**
+ * A version which only returns the hits in [lo, hi). Only the chunks which overlap
+ * the window (and the one before it, for its overshoot) are built and counted, and
+ * the hits in the partial chunks at either end are trimmed to the window.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b_range(const data_ptrs &, std::vector<uint32_t> &out,
+                               uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                               const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                               avx2b_context& ctx = default_context()) {
 
-    uint32_t overshoot = dyn_aux.max_overshoot[chunk];
-    //printf("overshoot: %u\n", overshoot);
-    assert(overshoot < cache_size);
-    // memcpy(counters, counters + cache_size, overshoot);
-    copymem(counter_base, counter_base + cache_size, overshoot);
-    // memset(counters + overshoot, 0, cache_size);
-    memzero<cache_size>(counter_base + overshoot);
+  _mm256_zeroupper();
+
+  out.clear();
+  if (lo >= hi) {
+    return;
+  }
+
+  const size_t chunk_size = all_aux_info.chunk_size;
+  size_t start_chunk = lo / chunk_size, end_chunk = div_up((size_t)hi, chunk_size);
+
+  implb::dynamic_aux<T> dyn_aux;
+  dyn_aux.build(all_aux_info, query, start_chunk ? start_chunk - 1 : 0, end_chunk);
+
+  end_chunk = std::min(end_chunk, dyn_aux.chunk_count());
+  if (start_chunk < end_chunk) {
+    fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, start_chunk, end_chunk, ctx);
+  }
+
+  trim_hits(out, 0, lo, hi);
+}
+
+/**
+ * The AVX2B algorithm with 16-bit counters, for queries with more than 255 arrays or
+ * thresholds larger than 254. It uses the same aux data and chunk size as the 8-bit
+ * version: the counters for a chunk take twice the space (about 80 KB plus the
+ * overshoot), which still fits comfortably in L2.
+ *
+ * K must be a kernel which increments 16-bit counters, e.g., record_hits_asm_branchy16w.
+ */
+template <typename T, kernel_fn<T, uint16_t> K>
+void fastscancount_avx2b_wide(const data_ptrs &, std::vector<uint32_t> &out,
+                              uint16_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query, avx2b_context16& ctx) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
+
+  fastscancount_avx2b_chunks<T, uint16_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx);
+}
+
+/**
+ * As above, using the default (thread-local) context.
+ */
+template <typename T, kernel_fn<T, uint16_t> K>
+void fastscancount_avx2b_wide(const data_ptrs &data, std::vector<uint32_t> &out,
+                              uint16_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query) {
+  fastscancount_avx2b_wide<T, K>(data, out, threshold, all_aux_info, query, default_context<uint16_t>());
+}
+
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i] is
+ * the count for out[i].
+ */
+template <typename T, kernel_fn<T, uint16_t> K>
+void fastscancount_avx2b_wide(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                              uint16_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query,
+                              avx2b_context16& ctx = default_context<uint16_t>()) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+  counts.clear();
+
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
+
+  fastscancount_avx2b_chunks<T, uint16_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), ctx, &counts);
+}
+
+namespace implb {
+
+/* true if a is a better top-k hit than b: a higher count, or the same count and a lower id */
+inline bool better_hit(const scored_hit& a, const scored_hit& b) {
+  return a.count > b.count || (a.count == b.count && a.id < b.id);
+}
+
+/**
+ * Add the hits from one chunk of counters to the top-k heap. Once the heap
+ * is full, only counters larger than the current kth best count can make it
+ * in, so we use that as the threshold for the scan, which rises as better
+ * hits are found.
+ */
+template <typename C>
+HEDLEY_NEVER_INLINE
+void populate_topk(C *array, size_t range, size_t start, size_t k, std::vector<scored_hit>& heap) {
+  size_t threshold = heap.size() == k ? heap.front().count : 0;
+  while (true) {
+    size_t next = find_next_gt_any(array, range, threshold);
+    if (next == SIZE_MAX)
+      break;
+    heap.push_back({(uint32_t)(start + next), array[next]});
+    std::push_heap(heap.begin(), heap.end(), better_hit);
+    if (heap.size() > k) {
+      std::pop_heap(heap.begin(), heap.end(), better_hit);
+      heap.pop_back();
+    }
+    if (heap.size() == k) {
+      threshold = heap.front().count;
+    }
+    range -= (next + 1);
+    array += (next + 1);
+    start += (next + 1);
+  }
+}
+
+} // implb namespace
+
+/**
+ * Top-k version of the AVX2B algorithm: rather than returning the elements which
+ * occur more than threshold times, return the k elements which occur the most
+ * times, with their counts, ordered from highest to lowest count. Ties are broken
+ * in favor of the lower element.
+ *
+ * The kth best count seen so far acts as a rising threshold: the scan for hits in
+ * each chunk only considers counters above it, and once k hits have been found,
+ * chunks where fewer arrays than that have any elements are not counted at all.
+ *
+ * With 8-bit counters the query must have fewer than 128 arrays, since the
+ * 8-bit scan uses a signed compare, or std::invalid_argument is thrown: use 16-bit
+ * counters for larger queries.
+ */
+template <typename T, typename C, kernel_fn<T, C> K>
+void fastscancount_avx2b_topk(const data_ptrs &, std::vector<scored_hit> &out,
+                              size_t k, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query, avx2b_context_t<C>& ctx) {
+
+  if (query.size() >= (sizeof(C) == 1 ? 128 : std::numeric_limits<C>::max())) {
+    throw std::invalid_argument("too many arrays for " + std::to_string(8 * sizeof(C))
+                                + "-bit top-k counters: " + std::to_string(query.size()));
+  }
+
+  _mm256_zeroupper();
+
+  out.clear();
+  if (k == 0 || query.empty()) {
+    return;
   }
+
+  implb::dynamic_aux dyn_aux(all_aux_info, query);
+
+  const size_t chunk_size = dyn_aux.chunk_size;
+  count_chunks(dyn_aux, 0, dyn_aux.chunk_count(), ctx,
+      // nothing in a chunk with no more arrays than the current kth best count can beat it
+      [&](size_t chunk) { return out.size() == k && dyn_aux.chunk_bound[chunk] <= out.front().count; },
+      [&](size_t chunk, bool) { count_chunk<T, C, K>(dyn_aux, chunk, ctx); },
+      [&](size_t chunk) { implb::populate_topk(ctx.base(), chunk_size, chunk * chunk_size, k, out); });
+
+  std::sort_heap(out.begin(), out.end(), implb::better_hit);
+}
+
+/**
+ * As above, using the default (thread-local) context.
+ */
+template <typename T, typename C, kernel_fn<T, C> K>
+void fastscancount_avx2b_topk(const data_ptrs &data, std::vector<scored_hit> &out,
+                              size_t k, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query) {
+  fastscancount_avx2b_topk<T, C, K>(data, out, k, all_aux_info, query, default_context<C>());
 }
 
 template <kernel_fn32 K>
-const auto fastscancount_avx2b32 = fastscancount_avx2b<uint32_t, K>;
+void fastscancount_avx2b32(const data_ptrs &data, std::vector<uint32_t> &out,
+                           uint8_t threshold, const implb::all_aux_t<uint32_t>& all_aux_info,
+                           const std::vector<uint32_t>& query) {
+  fastscancount_avx2b<uint32_t, K>(data, out, threshold, all_aux_info, query);
+}
 
+} // namespace FASTSCANCOUNT_ISA
 } // namespace fastscancount
 #endif
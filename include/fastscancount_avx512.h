@@ -16,13 +16,17 @@
 #include <vector>
 #include <stdexcept>
 
+#include "scratch.hpp"
+#include "simd-support.hpp"
+
 namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
 namespace {
 
 // credit: inspired by 256-bit implementation of Travis Downs
 void populate_hits_avx512(std::vector<uint8_t> &counters, size_t range,
                        size_t threshold, size_t start,
-                       std::vector<uint32_t> &out) {
+                       std::vector<uint32_t> &out, std::vector<uint32_t> *counts) {
   uint8_t *array = counters.data();
 
   size_t vsize = range / 64;
@@ -38,14 +42,21 @@ void populate_hits_avx512(std::vector<uint8_t> &counters, size_t range,
       bits >>= zqty;
       bits >>= 1; // If zqty = 63, shift by 64 is not defined, need to split shifts
       out.push_back(start_add + zqty);
+      if (counts) {
+        counts->push_back(array[start_add + zqty - start]);
+      }
       start_add += zqty + 1;
     }
   }
 
   for (size_t i = vsize * 64; i < range; i++) {
     auto v = array[i];
-    if (v > threshold)
+    if (v > threshold) {
       out.push_back(start + i);
+      if (counts) {
+        counts->push_back(v);
+      }
+    }
   }
 
 }
@@ -60,23 +71,11 @@ void update_counters_avx512(const uint32_t  *&it_, const uint32_t  *end,
   size_t qty = end - it_;
   size_t vsize = qty / 16;
 
-  __m512i *varray = (__m512i *)it_;
-  const __m512i add1 = _mm512_set1_epi32(1);
   const __m512i shift_vect = _mm512_set1_epi32(shift);
 
-  const __mmask64 blend_mask = 0x1111111111111111ull;
-
-  for (unsigned i = 0; i < vsize; ++i) {
-    __m512i indx = _mm512_sub_epi32(_mm512_loadu_si512(varray + i), shift_vect);
-    __m512i v_orig = _mm512_i32gather_epi32(indx, (const int*)counters, 1);
-    // Note: works correctly only if counters never overflow
-    // First, we increment counters.
-    __m512i v_inc = _mm512_add_epi32(v_orig, add1);
-    // Then, we will blend by keeping three higher-order bytes in each 32-bit word unmodified
-    // When 32-bit words overlap, the gather operation would first write the old values of the word
-    // then it will overwrite them with new values. So, this should work just fine.
-    __m512i v = v_inc; // _mm512_mask_blend_epi8(blend_mask, v_orig, v_inc);
-    _mm512_i32scatter_epi32((int*)counters, indx, v, 1);
+  for (size_t i = 0; i < vsize; ++i) {
+    __m512i indx = _mm512_sub_epi32(_mm512_loadu_si512(it_ + i * 16), shift_vect);
+    increment_bytes_avx512(counters, indx);
   }
 
   // tail processing
@@ -87,14 +86,14 @@ void update_counters_avx512(const uint32_t  *&it_, const uint32_t  *end,
   it_ = end;
 }
 
-
-} // namespace
-
-void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
-                          std::vector<uint32_t> &out, uint8_t threshold,
-                          uint32_t cache_size,
-                          const std::vector<const std::vector<uint32_t>*> &range_ends) {
-  std::vector<uint8_t> counters(cache_size);
+// if counts is not null, the count for each hit is appended to it
+void fastscancount_avx512_impl(const std::vector<const std::vector<uint32_t>*> &data,
+                               std::vector<uint32_t> &out, std::vector<uint32_t> *counts,
+                               uint8_t threshold, uint32_t cache_size,
+                               const std::vector<const std::vector<uint32_t>*> &range_ends,
+                               scan_scratch &scratch) {
+  grow(scratch.counters, cache_size);
+  auto &counters = scratch.counters;
   out.clear();
   const size_t dsize = data.size();
   if (!dsize) {
@@ -113,7 +112,8 @@ void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
 
   auto cdata = counters.data();
 
-  std::vector<const uint32_t*> it(dsize);
+  auto &it = scratch.ptrs;
+  it.assign(dsize, nullptr);
   for (unsigned k = 0; k < dsize; ++k) {
     const auto& v = *data[k];
     if (!v.empty()) {
@@ -130,9 +130,53 @@ void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
       update_counters_avx512(it[k], &v[0] + r[i], cdata, start);
     }
 
-    populate_hits_avx512(counters, cache_size, threshold, start, out);
+    populate_hits_avx512(counters, cache_size, threshold, start, out, counts);
   }
 }
 
+} // namespace
+
+/**
+ * Uses the scratch memory given, which must not be used by another thread at the
+ * same time, rather than allocating it.
+ */
+void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
+                          std::vector<uint32_t> &out, uint8_t threshold,
+                          uint32_t cache_size,
+                          const std::vector<const std::vector<uint32_t>*> &range_ends,
+                          scan_scratch &scratch) {
+  fastscancount_avx512_impl(data, out, nullptr, threshold, cache_size, range_ends, scratch);
+}
+
+void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
+                          std::vector<uint32_t> &out, uint8_t threshold,
+                          uint32_t cache_size,
+                          const std::vector<const std::vector<uint32_t>*> &range_ends) {
+  scan_scratch scratch;
+  fastscancount_avx512(data, out, threshold, cache_size, range_ends, scratch);
+}
+
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i]
+ * is the count for out[i].
+ */
+void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
+                          std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                          uint8_t threshold, uint32_t cache_size,
+                          const std::vector<const std::vector<uint32_t>*> &range_ends,
+                          scan_scratch &scratch) {
+  counts.clear();
+  fastscancount_avx512_impl(data, out, &counts, threshold, cache_size, range_ends, scratch);
+}
+
+void fastscancount_avx512(const std::vector<const std::vector<uint32_t>*> &data,
+                          std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                          uint8_t threshold, uint32_t cache_size,
+                          const std::vector<const std::vector<uint32_t>*> &range_ends) {
+  scan_scratch scratch;
+  fastscancount_avx512(data, out, counts, threshold, cache_size, range_ends, scratch);
+}
+
+} // namespace FASTSCANCOUNT_ISA
 } // namespace fastscancount
 #endif
@@ -0,0 +1,208 @@
+#ifndef HYBRID_H_
+#define HYBRID_H_
+
+#include "bitscan.hpp"
+#include "fastscancount_avx2b.h"
+
+#include <cassert>
+#include <stdexcept>
+#include <vector>
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+/*
+ * Rough costs, in cycles, used to pick an engine for each region. For AVX2B we pay
+ * for every element, plus a fixed amount per region to scan the counters for hits
+ * and zero them. For bitscan we pay for every chunk of every array, whether or not
+ * it has any elements, plus a little for each non-empty subchunk.
+ */
+constexpr double hybrid_avx2b_element_cost = 1.5;
+constexpr double hybrid_avx2b_region_cost  = 2000;
+constexpr double hybrid_bitscan_chunk_cost = 2;
+constexpr double hybrid_bitscan_elem_cost  = 0.25;
+
+/*
+ * Each region is one AVX2B chunk, so this is the region size unless the AVX2B aux
+ * data was built with a smaller chunk size. Regions don't line up with bitscan
+ * chunks, but the bitscan range functions trim their output, so a bitscan chunk
+ * which straddles two regions is just counted twice if both use bitscan.
+ */
+constexpr size_t hybrid_region_size = cache_size;
+
+enum class region_engine : uint8_t { skip, avx2b, bitscan };
+
+/**
+ * Aux data for the hybrid engine: the AVX2B and bitscan aux data for the same
+ * arrays (which must outlive this object), plus a per-array, per-region cost
+ * estimate calculated once when the index is built.
+ */
+template <typename T>
+struct hybrid_aux {
+  const implb::all_aux_t<T>& avx2b;
+  const bitscan_all_aux<uint32_t>& bitscan;
+
+  /*
+   * For each array, the estimated cost of bitscan minus the cost of AVX2B for the
+   * array's elements in each region: negative where bitscan is cheaper. Costs are
+   * additive across arrays, so a query only needs to sum these.
+   */
+  std::vector<std::vector<float>> region_delta;
+
+  hybrid_aux(const implb::all_aux_t<T>& avx2b, const bitscan_all_aux<uint32_t>& bitscan)
+      : avx2b{avx2b}, bitscan{bitscan} {
+    if (avx2b.aux_data.size() != bitscan.bitmaps.size() || avx2b.largest != bitscan.largest) {
+      throw std::invalid_argument("AVX2B and bitscan aux data must be for the same arrays");
+    }
+    constexpr size_t chunk_bits = compressed_bitmap<uint32_t>::chunk_bits;
+    const size_t regions = region_count();
+    region_delta.resize(avx2b.aux_data.size());
+    for (size_t a = 0; a < region_delta.size(); a++) {
+      auto& control = bitscan.bitmaps[a].control;
+      auto& range_counts = avx2b.aux_data[a].range_counts;
+      assert(range_counts.size() == regions);
+      auto& delta = region_delta[a];
+      delta.resize(regions);
+      for (size_t r = 0; r < regions; r++) {
+        // the bitscan chunks which overlap this region
+        size_t first = r * region_size() / chunk_bits,
+               last = std::min(div_up((r + 1) * region_size(), chunk_bits), control.size());
+        size_t subchunks = 0;
+        for (size_t c = first; c < last; c++) {
+          subchunks += __builtin_popcount(control[c]);
+        }
+        delta[r] = (last - first) * hybrid_bitscan_chunk_cost + subchunks * hybrid_bitscan_elem_cost
+            - range_counts[r] * hybrid_avx2b_element_cost;
+      }
+    }
+  }
+
+  size_t region_count() const {
+    return div_up(largest() + 1, (uint32_t)region_size());
+  }
+
+  size_t region_size() const {
+    return avx2b.chunk_size;
+  }
+
+  uint32_t largest() const {
+    return avx2b.largest;
+  }
+};
+
+/**
+ * Scratch memory for the hybrid engine, kept across queries to avoid allocating it
+ * every time, like query_context. It must not be used by another thread at the same
+ * time.
+ */
+template <typename T>
+struct hybrid_scratch {
+  /* the engine for each region, see hybrid_plan */
+  std::vector<region_engine> plan;
+
+  /* the summed cost deltas and element counts for each region */
+  std::vector<double> delta;
+  std::vector<uint32_t> elements;
+
+  implb::dynamic_aux<T> dyn_aux;
+
+  bitscan_scratch<uint32_t> bitscan;
+};
+
+/**
+ * Pick the engine for each region for the given query, leaving the plan in
+ * scratch.plan: regions where no array in the query has an element are skipped,
+ * and the others use whichever engine the summed cost estimates favour.
+ */
+template <typename T>
+void hybrid_plan(const hybrid_aux<T>& aux, const std::vector<uint32_t>& query,
+                 hybrid_scratch<T>& scratch) {
+  const size_t regions = aux.region_count();
+  auto& delta = scratch.delta;
+  auto& elements = scratch.elements;
+  delta.assign(regions, -hybrid_avx2b_region_cost);
+  elements.assign(regions, 0);
+  for (auto q : query) {
+    auto& qdelta = aux.region_delta.at(q);
+    auto& counts = aux.avx2b.aux_data[q].range_counts;
+    for (size_t r = 0; r < regions; r++) {
+      delta[r] += qdelta[r];
+      elements[r] += counts[r];
+    }
+  }
+
+  auto& plan = scratch.plan;
+  plan.resize(regions);
+  for (size_t r = 0; r < regions; r++) {
+    plan[r] = elements[r] == 0 ? region_engine::skip :
+              delta[r] < 0     ? region_engine::bitscan : region_engine::avx2b;
+  }
+}
+
+/* as above, returning the plan in plan, with scratch memory just for this query */
+template <typename T>
+void hybrid_plan(const hybrid_aux<T>& aux, const std::vector<uint32_t>& query,
+                 std::vector<region_engine>& plan) {
+  hybrid_scratch<T> scratch;
+  hybrid_plan(aux, query, scratch);
+  plan.swap(scratch.plan);
+}
+
+/* the bitscan range functions which take scratch memory, e.g., bitscan_avx512<uint32_t> */
+using bitscan_range_fn = void (const data_ptrs &, std::vector<uint32_t> &, uint8_t,
+                               const bitscan_all_aux<uint32_t>&, const std::vector<uint32_t>&,
+                               uint32_t, uint32_t, bitscan_scratch<uint32_t>&);
+
+/**
+ * A hybrid engine which splits the domain into regions of one AVX2B chunk and
+ * counts each run of consecutive regions with the same engine (see hybrid_plan) using
+ * either the AVX2B algorithm with kernel K or the bitscan function BS, so that dense
+ * stretches of the domain use bitscan and sparse ones AVX2B. The runs are handled in
+ * order, so the hits come out in increasing order.
+ *
+ * The plan, the AVX2B aux data for the query and the bitscan accumulators live in
+ * scratch, and the counters in ctx, so once those have seen queries as large as this
+ * one, running it doesn't allocate.
+ */
+template <typename T, kernel_fn<T> K, bitscan_range_fn* BS>
+void hybrid_scancount(const data_ptrs &data, std::vector<uint32_t> &out,
+                      uint8_t threshold, const hybrid_aux<T>& aux,
+                      const std::vector<uint32_t>& query, hybrid_scratch<T>& scratch,
+                      avx2b_context& ctx = default_context()) {
+
+  out.clear();
+
+  hybrid_plan(aux, query, scratch);
+
+  const auto& plan = scratch.plan;
+  auto& dyn_aux = scratch.dyn_aux;
+  for (size_t start = 0, end; start < plan.size(); start = end) {
+    auto engine = plan[start];
+    for (end = start + 1; end < plan.size() && plan[end] == engine; end++) {}
+
+    if (engine == region_engine::bitscan) {
+      BS(data, out, threshold, aux.bitscan, query, start * aux.region_size(),
+          std::min((size_t)aux.largest() + 1, end * aux.region_size()), scratch.bitscan);
+    } else if (engine == region_engine::avx2b) {
+      _mm256_zeroupper();
+      // only the chunks for this run (and the one before, for its overshoot) are built
+      dyn_aux.build(aux.avx2b, query, start ? start - 1 : 0, end);
+      assert(end <= dyn_aux.chunk_count());
+      fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, start, end, ctx);
+    }
+  }
+}
+
+/* as above, with scratch memory just for this query */
+template <typename T, kernel_fn<T> K, bitscan_range_fn* BS>
+void hybrid_scancount(const data_ptrs &data, std::vector<uint32_t> &out,
+                      uint8_t threshold, const hybrid_aux<T>& aux,
+                      const std::vector<uint32_t>& query) {
+  hybrid_scratch<T> scratch;
+  hybrid_scancount<T, K, BS>(data, out, threshold, aux, query, scratch);
+}
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MERGE_H_
+#define MERGE_H_
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fastscancount {
+
+/**
+ * Scratch memory for merge_scancount, kept across queries to avoid allocating it
+ * every time: see query_context.
+ */
+struct merge_scratch {
+  std::vector<uint32_t> keys, tmp;
+  /* the radix sort histograms */
+  std::vector<uint32_t> hist;
+};
+
+/**
+ * Merge-based scancount for sparse queries, whose cost depends only on the total
+ * size of the arrays, not on the range of elements they span.
+ *
+ * All the elements are radix sorted together, skipping the digits above the
+ * largest element, and then an element occurs more than threshold times exactly
+ * when the sorted copy at its first occurrence plus threshold is the same element,
+ * so the runs are counted without a counter array.
+ *
+ * The chunked engines zero and scan a block of counters for every chunk the query
+ * spans, which dominates for queries with only a few thousand elements spread over
+ * a large domain: see prefer_merge.
+ *
+ * The hits are written to out in increasing order.
+ */
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold);
+
+/* as above, using the given scratch memory rather than allocating it */
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold,
+                     merge_scratch &scratch);
+
+/**
+ * As above, but also return the number of arrays each hit occurs in: counts[i] is
+ * the count for out[i].
+ */
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                     uint8_t threshold);
+
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                     uint8_t threshold, merge_scratch &scratch);
+
+/**
+ * True if merge_scancount is expected to be cheaper than the chunked engines, e.g.,
+ * fastscancount_avx2b, for the given arrays: that is, when the per-chunk cost of
+ * the chunked engines over the domain the arrays span outweighs the extra cost per
+ * element of sorting.
+ */
+bool prefer_merge(const data_ptrs &data);
+
+} // namespace fastscancount
+
+#endif
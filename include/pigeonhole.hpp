@@ -0,0 +1,68 @@
+#ifndef PIGEONHOLE_H_
+#define PIGEONHOLE_H_
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fastscancount {
+
+/**
+ * Scratch memory for pigeonhole_scancount, kept across queries to avoid allocating
+ * it every time: see query_context.
+ */
+struct pigeonhole_scratch {
+  struct candidate {
+    uint32_t id;
+    uint32_t count; // the number of arrays seen so far which contain id
+  };
+
+  /* the arrays of the query in increasing order of size */
+  data_ptrs arrays;
+  /* the candidates, and the buffers they are merged through */
+  std::vector<candidate> cands, tmp, merged;
+};
+
+/**
+ * Candidate-and-probe scancount for thresholds close to the number of arrays.
+ *
+ * An element which occurs more than threshold times in n arrays must occur in at
+ * least one of any n - threshold of the arrays, so the candidates are taken from
+ * the n - threshold shortest arrays, and each of the remaining (long) arrays is
+ * only probed for the candidates which can still make it over the threshold. The
+ * probes use galloping search, with several independent searches interleaved so
+ * that their cache misses overlap.
+ *
+ * The hits are written to out in increasing order. Like the other engines this
+ * takes the arrays for a query directly.
+ */
+void pigeonhole_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold);
+
+/* as above, using the given scratch memory */
+void pigeonhole_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold,
+                          pigeonhole_scratch &scratch);
+
+/**
+ * An estimate of the number of elements pigeonhole_scancount would touch for the given
+ * arrays and threshold, to compare against the total size of the arrays, which is about
+ * what the scanning engines touch.
+ */
+size_t pigeonhole_cost(const data_ptrs &data, uint8_t threshold);
+
+/* as above, using the given scratch memory */
+size_t pigeonhole_cost(const data_ptrs &data, uint8_t threshold, pigeonhole_scratch &scratch);
+
+/**
+ * True if pigeonhole_scancount is expected to be much cheaper than scanning all the
+ * arrays, e.g., with fastscancount_avx2b, for the given arrays and threshold.
+ */
+bool prefer_pigeonhole(const data_ptrs &data, uint8_t threshold);
+
+/* as above, using the given scratch memory */
+bool prefer_pigeonhole(const data_ptrs &data, uint8_t threshold, pigeonhole_scratch &scratch);
+
+} // namespace fastscancount
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef QUERY_CONTEXT_H_
+#define QUERY_CONTEXT_H_
+
+#include "bitscan.hpp"
+#include "fastscancount_avx2b.h"
+#include "merge.hpp"
+#include "pigeonhole.hpp"
+#include "scratch.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+/**
+ * All the scratch memory needed to run a query. Use one object per thread:
+ * a thread can then run any number of queries without sharing state with
+ * other threads, reusing the memory from its earlier queries. The memory
+ * only ever grows, so once a context has seen queries as large as the ones
+ * it gets, running a query doesn't allocate at all.
+ *
+ * The AVX2B functions below take the whole context, and the other algorithms
+ * take the part of it they use, e.g., fastscancount(data, out, threshold, ctx.scan).
+ *
+ * This object embeds the AVX2B counters, so it is large and should be
+ * allocated on the heap.
+ */
+struct query_context {
+  /* counters for the AVX2B algorithm */
+  avx2b_context avx2b;
+
+  /* per-query aux data for the AVX2B algorithm, one for each rewritten element type */
+  implb::dynamic_aux<uint16_t> dyn_aux16;
+  implb::dynamic_aux<uint32_t> dyn_aux32;
+
+  /* for fastscancount, fastscancount_avx2 and fastscancount_avx512 */
+  scan_scratch scan;
+
+  merge_scratch merge;
+
+  pigeonhole_scratch pigeonhole;
+
+  bitscan_scratch<uint32_t> bitscan;
+
+  /* an output buffer which keeps its capacity across queries */
+  std::vector<uint32_t> out;
+
+  /* scratch for fastscancount_avx2b_planes */
+  std::vector<uint32_t> sorted_query, rest_query;
+
+  /* the threshold level of each count, for fastscancount_avx2b_multi */
+  std::vector<uint32_t> levels;
+
+  template <typename T>
+  implb::dynamic_aux<T>& dyn_aux();
+
+  /* the AVX2B counters of type C */
+  template <typename C>
+  avx2b_context_t<C>& counters();
+
+  /* the 16-bit counters for the wide AVX2B algorithm, allocated the first time they are used */
+  avx2b_context16& avx2b16() {
+    if (!wide) {
+      wide = std::make_unique<avx2b_context16>();
+    }
+    return *wide;
+  }
+
+private:
+  std::unique_ptr<avx2b_context16> wide;
+};
+
+template <>
+inline implb::dynamic_aux<uint16_t>& query_context::dyn_aux<uint16_t>() { return dyn_aux16; }
+
+template <>
+inline implb::dynamic_aux<uint32_t>& query_context::dyn_aux<uint32_t>() { return dyn_aux32; }
+
+template <>
+inline avx2b_context& query_context::counters<uint8_t>() { return avx2b; }
+
+template <>
+inline avx2b_context16& query_context::counters<uint16_t>() { return avx2b16(); }
+
+/**
+ * The AVX2B algorithm, using the counters and dynamic aux storage from the given context.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b(const data_ptrs &, std::vector<uint32_t> &out,
+                         uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                         const std::vector<uint32_t>& query, query_context& qctx) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  auto& dyn_aux = qctx.dyn_aux<T>();
+  dyn_aux.build(all_aux_info, query);
+
+  fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), qctx.avx2b);
+}
+
+/**
+ * fastscancount_avx2b_fused, using the given context.
+ */
+template <typename T, fused_kernel_fn<T> FK>
+void fastscancount_avx2b_fused(const data_ptrs &, std::vector<uint32_t> &out,
+                               uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                               const std::vector<uint32_t>& query, query_context& qctx) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  auto& dyn_aux = qctx.dyn_aux<T>();
+  dyn_aux.build(all_aux_info, query);
+
+  fastscancount_avx2b_fused_chunks<T, uint8_t, FK>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), qctx.avx2b);
+}
+
+/**
+ * fastscancount_avx2b_auto, using the given context.
+ */
+template <typename T, kernel_fn<T> K, fused_kernel_fn<T> FK>
+void fastscancount_avx2b_auto(const data_ptrs &, std::vector<uint32_t> &out,
+                              uint8_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query, query_context& qctx) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  auto& dyn_aux = qctx.dyn_aux<T>();
+  dyn_aux.build(all_aux_info, query);
+
+  if (prefer_fused(dyn_aux, threshold)) {
+    fastscancount_avx2b_fused_chunks<T, uint8_t, FK>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), qctx.avx2b);
+  } else {
+    fastscancount_avx2b_chunks<T, uint8_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), qctx.avx2b);
+  }
+}
+
+/**
+ * fastscancount_avx2b_multi, using the given context.
+ */
+template <typename T, kernel_fn<T> K>
+void fastscancount_avx2b_multi(const data_ptrs &data, std::vector<std::vector<uint32_t>> &out,
+                               const std::vector<uint8_t>& thresholds, const implb::all_aux_t<T>& all_aux_info,
+                               const std::vector<uint32_t>& query, query_context& qctx) {
+  fastscancount_avx2b_multi<T, K>(data, out, thresholds, all_aux_info, query, qctx.avx2b,
+                                  qctx.dyn_aux<T>(), qctx.levels);
+}
+
+/**
+ * fastscancount_avx2b_wide, using the given context.
+ */
+template <typename T, kernel_fn<T, uint16_t> K>
+void fastscancount_avx2b_wide(const data_ptrs &, std::vector<uint32_t> &out,
+                              uint16_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                              const std::vector<uint32_t>& query, query_context& qctx) {
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  auto& dyn_aux = qctx.dyn_aux<T>();
+  dyn_aux.build(all_aux_info, query);
+
+  fastscancount_avx2b_chunks<T, uint16_t, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), qctx.avx2b16());
+}
+
+/**
+ * If the query contains one of the groups in planes, run the AVX2B algorithm with C
+ * bit counters and kernel K over the other arrays of the query, adding the counts for
+ * the group from its planes (see count_planes), and return true. Otherwise return false
+ * and leave out alone. If the query contains more than one group, the largest is used.
+ */
+template <typename T, typename C, kernel_fn<T, C> K>
+bool fastscancount_avx2b_planes(const data_ptrs &, std::vector<uint32_t> &out,
+                                uint16_t threshold, const implb::all_aux_t<T>& all_aux_info,
+                                const std::vector<count_planes>& planes,
+                                const std::vector<uint32_t>& query, query_context& qctx) {
+
+  auto& sorted = qctx.sorted_query;
+  sorted.assign(query.begin(), query.end());
+  std::sort(sorted.begin(), sorted.end());
+  const count_planes* p = find_planes(planes, sorted);
+  if (!p) {
+    return false;
+  }
+
+  _mm256_zeroupper();
+
+  out.clear();
+
+  // any arrays the query has more than once are left in the rest for the extra times
+  auto& rest = qctx.rest_query;
+  rest.clear();
+  std::set_difference(sorted.begin(), sorted.end(), p->group.begin(), p->group.end(), std::back_inserter(rest));
+
+  auto& dyn_aux = qctx.dyn_aux<T>();
+  dyn_aux.build(all_aux_info, rest, 0, SIZE_MAX, p->largest);
+
+  fastscancount_avx2b_chunks<T, C, K>(dyn_aux, out, threshold, 0, dyn_aux.chunk_count(),
+                                      qctx.counters<C>(), nullptr, p);
+  return true;
+}
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
+
+#endif
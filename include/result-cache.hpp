@@ -0,0 +1,94 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include "dispatch.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace fastscancount {
+
+/**
+ * A bounded LRU cache of query results, keyed by the set of arrays in the query
+ * (the order doesn't matter) and the threshold.
+ *
+ * The hits are stored as varint-encoded deltas, which takes one or two bytes per
+ * hit for typical results rather than four. Entries are evicted, least recently
+ * used first, to keep the memory used within the budget given, and results larger
+ * than the whole budget aren't cached at all.
+ *
+ * The cache knows nothing about the index: whoever owns it must clear() it when the
+ * index changes. Like the engines, it must only be used by one thread at a time.
+ */
+class result_cache {
+public:
+  struct stats {
+    size_t hits, misses, evictions;
+    /* the number of entries and the memory they use, in bytes */
+    size_t entries, bytes;
+  };
+
+  explicit result_cache(size_t budget_bytes);
+
+  /*
+   * If the result for query and threshold is cached, write it to out and return
+   * true, otherwise return false and leave out as it was.
+   */
+  bool lookup(const std::vector<uint32_t>& query, uint8_t threshold, std::vector<uint32_t>& out);
+
+  /* cache hits, which must be the result for query and threshold, in increasing order */
+  void insert(const std::vector<uint32_t>& query, uint8_t threshold, const std::vector<uint32_t>& hits);
+
+  /* remove all the entries, e.g., because the index changed */
+  void clear();
+
+  size_t budget() const { return budget_bytes; }
+
+  stats get_stats() const;
+
+private:
+  struct entry {
+    uint64_t hash;
+    uint8_t threshold;
+    std::vector<uint32_t> arrays; // sorted
+    std::vector<uint8_t> encoded;
+    size_t hit_count;
+
+    size_t bytes() const;
+  };
+
+  using lru_list = std::list<entry>;
+
+  /* sort query into key and return its hash */
+  uint64_t make_key(const std::vector<uint32_t>& query, uint8_t threshold);
+
+  lru_list::iterator find(uint64_t hash, uint8_t threshold);
+
+  void evict_until(size_t bytes);
+
+  const size_t budget_bytes;
+  size_t used_bytes = 0;
+  size_t hits = 0, misses = 0, evictions = 0;
+
+  /* most recently used first */
+  lru_list lru;
+  std::unordered_map<uint64_t, lru_list::iterator> index;
+
+  /* the sorted query, kept to avoid allocating it every time */
+  std::vector<uint32_t> key;
+};
+
+/**
+ * Wrap inner in an engine which answers repeated queries from a result_cache with
+ * the given budget, in bytes. The cache is cleared whenever the tuning changes,
+ * since that may rebuild the index.
+ */
+std::unique_ptr<engine> make_cached_engine(std::unique_ptr<engine> inner, size_t budget_bytes);
+
+} // namespace fastscancount
+
+#endif
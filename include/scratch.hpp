@@ -0,0 +1,40 @@
+#ifndef SCRATCH_H_
+#define SCRATCH_H_
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+/* where the chunked algorithms are up to in one array */
+struct array_cursor {
+  const uint32_t *cur; // current pointer into data
+  const uint32_t *end; // pointer to end
+  uint32_t last;       // value of last element
+  array_cursor(const uint32_t *cur, const uint32_t *end, uint32_t last)
+      : cur{cur}, end{end}, last{last} {}
+};
+
+/**
+ * Scratch memory for fastscancount, fastscancount_avx2 and fastscancount_avx512,
+ * which can be passed to each of them to avoid allocating it on every query: see
+ * query_context. Each algorithm only uses some of the members.
+ */
+struct scan_scratch {
+  std::vector<uint8_t> counters;
+  /* the position reached in each array */
+  std::vector<size_t> iters;
+  std::vector<array_cursor> cursors;
+  std::vector<const uint32_t*> ptrs;
+  /* the hits are written here without bounds checks, then copied to out */
+  std::vector<uint32_t> hits;
+};
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
+
+#endif
@@ -8,18 +8,24 @@
 #include <iosfwd>
 #include <vector>
 
+#include "hedley.h"
+
 // #include "dbg.h"
 
 extern uint8_t g_pack_left_table_uint8_tx3[256 * 3 + 1];
+extern uint8_t g_expand_table_uint8_tx3[256 * 3 + 1];
+
+// the AVX2 helpers are only declared in files built with AVX2, see the Makefile
+#ifdef __AVX2__
 
 /** epi32 fill-in based on a costless cast and movemaskps */
-inline uint32_t _mm256_movemask_epi32(__m256i v) {
+HEDLEY_ALWAYS_INLINE uint32_t _mm256_movemask_epi32(__m256i v) {
     return _mm256_movemask_ps(_mm256_castsi256_ps(v));
 }
 
 // Generate Move mask via: _mm256_movemask_ps(_mm256_castsi256_ps(mask)); etc
 // author: Froglegs, see https://stackoverflow.com/a/36949578
-inline __m256i pack_left_epi32(__m256i values, uint32_t moveMask) {
+HEDLEY_ALWAYS_INLINE __m256i pack_left_epi32(__m256i values, uint32_t moveMask) {
     uint8_t *adr = g_pack_left_table_uint8_tx3 + moveMask * 3;
     __m256i indices = _mm256_set1_epi32(*reinterpret_cast<uint32_t*>(adr)); //lower 24 bits has our LUT
 
@@ -28,30 +34,104 @@ inline __m256i pack_left_epi32(__m256i values, uint32_t moveMask) {
     return _mm256_permutevar8x32_epi32(values, shufmask);
 }
 
-inline __m256i pack_left_epi32(__m256i values, __m256i mask) {
+HEDLEY_ALWAYS_INLINE __m256i pack_left_epi32(__m256i values, __m256i mask) {
     return pack_left_epi32(values, _mm256_movemask_epi32(mask));
 }
 
-inline __m256i _mm256_cmpgt_epu32(__m256i left, __m256i right) {
+/**
+ * The inverse of pack_left_epi32: the i-th set bit of moveMask gets element i of
+ * values (from the bottom), and the other elements are zeroed. Works like the
+ * AVX-512 vpexpandd.
+ */
+HEDLEY_ALWAYS_INLINE __m256i expand_epi32(__m256i values, uint32_t moveMask) {
+    uint8_t *adr = g_expand_table_uint8_tx3 + moveMask * 3;
+    __m256i indices = _mm256_set1_epi32(*reinterpret_cast<uint32_t*>(adr)); //lower 24 bits has our LUT
+
+    __m256i shufmask = _mm256_srlv_epi32 (indices, _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21));
+    __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i keep = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(moveMask), lane_bits), lane_bits);
+    return _mm256_and_si256(_mm256_permutevar8x32_epi32(values, shufmask), keep);
+}
+
+HEDLEY_ALWAYS_INLINE __m256i _mm256_cmpgt_epu32(__m256i left, __m256i right) {
     __m256i  left_shifted = _mm256_xor_si256( left, _mm256_set1_epi32(0x80000000));
     __m256i right_shifted = _mm256_xor_si256(right, _mm256_set1_epi32(0x80000000));
     return _mm256_cmpgt_epi32(left_shifted, right_shifted);
 }
 
+#ifdef __AVX512F__
+/**
+ * Increment the byte counters counters[idx[i]] for each of the 16 indexes in idx,
+ * correctly even when several indexes are equal or fall in the same dword.
+ *
+ * The counters are gathered and scattered as whole dwords, so lanes whose counters
+ * share a dword (found with vpconflictd) alias each other. With VPOPCNTDQ every lane
+ * adds up the increments of the lanes in its group up to and including itself, and
+ * since scatters to the same address happen in lane order, the last lane of each
+ * group, which has the group total, wins. Without it we fall back to one
+ * gather/scatter round per lane in the largest group.
+ *
+ * The counters must be readable and writable up to the end of the dword holding
+ * the largest index, and no counter may go past 255.
+ */
+HEDLEY_ALWAYS_INLINE void increment_bytes_avx512(uint8_t* counters, __m512i idx) {
+    const __m512i dword = _mm512_srli_epi32(idx, 2);
+    const __m512i conflicts = _mm512_conflict_epi32(dword);
+    const __m512i byte_shift = _mm512_slli_epi32(_mm512_and_si512(idx, _mm512_set1_epi32(3)), 3);
+
+    if (__builtin_expect(_mm512_test_epi32_mask(conflicts, conflicts) == 0, 1)) {
+        // every lane has its own dword: the common case unless the data is dense
+        __m512i old = _mm512_i32gather_epi32(dword, counters, 4);
+        __m512i inc = _mm512_sllv_epi32(_mm512_set1_epi32(1), byte_shift);
+        _mm512_i32scatter_epi32(counters, dword, _mm512_add_epi32(old, inc), 4);
+        return;
+    }
+
+#ifdef __AVX512VPOPCNTDQ__
+    const __m512i lane_bit = _mm512_sllv_epi32(_mm512_set1_epi32(1),
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    const __m512i group = _mm512_or_si512(conflicts, lane_bit);
+    const __m512i byte = _mm512_srli_epi32(byte_shift, 3);
+    __m512i inc = _mm512_setzero_si512();
+    for (int b = 0; b < 4; b++) {
+        // the number of lanes in the group so far which increment byte b
+        __mmask16 on_b = _mm512_cmpeq_epi32_mask(byte, _mm512_set1_epi32(b));
+        __m512i count = _mm512_popcnt_epi32(_mm512_and_si512(group, _mm512_set1_epi32(on_b)));
+        inc = _mm512_add_epi32(inc, _mm512_slli_epi32(count, 8 * b));
+    }
+    __m512i old = _mm512_i32gather_epi32(dword, counters, 4);
+    _mm512_i32scatter_epi32(counters, dword, _mm512_add_epi32(old, inc), 4);
+#else
+    const __m512i inc = _mm512_sllv_epi32(_mm512_set1_epi32(1), byte_shift);
+    for (__mmask16 todo = 0xFFFF; todo; ) {
+        // the lanes with no earlier lane still to do in their group
+        __mmask16 now = _mm512_mask_testn_epi32_mask(todo, conflicts, _mm512_set1_epi32(todo));
+        __m512i old = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), now, dword, counters, 4);
+        _mm512_mask_i32scatter_epi32(counters, now, dword, _mm512_add_epi32(old, inc), 4);
+        todo &= ~now;
+    }
+#endif
+}
+#endif
+
+#endif // __AVX2__
+
 /*
  * load a vector given an address which must be valid for a load of the vector size
  */
 template <typename V>
 inline V load(const void *);
 
+#ifdef __AVX2__
 template <>
-inline __m256i load<__m256i>(const void *p) {
+HEDLEY_ALWAYS_INLINE __m256i load<__m256i>(const void *p) {
     return _mm256_loadu_si256(static_cast<const __m256i *>(p));
 }
+#endif
 
 #ifdef __AVX512F__
 template <>
-inline __m512i load<__m512i>(const void *p) {
+HEDLEY_ALWAYS_INLINE __m512i load<__m512i>(const void *p) {
     return _mm512_loadu_si512(static_cast<const __m512i *>(p));
 }
 #endif
@@ -59,14 +139,16 @@ inline __m512i load<__m512i>(const void *p) {
 template <typename V>
 inline void store(void *p, V v);
 
+#ifdef __AVX2__
 template <>
-inline void store(void *p, __m256i v) {
+HEDLEY_ALWAYS_INLINE void store(void *p, __m256i v) {
     _mm256_storeu_si256(static_cast<__m256i *>(p), v);
 }
+#endif
 
 #ifdef __AVX512F__
 template <>
-inline void store(void *p, __m512i v) {
+HEDLEY_ALWAYS_INLINE void store(void *p, __m512i v) {
     _mm512_storeu_si512(p, v);
 }
 #endif
@@ -86,7 +168,7 @@ inline std::vector<T> to_vector(V in) {
 }
 
 template <typename T = uint32_t, typename V>
-inline std::array<T, sizeof(V) / sizeof(T)> to_array(V in) {
+HEDLEY_ALWAYS_INLINE std::array<T, sizeof(V) / sizeof(T)> to_array(V in) {
     static_assert(sizeof(V) % sizeof(T) == 0, "T size must divide V");
     std::array<T, sizeof(V) / sizeof(T)> out;
     store(out.data(), in);
@@ -99,6 +181,7 @@ inline std::array<T, sizeof(V) / sizeof(T)> to_array(V in) {
 // template <typename T = std::uint32_t>
 // inline std::vector<T> to_vector(__m512i in) { return to_vector_impl<T>(in); }
 
+#ifdef __AVX2__
 std::ostream& operator<<(std::ostream& os, __m256i v);
 
 inline __m256i f2i(__m256 in) {
@@ -108,6 +191,7 @@ inline __m256i f2i(__m256 in) {
 inline __m256 i2f(__m256i in) {
     return _mm256_castsi256_ps(in);
 }
+#endif
 
 template <typename T, typename F>
 std::vector<T> cvec(const std::vector<F>& in) {
@@ -117,6 +201,7 @@ std::vector<T> cvec(const std::vector<F>& in) {
     }
     return ret;
 }
+#ifdef __AVX2__
 /**
  * Full shifts - byte granular shifts across an entire 256-bit
  * vector.
@@ -137,5 +222,6 @@ inline __m256i ss_mm256_sllx_si256(__m256i v) {
         return _mm256_slli_si256(_mm256_permute2x128_si256(v, v, 0x8), N - 16);
     }
 }
+#endif
 
 #endif
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Usage: isa-rename.sh OBJECT ISA
+#
+# Give every weak definition in OBJECT, one of the engine objects built for ISA (see the
+# Makefile), and the COMDAT group holding it, the suffix .ISA, e.g., the copy of
+# std::vector<unsigned>::_M_realloc_insert in engine-avx2.o becomes
+# std::vector<unsigned>::_M_realloc_insert [clone .avx2].
+#
+# These are the inline functions and template instantiations every object gets its own
+# copy of, which the linker merges, keeping any one of them. Most of the ones from our
+# headers are in the FASTSCANCOUNT_ISA namespace and so already differ by ISA, but the
+# ones from other headers, e.g., the standard library, don't, and the copy compiled for
+# ISA must not be used by the code built for MARCH. After renaming, only the copies from
+# objects built for the same ISA are merged.
+#
+# Anything which names the ISA's namespace is left alone, since it's already distinct,
+# and other objects for the same ISA may refer to it, e.g., to the explicit instantiations
+# in bitscan.cpp. So are the typeinfo objects, which hold no code and are compared by name.
+
+set -e -o pipefail
+
+obj=$1
+isa=$2
+syms=$obj.syms
+
+{
+    nm --defined-only "$obj" | awk '$2 ~ /^[WV]$/ { print $3 }'
+    readelf -gW "$obj" | sed -n 's/^COMDAT group section .* \[\(.*\)\] contains .*/\1/p'
+} | awk -v isa="$isa" -v ns="13fastscancount${#isa}$isa" '
+    /^_Z/ && !/^_ZT[IS]/ && !index($1, ns) && !seen[$1]++ { print $1, $1 "." isa }' > "$syms"
+
+objcopy --redefine-syms="$syms" "$obj"
+rm -f "$syms"
@@ -2,9 +2,15 @@
 
 BITS 64
 
-; must be equal to the unroll value in fastscancount_avx2b.h
+; must be equal to the unroll value in fastscancount_avx2b.h. This stays fixed, since
+; the rewritten arrays are padded to a multiple of it
 %define UNROLL 16
 
+; how far ahead in the current array the kernels prefetch, in bytes. The 16-bit branchy
+; and fused kernels also come in _pf128 and _pf512 variants, which the AVX2 engine picks
+; between at runtime, see tuning in dispatch.hpp
+%define PF_DEFAULT 256
+
 ; keep in sync with aux_chunk in fastscancount_avx2b.h
 struc aux_chunk
         .start_ptr:  resb 8
@@ -12,24 +18,35 @@ struc aux_chunk
         .overshoot:  resb 4 ; not used
 endstruc
 
-; the counters global array
-extern _ZN13fastscancount8countersE
-
-%define COUNTER_ARRAY abs _ZN13fastscancount8countersE
+; all the record_hits kernels take the counter array (avx2b_context::counters)
+; as their fourth argument, in rcx
+%define COUNTER_ARRAY rcx
 
 global record_hits_asm_branchy32:function,record_hits_asm_branchless32:function
 global record_hits_asm_branchy16:function,record_hits_asm_branchless16:function
+global record_hits_asm_branchy16w:function
+global record_hits_asm_branchy16_pf128:function,record_hits_asm_branchy16_pf512:function
+global record_hits_asm_branchy16w_pf128:function,record_hits_asm_branchy16w_pf512:function
 
 
-; %1 suffix
+; %1 element size in bits
 ; %2 load instruction (eg mov or movzx)
 ; %3 load size (eg dword or word)
-%macro make_branchy 3
+; %4 counter size (byte or word)
+; %5 suffix
+; %6 prefetch distance in bytes
+%macro make_branchy 6
 %define DSIZE (%1 / 8)
+%ifidn %4,word
+%define CSIZE 2
+%else
+%define CSIZE 1
+%endif
 ; rdi : const uint32_t** aux_ptr
 ; rsi : const uint32_t** aux_end
 ; rdx : uint32_t start
-record_hits_asm_branchy%1:
+; rcx : uint8_t* or uint16_t* counters
+record_hits_asm_branchy%5:
         mov     rax, [rdi + aux_chunk.start_ptr] ; load eptr
         mov     r9d, [rdi + aux_chunk.iter_count]  ; load loop count
         mov     r10, [rdi + aux_chunk_size + aux_chunk.start_ptr]   ; load next eptr for prefetching
@@ -41,9 +58,9 @@ ALIGN   32
 %assign i 0
 %rep UNROLL
         %2     r8d, %3 [rax + i * DSIZE]
-        add     byte [COUNTER_ARRAY + r8], 1
+        add     %4 [COUNTER_ARRAY + r8 * CSIZE], 1
 %if     i == 0
-        prefetcht0 [rax + 256]
+        prefetcht0 [rax + %6]
         prefetcht0 [r10]
 %endif
 %assign i (i + 1)
@@ -78,13 +95,19 @@ ALIGN   32
 
 %endmacro
 
-make_branchy 32, mov  , dword
-make_branchy 16, movzx, word
+make_branchy 32, mov  , dword, byte, 32, PF_DEFAULT
+make_branchy 16, movzx, word , byte, 16, PF_DEFAULT
+make_branchy 16, movzx, word , word, 16w, PF_DEFAULT
+make_branchy 16, movzx, word , byte, 16_pf128, 128
+make_branchy 16, movzx, word , byte, 16_pf512, 512
+make_branchy 16, movzx, word , word, 16w_pf128, 128
+make_branchy 16, movzx, word , word, 16w_pf512, 512
 
 global record_hits_asm_branchyB:function
 ; rdi : const uint32_t** aux_ptr
 ; rsi : const uint32_t** aux_end
-; rdx : uint32_t start
+; rdx : uint32_t start (clobbered)
+; rcx : uint8_t* counters
 record_hits_asm_branchyB:
         push    r12
         push    r13
@@ -104,18 +127,18 @@ ALIGN   32
 %rep UNROLL
 %if i % 4 == 0
         mov     r11, QWORD [rax + i * DSIZE]
-        mov     rcx, r11
+        mov     rdx, r11
 %elif i % 4 == 1
-        shrx    rcx, r11, r12
+        shrx    rdx, r11, r12
 %elif i % 4 == 2
-        shrx    rcx, r11, r13
+        shrx    rdx, r11, r13
 %elif i % 4 == 3
-        shrx    rcx, r11, r14
+        shrx    rdx, r11, r14
 %endif
-        movzx   r8d, cx
+        movzx   r8d, dx
         add     byte [COUNTER_ARRAY + r8], 1
 %if     i == 0
-        prefetcht0 [rax + 256]
+        prefetcht0 [rax + PF_DEFAULT]
         prefetcht0 [r10]
 %endif
 %assign i (i + 1)
@@ -153,6 +176,82 @@ ALIGN   32
         ret
 
 
+global record_hits_asm_fused16:function
+global record_hits_asm_fused16_pf128:function,record_hits_asm_fused16_pf512:function
+
+; like record_hits_asm_branchy16, but also appends the index of each counter which
+; was equal to the threshold before its increment to the hit buffer, see
+; fused_kernel_fn in fastscancount_avx2b.h
+; %1 suffix
+; %2 prefetch distance in bytes
+%macro make_fused 2
+; rdi : const uint32_t** aux_ptr
+; rsi : const uint32_t** aux_end
+; rdx : uint32_t threshold
+; rcx : uint8_t* counters
+; r8  : uint32_t* hits
+; returns the new end of hits in rax
+record_hits_asm_fused%1:
+        push    rbx
+        xor     ebx, ebx                         ; only bl is written below
+        mov     r11, [rdi + aux_chunk.start_ptr] ; load eptr
+        mov     r9d, [rdi + aux_chunk.iter_count]  ; load loop count
+        mov     r10, [rdi + aux_chunk_size + aux_chunk.start_ptr]   ; load next eptr for prefetching
+
+        jmp .top
+ALIGN   32
+.top:
+
+%assign i 0
+%rep UNROLL
+        movzx   eax, word [r11 + i * 2]
+        cmp     byte [COUNTER_ARRAY + rax], dl
+        sete    bl
+        add     byte [COUNTER_ARRAY + rax], 1
+        mov     dword [r8], eax                  ; always write the hit, but only keep it if it was one
+        lea     r8, [r8 + rbx * 4]
+%if     i == 0
+        prefetcht0 [r11 + %2]
+        prefetcht0 [r10]
+%endif
+%assign i (i + 1)
+%endrep
+
+        add     r11, 2 * UNROLL
+        add     r10, 2 * UNROLL
+
+        dec     r9d
+        jnz     .top
+
+; next array
+        add     rdi, aux_chunk_size ; aux_ptr++
+        cmp     rsi, rdi            ; break if aux_ptr == aux_end
+        je      .done
+        mov     r11, [rdi + aux_chunk.start_ptr]  ; load eptr
+        mov     r9d, [rdi + aux_chunk.iter_count] ; load loop count
+
+        ; prefetch the first few lines (also kicks off the L2 prefetcher)
+%assign offset 0
+%rep 2
+        prefetcht0 [r11 + offset]
+%assign offset (offset + 64)
+%endrep
+
+        ; prefetch the *next* array after this one
+        mov     r10, [rdi + aux_chunk_size + aux_chunk.start_ptr]
+
+        jmp     .top
+
+.done:
+        mov     rax, r8
+        pop     rbx
+        ret
+%endmacro
+
+make_fused 16, PF_DEFAULT
+make_fused 16_pf128, 128
+make_fused 16_pf512, 512
+
 ; %1 suffix
 ; %2 load instruction (eg mov or movzx)
 ; %3 load size (eg dword or word)
@@ -161,6 +260,7 @@ ALIGN   32
 ; rdi : const uint32_t** aux_ptr
 ; rsi : const uint32_t** aux_end
 ; rdx : uint32_t start
+; rcx : uint8_t* counters
 record_hits_asm_branchless%1:
 
         mov     rax, [rdi + aux_chunk.start_ptr]  ; load eptr
@@ -0,0 +1,148 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace fastscancount {
+inline namespace FASTSCANCOUNT_ISA {
+
+worker_pool::worker_pool(size_t thread_count, bool pin) {
+  thread_count = std::max((size_t)1, thread_count);
+  contexts.reserve(thread_count);
+  for (size_t i = 0; i < thread_count; i++) {
+    contexts.push_back(std::make_unique<query_context>());
+  }
+  workers.reserve(thread_count);
+  for (size_t i = 0; i < thread_count; i++) {
+    workers.emplace_back(&worker_pool::worker_loop, this, i, pin);
+  }
+}
+
+worker_pool::~worker_pool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work_cv.notify_all();
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+void worker_pool::run(size_t count, const task_fn& f) {
+  if (count == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> run_lock(run_mutex);
+  std::unique_lock<std::mutex> lock(mutex);
+  task = &f;
+  task_count = count;
+  next = 0;
+  active = workers.size();
+  error = nullptr;
+  generation++;
+  work_cv.notify_all();
+
+  done_cv.wait(lock, [this]{ return active == 0; });
+  task = nullptr;
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+void worker_pool::worker_loop(size_t id, bool pin) {
+#ifdef __linux__
+  if (pin) {
+    // pinning is best-effort: if it fails the worker just runs unpinned
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % std::max(1u, std::thread::hardware_concurrency()), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+#endif
+
+  query_context& ctx = *contexts[id];
+  size_t seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    work_cv.wait(lock, [&]{ return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    const task_fn& f = *task;
+    const size_t count = task_count;
+    lock.unlock();
+
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count; ) {
+      try {
+        f(i, ctx);
+      } catch (...) {
+        std::lock_guard<std::mutex> elock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+    }
+
+    lock.lock();
+    if (--active == 0) {
+      done_cv.notify_all();
+    }
+  }
+}
+
+worker_pool& worker_pool::default_pool() {
+  static worker_pool pool;
+  return pool;
+}
+
+std::vector<std::vector<uint32_t>> scancount_batch(worker_pool& pool,
+                                                   const std::vector<std::vector<uint32_t>>& queries,
+                                                   const std::vector<uint8_t>& thresholds,
+                                                   const batch_engine& engine) {
+  if (queries.size() != thresholds.size()) {
+    throw std::invalid_argument("need exactly one threshold per query");
+  }
+
+  // find the distinct queries: the order of arrays in a query doesn't affect its result
+  using key_type = std::pair<std::vector<uint32_t>, uint8_t>;
+  std::map<key_type, size_t> distinct;
+  std::vector<size_t> unique_idx(queries.size()); // for each query, the index of its distinct query
+  std::vector<size_t> first_idx;                  // for each distinct query, the first query with that key
+  for (size_t i = 0; i < queries.size(); i++) {
+    key_type key{queries[i], thresholds[i]};
+    std::sort(key.first.begin(), key.first.end());
+    auto inserted = distinct.emplace(std::move(key), first_idx.size());
+    if (inserted.second) {
+      first_idx.push_back(i);
+    }
+    unique_idx[i] = inserted.first->second;
+  }
+
+  std::vector<std::vector<uint32_t>> unique_results(first_idx.size());
+  pool.run(first_idx.size(), [&](size_t u, query_context& ctx) {
+    size_t q = first_idx[u];
+    engine(queries[q], thresholds[q], ctx.out, ctx);
+    unique_results[u].assign(ctx.out.begin(), ctx.out.end());
+  });
+
+  std::vector<std::vector<uint32_t>> results(queries.size());
+  for (size_t i = queries.size(); i-- > 0; ) {
+    auto& r = unique_results[unique_idx[i]];
+    // the first query with a given key takes the result, the duplicates (which come later) get copies
+    results[i] = first_idx[unique_idx[i]] == i ? std::move(r) : r;
+  }
+  return results;
+}
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
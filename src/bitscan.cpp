@@ -4,18 +4,14 @@
 #include "simd-support.hpp"
 
 #include <immintrin.h>
+#include <stdexcept>
 
 namespace fastscancount {
-
-#ifndef CHUNKS_PER_PASS
-#define CHUNKS_PER_PASS 512
-#endif
-
-constexpr size_t chunks_per_pass = CHUNKS_PER_PASS;
-constexpr size_t prefetch_distance = 256;
+inline namespace FASTSCANCOUNT_ISA {
 
 using query_type = std::vector<uint32_t>;
 using out_type = std::vector<uint32_t>;
+using count_type = std::vector<uint32_t>;
 
 #define UNROLL_X(fn, arg)\
         fn(0, arg);  \
@@ -63,24 +59,41 @@ struct fake_traits : base_traits<E, fake_traits<E>> {
             }
         }
     }
+
+    template <typename A>
+    static void populate_counts(const A& accum, size_t base_count, uint32_t offset,
+                                out_type& out, count_type& counts) {
+        auto flags = accum.get_saturated();
+        auto& planes = accum.get_bits();
+        for (size_t i = 0; i < base::chunk_bits; i++) {
+            if (flags.test(i)) {
+                uint32_t v = 0;
+                for (size_t b = 0; b < planes.size(); b++) {
+                    v |= (uint32_t)planes[b].test(i) << b;
+                }
+                out.push_back(offset + i);
+                counts.push_back(base_count + v);
+            }
+        }
+    }
 };
 
-#ifdef __AVX512F__
+#ifdef __AVX2__
 
-template <typename E>
-struct avx512_traits : base_traits<E, avx512_traits<E>> {
-    using base = base_traits<E, avx512_traits<E>>;
-    using chunk_type = __m512i;
+/*
+ * Common parts of the SIMD traits: VT is the vector traits class for the chunk type,
+ * which must be storable as 8 uint64_t words.
+ */
+template <typename E, typename D, typename VT>
+struct vector_traits : base_traits<E, D> {
+    using base = base_traits<E, D>;
+    using chunk_type = typename VT::T;
 
     template <size_t B>
-    using accum_type = accumulator<B, chunk_type, m512_traits>;
-
-    static chunk_type expand(const typename base::btype& bitmap, size_t index, const E*& eptr) {
-        return bitmap.expand512(index, eptr);
-    }
+    using accum_type = accumulator<B, chunk_type, VT>;
 
     static void populate_hits(const chunk_type& flags, uint32_t offset, out_type& out) {
-        if (HEDLEY_LIKELY(_mm512_test_epi32_mask(flags, flags) == 0)) {
+        if (HEDLEY_LIKELY(VT::zero(flags))) {
             return;
         }
         auto flags64 = to_array<uint64_t>(flags);
@@ -97,6 +110,57 @@ struct avx512_traits : base_traits<E, avx512_traits<E>> {
         }
         // printf("chunk had %zu hits\n", hits);
     }
+
+    template <typename A>
+    static void populate_counts(const A& accum, size_t base_count, uint32_t offset,
+                                out_type& out, count_type& counts) {
+        auto flags = accum.get_saturated();
+        if (HEDLEY_LIKELY(VT::zero(flags))) {
+            return;
+        }
+        auto flags64 = to_array<uint64_t>(flags);
+        std::array<std::array<uint64_t, 8>, A::bit_count> planes;
+        for (size_t b = 0; b < planes.size(); b++) {
+            planes[b] = to_array<uint64_t>(accum.get_bits()[b]);
+        }
+        for (size_t w = 0; w < flags64.size(); w++) {
+            for (auto f = flags64[w]; f; f &= (f - 1)) {
+                uint32_t idx = __builtin_ctzl(f);
+                uint32_t v = 0;
+                for (size_t b = 0; b < planes.size(); b++) {
+                    v |= (uint32_t)((planes[b][w] >> idx) & 1) << b;
+                }
+                out.push_back(offset + w * 64 + idx);
+                counts.push_back(base_count + v);
+            }
+        }
+    }
+};
+
+template <typename E>
+struct avx2_traits : vector_traits<E, avx2_traits<E>, m256_traits> {
+    using base = base_traits<E, avx2_traits<E>>;
+    using chunk_type = m256x2;
+
+    static chunk_type expand(const typename base::btype& bitmap, size_t index, const E*& eptr) {
+        chunk_type ret;
+        bitmap.expand256(index, eptr, ret.lo, ret.hi);
+        return ret;
+    }
+};
+
+#endif
+
+#ifdef __AVX512F__
+
+template <typename E>
+struct avx512_traits : vector_traits<E, avx512_traits<E>, m512_traits> {
+    using base = base_traits<E, avx512_traits<E>>;
+    using chunk_type = __m512i;
+
+    static chunk_type expand(const typename base::btype& bitmap, size_t index, const E*& eptr) {
+        return bitmap.expand512(index, eptr);
+    }
 };
 
 #endif
@@ -110,6 +174,21 @@ void generic_populate_hits(std::vector<A>& accums, out_type& out, size_t offset)
     }
 }
 
+/**
+ * Like generic_populate_hits, but also append the count for each hit to counts. The
+ * accumulators started at max - threshold - 1, so a saturated accumulator holds
+ * count - threshold - 1, as long as it has enough bits not to wrap around again.
+ */
+template <typename traits, typename A>
+HEDLEY_NEVER_INLINE
+void generic_populate_counts(std::vector<A>& accums, out_type& out, count_type& counts,
+                             size_t threshold, size_t offset) {
+    for (auto& accum : accums) {
+        traits::populate_counts(accum, threshold + 1, offset, out, counts);
+        offset += traits::chunk_bits;
+    }
+}
+
 template <size_t N, typename traits, typename A>
 void handle_tail(
     size_t qidx,
@@ -134,7 +213,7 @@ void handle_tail(
         for (size_t i = 0; i < N; i++) {
             auto e = traits::expand(*bitmaps[i], c, eptrs[i]);
             assert(c - start_chunk < accums.size());
-            __builtin_prefetch(eptrs[i] + prefetch_distance/sizeof(eptrs[0]), 0, 3);
+            __builtin_prefetch((const char *)eptrs[i] + aux_info.prefetch_distance, 0, 3);
             accums[c - start_chunk].accept(e);
         }
     }
@@ -150,7 +229,8 @@ void handle_middle(
         typename traits::btype const * const * bitmaps,
         typename traits::elem_type const * * eptrs,
         size_t start_chunk,
-        size_t end_chunk
+        size_t end_chunk,
+        size_t prefetch_distance
     )
 {
     if constexpr (traits::template has_override_middle<B>) {
@@ -165,7 +245,7 @@ void handle_middle(
         #define BODY(i,_) auto e##i = traits::expand(*bitmaps[i], c, eptr_##i);
         UNROLL_X(BODY,_);
 
-        #define PREFETCH(i,_) __builtin_prefetch(eptr_##i + prefetch_distance/sizeof(*eptr_##i), 0, 3);
+        #define PREFETCH(i,_) __builtin_prefetch((const char *)eptr_##i + prefetch_distance, 0, 3);
         UNROLL_X(PREFETCH,_);
 
         assert(c - start_chunk < accums.size());
@@ -221,24 +301,38 @@ void do_accum_init(A* HEDLEY_RESTRICT accums, size_t size, A accum_init) {
     }
 }
 
-template <size_t THRESHOLD, typename traits>
-void bitscan_generic(out_type& out,
+/**
+ * Count using B-bit accumulators, which works for any threshold < 2^B: the
+ * accumulators start at 2^B - threshold - 1, so they saturate exactly when the
+ * count exceeds the threshold. Only the chunks in [first_chunk, last_chunk) are
+ * counted.
+ *
+ * If counts is not null, the count for each hit is written to it, which also
+ * needs accumulators wide enough to hold count - threshold - 1 for any count,
+ * see bits_needed().
+ */
+template <size_t B, typename traits, bool COUNTS = false>
+void bitscan_generic(out_type& out, count_type* counts,
                      const typename traits::aux_type& aux_info,
-                     const std::vector<uint32_t>& query)
+                     const std::vector<uint32_t>& query,
+                     size_t threshold, size_t first_chunk, size_t last_chunk,
+                     bitscan_scratch<typename traits::elem_type>& scratch)
 {
-    constexpr size_t B = lg2_up(THRESHOLD + 1); // number of bits needed in the accumulators
     using T = typename traits::elem_type;
     using atype = typename traits::template accum_type<B>;
 
-    assert(atype::max >= THRESHOLD + 1u); // need to increase A_BITS if this fails
+    assert(atype::max >= threshold + 1u); // the dispatcher picked a B which is too small
 
     const size_t array_count = query.size();
-    const size_t total_chunk_count = aux_info.get_chunk_count();
+    const size_t stop_chunk = std::min(last_chunk, aux_info.get_chunk_count());
+    if (first_chunk >= stop_chunk) {
+        return;
+    }
 
-    atype accum_init(atype::max - THRESHOLD - 1);
+    atype accum_init(atype::max - threshold - 1);
 
-    std::vector<const compressed_bitmap<T>*> all_bitmaps;
-    std::vector<const T*> all_eptrs;
+    auto& all_bitmaps = scratch.bitmaps;
+    auto& all_eptrs = scratch.eptrs;
     all_bitmaps.resize(array_count);
     all_eptrs.resize(array_count);
 
@@ -246,16 +340,18 @@ void bitscan_generic(out_type& out,
         auto did = query.at(qidx);
         assert(did < aux_info.bitmaps.size());
         all_bitmaps[qidx] = &aux_info.bitmaps[did];;
-        all_eptrs[qidx]   = all_bitmaps[qidx]->elements.data();
-        assert(all_bitmaps[qidx]->chunk_count() == total_chunk_count);
+        all_eptrs[qidx]   = all_bitmaps[qidx]->elements.data() + all_bitmaps[qidx]->element_offset(first_chunk);
+        assert(all_bitmaps[qidx]->chunk_count() == aux_info.get_chunk_count());
         assert(all_bitmaps[qidx] && all_eptrs[qidx]);
     }
 
-    std::vector<atype> accums;
+    auto& accums = scratch.template accums_for<atype>(B);
 
-    for (size_t start_chunk = 0; start_chunk < total_chunk_count; start_chunk += chunks_per_pass) {
+    const size_t chunks_per_pass = aux_info.chunks_per_pass;
+    assert(chunks_per_pass > 0);
+    for (size_t start_chunk = first_chunk; start_chunk < stop_chunk; start_chunk += chunks_per_pass) {
 
-        const size_t pass_chunk_count = std::min(chunks_per_pass, total_chunk_count - start_chunk);
+        const size_t pass_chunk_count = std::min(chunks_per_pass, stop_chunk - start_chunk);
         const size_t end_chunk = start_chunk + pass_chunk_count;
 
         accums.resize(pass_chunk_count, accum_init);
@@ -267,7 +363,7 @@ void bitscan_generic(out_type& out,
         for (; qidx + stream_count <= array_count; qidx += stream_count) {
             auto bitmaps = &all_bitmaps.at(qidx);
             auto eptrs = &all_eptrs.at(qidx);
-            handle_middle<traits, B>(accums, bitmaps, eptrs, start_chunk, end_chunk);
+            handle_middle<traits, B>(accums, bitmaps, eptrs, start_chunk, end_chunk, aux_info.prefetch_distance);
         }
 
         // TODO get rid of this ugly switch
@@ -280,43 +376,88 @@ void bitscan_generic(out_type& out,
             case 4: handle_tail<4, traits>(qidx, accums, aux_info, query, all_bitmaps, all_eptrs, start_chunk, end_chunk); break;
             case 5: handle_tail<5, traits>(qidx, accums, aux_info, query, all_bitmaps, all_eptrs, start_chunk, end_chunk); break;
             case 6: handle_tail<6, traits>(qidx, accums, aux_info, query, all_bitmaps, all_eptrs, start_chunk, end_chunk); break;
+            case 7: handle_tail<7, traits>(qidx, accums, aux_info, query, all_bitmaps, all_eptrs, start_chunk, end_chunk); break;
             default: assert(false);
         }
 
 
-        generic_populate_hits<traits>(accums, out, start_chunk * traits::chunk_bits);
+        if constexpr (COUNTS) {
+            generic_populate_counts<traits>(accums, out, *counts, threshold, start_chunk * traits::chunk_bits);
+        } else {
+            generic_populate_hits<traits>(accums, out, start_chunk * traits::chunk_bits);
+        }
     }
 }
 
 
 template <typename traits>
-using bitscan_fn = void (out_type& out,
+using bitscan_fn = void (out_type& out, count_type* counts,
                          const typename traits::aux_type& aux_info,
-                         const std::vector<uint32_t>& query);
+                         const std::vector<uint32_t>& query,
+                         size_t threshold, size_t first_chunk, size_t last_chunk,
+                         bitscan_scratch<typename traits::elem_type>& scratch);
 
+/* the widest accumulators we instantiate */
+static constexpr size_t MAX_B = bitscan_max_width;
 
-template <typename traits, size_t I, size_t MAX>
+template <typename traits, bool COUNTS, size_t I, size_t MAX>
 constexpr void make_helper(std::array<bitscan_fn<traits> *, MAX>& a) {
     if constexpr (I < MAX) {
-        a[I] = bitscan_generic<I, traits>;
-        make_helper<traits, I + 1, MAX>(a);
+        a[I] = bitscan_generic<I, traits, COUNTS>;
+        make_helper<traits, COUNTS, I + 1, MAX>(a);
     }
 }
 
-template <typename traits, size_t MAX>
-constexpr std::array<bitscan_fn<traits> *, MAX> make_lut() {
-    std::array<bitscan_fn<traits> *, MAX> ret{};
-    make_helper<traits, 1, MAX>(ret);
+/* a table of bitscan_generic instances indexed by accumulator width, for widths 1 to MAX_B */
+template <typename traits, bool COUNTS>
+constexpr std::array<bitscan_fn<traits> *, MAX_B + 1> make_lut() {
+    std::array<bitscan_fn<traits> *, MAX_B + 1> ret{};
+    make_helper<traits, COUNTS, 1, MAX_B + 1>(ret);
     return ret;
 }
 
-static constexpr size_t MAX_T = 16;
-
-template <typename traits>
+template <typename traits, bool COUNTS = false>
 struct lut_holder {
-    static constexpr std::array<bitscan_fn<traits> *, MAX_T> lut = make_lut<traits, MAX_T>();
+    static constexpr std::array<bitscan_fn<traits> *, MAX_B + 1> lut = make_lut<traits, COUNTS>();
 };
 
+/**
+ * The accumulator width needed for the given threshold: the accumulators must
+ * be able to start at 2^B - threshold - 1 and, when counting, hold
+ * count - threshold - 1 for the largest possible count, array_count.
+ */
+static size_t bits_needed(size_t threshold, size_t array_count, bool counts) {
+    size_t range = threshold + 1;
+    if (counts && array_count > threshold) {
+        range = std::max(range, array_count - threshold);
+    }
+    return std::max((size_t)1, lg2_up(range));
+}
+
+/* run the bitscan_generic instance for the narrowest accumulators which work for this query */
+template <typename traits, bool COUNTS = false>
+void bitscan_dispatch(out_type& out, count_type* counts, size_t threshold,
+                      const typename traits::aux_type& aux_info,
+                      const std::vector<uint32_t>& query,
+                      size_t first_chunk, size_t last_chunk,
+                      bitscan_scratch<typename traits::elem_type>& scratch)
+{
+    size_t b = bits_needed(threshold, query.size(), COUNTS);
+    if (b > MAX_B) throw std::runtime_error("too many arrays to return counts");
+    lut_holder<traits, COUNTS>::lut[b](out, counts, aux_info, query, threshold, first_chunk, last_chunk, scratch);
+}
+
+/* as above, with scratch memory just for this query */
+template <typename traits, bool COUNTS = false>
+void bitscan_dispatch(out_type& out, count_type* counts, size_t threshold,
+                      const typename traits::aux_type& aux_info,
+                      const std::vector<uint32_t>& query,
+                      size_t first_chunk, size_t last_chunk)
+{
+    bitscan_scratch<typename traits::elem_type> scratch;
+    bitscan_dispatch<traits, COUNTS>(out, counts, threshold, aux_info, query, first_chunk, last_chunk, scratch);
+}
+
 template <typename E>
 void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
                     uint8_t threshold, const bitscan_all_aux<E>& aux_info,
@@ -325,9 +466,146 @@ void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
 #ifndef __AVX512F__
     throw std::runtime_error("not compiled for AVX-512");
 #else
-    if (threshold >= MAX_T) throw std::runtime_error("MAX_T too small");
-    lut_holder<avx512_traits<E>>::lut[threshold](out, aux_info, query);
+    bitscan_dispatch<avx512_traits<E>>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX);
+#endif
+}
+
+template <typename E>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
+                    uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                    const std::vector<uint32_t>& query, bitscan_scratch<E>& scratch)
+{
+#ifndef __AVX512F__
+    throw std::runtime_error("not compiled for AVX-512");
+#else
+    bitscan_dispatch<avx512_traits<E>>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX, scratch);
+#endif
+}
+
+template <typename E>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                    uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                    const std::vector<uint32_t>& query)
+{
+#ifndef __AVX512F__
+    throw std::runtime_error("not compiled for AVX-512");
+#else
+    counts.clear();
+    bitscan_dispatch<avx512_traits<E>, true>(out, &counts, threshold, aux_info, query, 0, SIZE_MAX);
+#endif
+}
+
+/* the chunks which overlap [lo, hi) */
+static size_t range_first_chunk(uint32_t lo) {
+    return lo / compressed_bitmap<uint32_t>::chunk_bits;
+}
+
+static size_t range_last_chunk(uint32_t hi) {
+    return div_up((size_t)hi, compressed_bitmap<uint32_t>::chunk_bits);
+}
+
+template <typename E>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
+                    uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                    const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi)
+{
+#ifndef __AVX512F__
+    throw std::runtime_error("not compiled for AVX-512");
+#else
+    size_t begin = out.size();
+    bitscan_dispatch<avx512_traits<E>>(out, nullptr, threshold, aux_info, query,
+            range_first_chunk(lo), range_last_chunk(hi));
+    trim_hits(out, begin, lo, hi);
+#endif
+}
+
+template <typename E>
+void bitscan_avx512(const data_ptrs &, std::vector<uint32_t> &out,
+                    uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                    const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                    bitscan_scratch<E>& scratch)
+{
+#ifndef __AVX512F__
+    throw std::runtime_error("not compiled for AVX-512");
+#else
+    size_t begin = out.size();
+    bitscan_dispatch<avx512_traits<E>>(out, nullptr, threshold, aux_info, query,
+            range_first_chunk(lo), range_last_chunk(hi), scratch);
+    trim_hits(out, begin, lo, hi);
+#endif
+}
+
+#ifdef __AVX2__
+template <typename E>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                  uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                  const std::vector<uint32_t>& query)
+{
+    bitscan_dispatch<avx2_traits<E>>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX);
+}
+
+template <typename E>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                  uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                  const std::vector<uint32_t>& query, bitscan_scratch<E>& scratch)
+{
+    bitscan_dispatch<avx2_traits<E>>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX, scratch);
+}
+
+template <typename E>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                  uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                  const std::vector<uint32_t>& query)
+{
+    counts.clear();
+    bitscan_dispatch<avx2_traits<E>, true>(out, &counts, threshold, aux_info, query, 0, SIZE_MAX);
+}
+
+template <typename E>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                  uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                  const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi)
+{
+    size_t begin = out.size();
+    bitscan_dispatch<avx2_traits<E>>(out, nullptr, threshold, aux_info, query,
+            range_first_chunk(lo), range_last_chunk(hi));
+    trim_hits(out, begin, lo, hi);
+}
+
+template <typename E>
+void bitscan_avx2(const data_ptrs &, std::vector<uint32_t> &out,
+                  uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                  const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                  bitscan_scratch<E>& scratch)
+{
+    size_t begin = out.size();
+    bitscan_dispatch<avx2_traits<E>>(out, nullptr, threshold, aux_info, query,
+            range_first_chunk(lo), range_last_chunk(hi), scratch);
+    trim_hits(out, begin, lo, hi);
+}
 #endif
+
+template <typename E>
+void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out,
+                   uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                   const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi)
+{
+    size_t begin = out.size();
+    bitscan_dispatch<fake_traits<E>>(out, nullptr, threshold, aux_info, query,
+            range_first_chunk(lo), range_last_chunk(hi));
+    trim_hits(out, begin, lo, hi);
+}
+
+template <typename E>
+void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out,
+                   uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                   const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                   bitscan_scratch<E>& scratch)
+{
+    size_t begin = out.size();
+    bitscan_dispatch<fake_traits<E>>(out, nullptr, threshold, aux_info, query,
+            range_first_chunk(lo), range_last_chunk(hi), scratch);
+    trim_hits(out, begin, lo, hi);
 }
 
 template <typename E>
@@ -335,8 +613,16 @@ void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out,
                    uint8_t threshold, const bitscan_all_aux<E>& aux_info,
                    const std::vector<uint32_t>& query)
 {
-    if (threshold >= MAX_T) throw std::runtime_error("MAX_T too small");
-    lut_holder<fake_traits<E>>::lut[threshold](out, aux_info, query);
+    bitscan_dispatch<fake_traits<E>>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX);
+}
+
+template <typename E>
+void bitscan_fake2(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                   uint8_t threshold, const bitscan_all_aux<E>& aux_info,
+                   const std::vector<uint32_t>& query)
+{
+    counts.clear();
+    bitscan_dispatch<fake_traits<E>, true>(out, &counts, threshold, aux_info, query, 0, SIZE_MAX);
 }
 
 #ifdef __AVX512F__
@@ -344,8 +630,22 @@ void bitscan_avx512_asm(const data_ptrs &, std::vector<uint32_t> &out,
                     uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
                     const std::vector<uint32_t>& query)
 {
-    if (threshold >= MAX_T) throw std::runtime_error("MAX_T too small");
-    lut_holder<avx512_traits_asm>::lut[threshold](out, aux_info, query);
+    bitscan_dispatch<avx512_traits_asm>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX);
+}
+
+void bitscan_avx512_asm(const data_ptrs &, std::vector<uint32_t> &out,
+                    uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                    const std::vector<uint32_t>& query, bitscan_scratch<uint32_t>& scratch)
+{
+    bitscan_dispatch<avx512_traits_asm>(out, nullptr, threshold, aux_info, query, 0, SIZE_MAX, scratch);
+}
+
+void bitscan_avx512_asm(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                    uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                    const std::vector<uint32_t>& query)
+{
+    counts.clear();
+    bitscan_dispatch<avx512_traits_asm, true>(out, &counts, threshold, aux_info, query, 0, SIZE_MAX);
 }
 #endif
 
@@ -359,4 +659,87 @@ template void bitscan_avx512<uint32_t>(const data_ptrs &, std::vector<uint32_t>
                 uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
                 const std::vector<uint32_t>& query);
 
-}
+template void bitscan_avx512<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, bitscan_scratch<uint32_t>& scratch);
+
+template void bitscan_fake2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template void bitscan_fake2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template void bitscan_fake2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                bitscan_scratch<uint32_t>& scratch);
+
+template void bitscan_avx512<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template void bitscan_avx512<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                bitscan_scratch<uint32_t>& scratch);
+
+template void bitscan_avx512<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+/* the same for byte elements */
+template void bitscan_fake2<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template void bitscan_avx512<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template void bitscan_avx512<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query, bitscan_scratch<uint8_t>& scratch);
+
+template void bitscan_fake2<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template void bitscan_fake2<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template void bitscan_avx512<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template void bitscan_avx512<uint8_t>(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<uint8_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+#ifdef __AVX2__
+template void bitscan_avx2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template void bitscan_avx2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, bitscan_scratch<uint32_t>& scratch);
+
+template void bitscan_avx2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query);
+
+template void bitscan_avx2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi);
+
+template void bitscan_avx2<uint32_t>(const data_ptrs &, std::vector<uint32_t> &out,
+                uint8_t threshold, const bitscan_all_aux<uint32_t>& aux_info,
+                const std::vector<uint32_t>& query, uint32_t lo, uint32_t hi,
+                bitscan_scratch<uint32_t>& scratch);
+#endif
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
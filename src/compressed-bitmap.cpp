@@ -50,7 +50,8 @@ typename compressed_bitmap<T>::chunk_type compressed_bitmap<T>::expand(size_t id
  */
 template <typename T>
 compressed_bitmap<T>::compressed_bitmap(const std::vector<uint32_t>& array, uint32_t largest) {
-    assert(!array.empty()); // some bugs for empty arrays
+    // an empty array is all empty chunks, so needs largest to know how many
+    assert(!array.empty() || largest != -1u);
     constexpr auto bits_per_entry = sizeof(T) * 8;
     static_assert(chunk_bits % bits_per_entry == 0);
     constexpr auto control_bits = 8 * sizeof(control[0]);
@@ -76,16 +77,25 @@ compressed_bitmap<T>::compressed_bitmap(const std::vector<uint32_t>& array, uint
         DBG(printf("\nbitmap R: %s\n", to_string(chunk).c_str()));
         assert(chunk.count() == elem_count);
 
+        if (control.size() % offset_stride == 0) {
+            chunk_offsets.push_back(elements.size());
+        }
+
         std::bitset<control_bits> one_control;
 #ifndef NDEBUG
         size_t size_before = elements.size();
 #endif
         // for each bits_per_entry chunk in the bitmap
         for (size_t suboffset = 0, bit = 0; suboffset < chunk_bits; suboffset += bits_per_entry, bit++) {
-            auto sub = chunk.subset<bits_per_entry>(suboffset);
-            DBG(printf("subset: %s (%szero)\n", to_string(sub).c_str(), sub.any() ? "non" : ""));
-            if (sub.any()) {  // any bit set in this subchunk?
-                elements.push_back(sub.to_ulong());
+            T sub;
+            if constexpr (bits_per_entry < 32) {
+                sub = chunk.extract(suboffset, bits_per_entry);
+            } else {
+                sub = chunk.template subset<bits_per_entry>(suboffset).to_ulong();
+            }
+            DBG(printf("subset: %lx\n", (unsigned long)sub));
+            if (sub) {  // any bit set in this subchunk?
+                elements.push_back(sub);
                 one_control.set(bit);
             }
         }
@@ -149,4 +159,5 @@ std::vector<typename compressed_bitmap<T>::chunk_type> compressed_bitmap<T>::chu
     return ret;
 }
 
+template class compressed_bitmap<uint8_t>;
 template class compressed_bitmap<uint32_t>;
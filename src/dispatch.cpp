@@ -0,0 +1,135 @@
+#include "dispatch.hpp"
+#include "merge.hpp"
+#include "pigeonhole.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+#include <cpuid.h>
+
+namespace fastscancount {
+
+namespace {
+
+/* LZCNT is in the AMD extended leaf, which not every compiler's __builtin_cpu_supports checks */
+bool has_lzcnt() {
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (ecx & bit_LZCNT);
+}
+
+}
+
+const char* isa_name(isa target) {
+  switch (target) {
+    case isa::scalar:      return "scalar";
+    case isa::avx2:        return "avx2";
+    case isa::avx512:      return "avx512";
+    case isa::avx512vbmi2: return "avx512vbmi2";
+  }
+  return "unknown";
+}
+
+isa detect_isa() {
+  // __builtin_cpu_supports also checks that the OS saves the vector state (via xgetbv)
+  __builtin_cpu_init();
+  // everything ISA_AVX2 in the Makefile lets the compiler use, which ISA_AVX512 adds to
+  const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") &&
+      __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt") && has_lzcnt();
+  if (!avx2) {
+    return isa::scalar;
+  }
+  const bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512dq") &&
+      __builtin_cpu_supports("avx512vl");
+  if (!avx512) {
+    return isa::avx2;
+  }
+  if (__builtin_cpu_supports("avx512vbmi2")) {
+    return isa::avx512vbmi2;
+  }
+  return isa::avx512;
+}
+
+engine::engine()
+    : merge{std::make_unique<merge_scratch>()}, pigeonhole{std::make_unique<pigeonhole_scratch>()} {}
+
+engine::~engine() = default;
+
+void engine::check_tuning(const tuning& t) const {
+  auto candidates = tuning_candidates();
+  if (std::find(candidates.begin(), candidates.end(), t) == candidates.end()) {
+    throw std::invalid_argument(std::string("unsupported tuning for engine ") + name());
+  }
+}
+
+bool engine::route_sparse(const all_data& data, const std::vector<uint32_t>& query, uint8_t threshold,
+                          std::vector<uint32_t>& out) {
+  sparse_ptrs.clear();
+  for (auto q : query) {
+    sparse_ptrs.push_back(&data.at(q));
+  }
+  if (prefer_merge(sparse_ptrs)) {
+    merge_scancount(sparse_ptrs, out, threshold, *merge);
+    return true;
+  }
+  if (prefer_pigeonhole(sparse_ptrs, threshold, *pigeonhole)) {
+    pigeonhole_scancount(sparse_ptrs, out, threshold, *pigeonhole);
+    return true;
+  }
+  return false;
+}
+
+tuning engine::autotune(const std::vector<std::vector<uint32_t>>& sample, uint8_t threshold) {
+  using clock = std::chrono::steady_clock;
+
+  auto candidates = tuning_candidates();
+  if (candidates.size() < 2) {
+    return get_tuning();
+  }
+
+  std::vector<uint32_t> out;
+  tuning best = get_tuning();
+  auto best_time = clock::duration::max();
+  for (auto& t : candidates) {
+    try {
+      set_tuning(t);
+    } catch (std::invalid_argument&) {
+      continue;
+    }
+    // one untimed run to warm up the caches, then keep the best of a few
+    auto elapsed = clock::duration::max();
+    for (int rep = 0; rep < 4; rep++) {
+      auto start = clock::now();
+      for (auto& query : sample) {
+        scancount(query, threshold, out);
+      }
+      if (rep > 0) {
+        elapsed = std::min(elapsed, clock::now() - start);
+      }
+    }
+    if (elapsed < best_time) {
+      best = t;
+      best_time = elapsed;
+    }
+  }
+
+  set_tuning(best);
+  return best;
+}
+
+std::unique_ptr<engine> make_engine(const all_data& data, isa target) {
+  if (target > detect_isa()) {
+    throw std::invalid_argument(std::string("this CPU doesn't support ") + isa_name(target));
+  }
+  switch (target) {
+    case isa::scalar:      return make_scalar_engine(data);
+    case isa::avx2:        return make_avx2_engine(data);
+    case isa::avx512:      return make_avx512_engine(data);
+    case isa::avx512vbmi2: return make_avx512vbmi2_engine(data);
+  }
+  throw std::invalid_argument("bad isa");
+}
+
+} // namespace fastscancount
@@ -0,0 +1,117 @@
+/*
+ * The AVX2 engine: see dispatch.hpp. This file is built with the AVX2 flags from
+ * the Makefile whatever MARCH is, with the code from the headers in
+ * fastscancount::avx2 (see common.h).
+ */
+
+#include "dispatch.hpp"
+#include "query-context.hpp"
+
+namespace fastscancount {
+namespace {
+
+namespace impl = avx2;
+
+/* the chunk sizes autotune tries: the default suits a 48 KB L1, the others smaller ones */
+constexpr size_t chunk_sizes[] = {16384, 24576, 32768, impl::cache_size};
+
+/* the prefetch distances the kernels are assembled with, see asm-kernels.asm */
+constexpr size_t prefetch_distances[] = {128, 256, 512};
+
+class avx2_engine : public engine {
+  const all_data& data;
+  impl::implb::all_aux_t<uint16_t> aux;
+  std::unique_ptr<impl::query_context> qctx = std::make_unique<impl::query_context>();
+  std::vector<std::vector<uint32_t>> hot_groups;
+  std::vector<impl::count_planes> planes;
+  size_t prefetch_distance = 256;
+
+  void build_planes() {
+    planes.clear();
+    for (auto& g : hot_groups) {
+      planes.push_back(impl::get_count_planes(data, g, aux.chunk_size));
+    }
+  }
+
+  /* run the query with the kernels for one prefetch distance: K and FK for 8-bit counters, KW for 16-bit ones */
+  template <impl::kernel_fn16 K, impl::kernel_fn16w KW, impl::fused_kernel_fn<uint16_t> FK>
+  void run(const std::vector<uint32_t>& query, uint8_t threshold, std::vector<uint32_t>& out) {
+    if (!planes.empty()) {
+      bool done = query.size() < 128
+          ? impl::fastscancount_avx2b_planes<uint16_t, uint8_t, K>({}, out, threshold, aux, planes, query, *qctx)
+          : impl::fastscancount_avx2b_planes<uint16_t, uint16_t, KW>({}, out, threshold, aux, planes, query, *qctx);
+      if (done) {
+        return;
+      }
+    }
+    if (query.size() < 128) {
+      impl::fastscancount_avx2b_auto<uint16_t, K, FK>({}, out, threshold, aux, query, *qctx);
+    } else {
+      // the 8-bit counters are compared as signed, so large queries need the wide version
+      impl::fastscancount_avx2b_wide<uint16_t, KW>({}, out, threshold, aux, query, *qctx);
+    }
+  }
+
+public:
+  avx2_engine(const all_data& data) : data{data}, aux{impl::implb::get_all_aux<uint16_t>(data)} {}
+
+  isa target() const override { return isa::avx2; }
+
+  const char* name() const override { return "AVX2B ASM branchy 16b"; }
+
+  void scancount(const std::vector<uint32_t>& query, uint8_t threshold,
+                 std::vector<uint32_t>& out) override {
+    if (route_sparse(data, query, threshold, out)) {
+      return;
+    }
+    switch (prefetch_distance) {
+      case 128:
+        run<impl::record_hits_asm_branchy16_pf128, impl::record_hits_asm_branchy16w_pf128,
+            impl::record_hits_asm_fused16_pf128>(query, threshold, out);
+        break;
+      case 512:
+        run<impl::record_hits_asm_branchy16_pf512, impl::record_hits_asm_branchy16w_pf512,
+            impl::record_hits_asm_fused16_pf512>(query, threshold, out);
+        break;
+      default:
+        run<impl::record_hits_asm_branchy16, impl::record_hits_asm_branchy16w,
+            impl::record_hits_asm_fused16>(query, threshold, out);
+    }
+  }
+
+  tuning get_tuning() const override {
+    return {aux.chunk_size, 0, prefetch_distance};
+  }
+
+  void set_tuning(const tuning& t) override {
+    check_tuning(t);
+    if (t.chunk_size != aux.chunk_size) {
+      aux = impl::implb::get_all_aux<uint16_t>(data, t.chunk_size);
+      build_planes();
+    }
+    prefetch_distance = t.prefetch_distance;
+  }
+
+  void set_hot_groups(const std::vector<std::vector<uint32_t>>& groups) override {
+    hot_groups = groups;
+    build_planes();
+  }
+
+  std::vector<tuning> tuning_candidates() const override {
+    std::vector<tuning> ret;
+    for (size_t size : chunk_sizes) {
+      for (size_t pf : prefetch_distances) {
+        ret.push_back({size, 0, pf});
+      }
+    }
+    return ret;
+  }
+};
+
+} // namespace
+
+std::unique_ptr<engine> make_avx2_engine(const all_data& data) {
+  return std::make_unique<avx2_engine>(data);
+}
+
+} // namespace fastscancount
@@ -0,0 +1,69 @@
+/*
+ * The AVX-512 engine: see dispatch.hpp. This file is built with the AVX-512 flags
+ * from the Makefile whatever MARCH is, with the code from the headers in
+ * fastscancount::avx512 (see common.h). Since bitscan.o is built for MARCH, and
+ * so may not have the AVX-512 bitscan at all, the Makefile also builds bitscan.cpp
+ * with the same flags for this engine.
+ */
+
+#include "dispatch.hpp"
+#include "bitscan.hpp"
+
+namespace fastscancount {
+namespace {
+
+namespace impl = avx512;
+
+/* the bitscan passes and prefetch distances autotune tries */
+constexpr size_t pass_sizes[] = {128, 256, 512, 1024, 2048};
+constexpr size_t prefetch_distances[] = {128, 256, 512};
+
+class avx512_engine : public engine {
+  const all_data& data;
+  impl::bitscan_all_aux<uint32_t> aux;
+  impl::bitscan_scratch<uint32_t> scratch;
+
+public:
+  avx512_engine(const all_data& data) : data{data}, aux{impl::get_all_aux_bitscan<uint32_t>(data)} {}
+
+  isa target() const override { return isa::avx512; }
+
+  const char* name() const override { return "bitscan_avx512_asm"; }
+
+  void scancount(const std::vector<uint32_t>& query, uint8_t threshold,
+                 std::vector<uint32_t>& out) override {
+    if (route_sparse(data, query, threshold, out)) {
+      return;
+    }
+    out.clear();
+    impl::bitscan_avx512_asm({}, out, threshold, aux, query, scratch);
+  }
+
+  tuning get_tuning() const override {
+    return {0, aux.chunks_per_pass, aux.prefetch_distance};
+  }
+
+  void set_tuning(const tuning& t) override {
+    check_tuning(t);
+    aux.chunks_per_pass = t.chunks_per_pass;
+    aux.prefetch_distance = t.prefetch_distance;
+  }
+
+  std::vector<tuning> tuning_candidates() const override {
+    std::vector<tuning> ret;
+    for (size_t pass : pass_sizes) {
+      for (size_t pf : prefetch_distances) {
+        ret.push_back({0, pass, pf});
+      }
+    }
+    return ret;
+  }
+};
+
+} // namespace
+
+std::unique_ptr<engine> make_avx512_engine(const all_data& data) {
+  return std::make_unique<avx512_engine>(data);
+}
+
+} // namespace fastscancount
@@ -0,0 +1,48 @@
+/*
+ * The scalar engine, for CPUs without AVX2: see dispatch.hpp. This file is built
+ * for baseline x86-64 whatever MARCH is, with the code from the headers in
+ * fastscancount::scalar.
+ */
+
+#include "dispatch.hpp"
+#include "fastscancount.h"
+
+#include <algorithm>
+
+namespace fastscancount {
+namespace {
+
+class scalar_engine : public engine {
+  const all_data& data;
+  data_ptrs ptrs;
+  scalar::scan_scratch scratch;
+
+public:
+  scalar_engine(const all_data& data) : data{data} {}
+
+  isa target() const override { return isa::scalar; }
+
+  const char* name() const override { return "fastscancount"; }
+
+  void scancount(const std::vector<uint32_t>& query, uint8_t threshold,
+                 std::vector<uint32_t>& out) override {
+    if (route_sparse(data, query, threshold, out)) {
+      return;
+    }
+    ptrs.clear();
+    for (auto q : query) {
+      ptrs.push_back(&data.at(q));
+    }
+    scalar::fastscancount(ptrs, out, threshold, scratch);
+    // the hits within each chunk come out of order
+    std::sort(out.begin(), out.end());
+  }
+};
+
+} // namespace
+
+std::unique_ptr<engine> make_scalar_engine(const all_data& data) {
+  return std::make_unique<scalar_engine>(data);
+}
+
+} // namespace fastscancount
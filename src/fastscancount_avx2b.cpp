@@ -1,5 +1,19 @@
 #include "fastscancount_avx2b.h"
 
 namespace fastscancount {
-alignas(64) uint8_t counters[counters_size];
+inline namespace FASTSCANCOUNT_ISA {
+
+template <>
+avx2b_context& default_context<uint8_t>() {
+  static thread_local avx2b_context ctx;
+  return ctx;
+}
+
+template <>
+avx2b_context16& default_context<uint16_t>() {
+  static thread_local avx2b_context16 ctx;
+  return ctx;
 }
+
+} // namespace FASTSCANCOUNT_ISA
+} // namespace fastscancount
@@ -0,0 +1,168 @@
+#include "merge.hpp"
+#include "hedley.h"
+
+#include <algorithm>
+
+namespace fastscancount {
+
+namespace {
+
+/* the radix sort takes this many bits of the elements per pass */
+constexpr unsigned digit_bits = 11;
+constexpr size_t radix = size_t{1} << digit_bits;
+
+/*
+ * Rough costs, in cycles. The chunked engines pay a little for every element of
+ * the domain the arrays span, to zero and scan the counters, plus the cost of
+ * incrementing a counter for each element of the arrays. We pay for every element
+ * of the arrays once per radix pass, plus once more to count the runs.
+ */
+constexpr double chunked_id_cost      = 0.05;
+constexpr double chunked_element_cost = 1.5;
+constexpr double sort_pass_cost       = 3;
+constexpr double run_cost             = 1;
+
+/* the number of radix passes needed to sort elements no larger than largest */
+size_t pass_count(uint32_t largest) {
+  unsigned bits = largest ? 32 - __builtin_clz(largest) : 1;
+  return div_up(bits, digit_bits);
+}
+
+uint32_t largest_of(const data_ptrs &data) {
+  uint32_t largest = 0;
+  for (auto d : data) {
+    if (!d->empty()) {
+      largest = std::max(largest, d->back());
+    }
+  }
+  return largest;
+}
+
+/*
+ * LSD radix sort of keys, all of which must be no larger than largest, with tmp and
+ * hist as scratch space. The histograms for all the passes are built in one go, and
+ * a pass where all the keys have the same digit is skipped.
+ */
+HEDLEY_NEVER_INLINE
+void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& tmp, std::vector<uint32_t>& hist,
+                uint32_t largest) {
+  const size_t n = keys.size();
+  if (n == 0) {
+    return;
+  }
+
+  const size_t passes = pass_count(largest);
+  hist.assign(passes * radix, 0);
+  for (auto k : keys) {
+    for (size_t p = 0; p < passes; p++) {
+      hist[p * radix + ((k >> (p * digit_bits)) & (radix - 1))]++;
+    }
+  }
+
+  tmp.resize(n);
+  for (size_t p = 0; p < passes; p++) {
+    const unsigned shift = p * digit_bits;
+    uint32_t *h = &hist[p * radix];
+    if (h[(keys[0] >> shift) & (radix - 1)] == n) {
+      continue;
+    }
+    // turn the counts into the start of each bucket
+    uint32_t sum = 0;
+    for (size_t d = 0; d < radix; d++) {
+      uint32_t count = h[d];
+      h[d] = sum;
+      sum += count;
+    }
+    for (auto k : keys) {
+      tmp[h[(k >> shift) & (radix - 1)]++] = k;
+    }
+    keys.swap(tmp);
+  }
+}
+
+/*
+ * Find the elements of sorted which occur more than threshold times. The arrays
+ * have no duplicates, so no run is longer than the number of arrays.
+ */
+template <bool COUNTS>
+void count_runs(const std::vector<uint32_t>& sorted, std::vector<uint32_t>& out,
+                std::vector<uint32_t>* counts, size_t threshold) {
+  const size_t n = sorted.size();
+  const uint32_t *s = sorted.data();
+  for (size_t i = 0; i + threshold < n;) {
+    const uint32_t id = s[i];
+    size_t end;
+    if (s[i + threshold] == id) {
+      // a hit, so find the rest of the run
+      for (end = i + threshold + 1; end < n && s[end] == id; end++) {}
+      out.push_back(id);
+      if (COUNTS) {
+        counts->push_back(end - i);
+      }
+    } else {
+      // not a hit, so the run ends before i + threshold
+      end = std::upper_bound(s + i + 1, s + i + threshold, id) - s;
+    }
+    i = end;
+  }
+}
+
+template <bool COUNTS>
+void merge_impl(const data_ptrs &data, std::vector<uint32_t> &out, std::vector<uint32_t>* counts,
+                uint8_t threshold, merge_scratch &scratch) {
+  out.clear();
+  if (COUNTS) {
+    counts->clear();
+  }
+
+  size_t total = 0;
+  for (auto d : data) {
+    total += d->size();
+  }
+
+  auto& keys = scratch.keys;
+  keys.clear();
+  keys.reserve(total);
+  for (auto d : data) {
+    keys.insert(keys.end(), d->begin(), d->end());
+  }
+
+  radix_sort(keys, scratch.tmp, scratch.hist, largest_of(data));
+  count_runs<COUNTS>(keys, out, counts, threshold);
+}
+
+}
+
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold,
+                     merge_scratch &scratch) {
+  merge_impl<false>(data, out, nullptr, threshold, scratch);
+}
+
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold) {
+  merge_scratch scratch;
+  merge_scancount(data, out, threshold, scratch);
+}
+
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                     uint8_t threshold, merge_scratch &scratch) {
+  merge_impl<true>(data, out, &counts, threshold, scratch);
+}
+
+void merge_scancount(const data_ptrs &data, std::vector<uint32_t> &out, std::vector<uint32_t> &counts,
+                     uint8_t threshold) {
+  merge_scratch scratch;
+  merge_scancount(data, out, counts, threshold, scratch);
+}
+
+bool prefer_merge(const data_ptrs &data) {
+  size_t total = 0;
+  for (auto d : data) {
+    total += d->size();
+  }
+  const uint32_t largest = largest_of(data);
+  double merge_cost   = total * (pass_count(largest) * sort_pass_cost + run_cost);
+  double chunked_cost = total * chunked_element_cost + (largest + 1.0) * chunked_id_cost;
+  return merge_cost < chunked_cost;
+}
+
+} // namespace fastscancount
@@ -0,0 +1,236 @@
+#include "pigeonhole.hpp"
+#include "hedley.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <numeric>
+
+namespace fastscancount {
+
+namespace {
+
+using candidate = pigeonhole_scratch::candidate;
+using candidates = std::vector<candidate>;
+
+/* merge two sorted candidate lists, adding up the counts for ids in both, into out,
+   which must have room for both */
+void merge_candidates(const candidates& a, const candidates& b, candidates& out) {
+  assert(out.capacity() >= a.size() + b.size());
+  out.clear();
+  auto ai = a.begin(), bi = b.begin();
+  while (ai != a.end() && bi != b.end()) {
+    if (ai->id < bi->id) {
+      out.push_back(*ai++);
+    } else if (bi->id < ai->id) {
+      out.push_back(*bi++);
+    } else {
+      out.push_back({ai->id, ai->count + bi->count});
+      ++ai, ++bi;
+    }
+  }
+  out.insert(out.end(), ai, a.end());
+  out.insert(out.end(), bi, b.end());
+}
+
+/* the number of galloping searches we interleave */
+constexpr size_t probe_streams = 16;
+
+/*
+ * One galloping search through a long array, for each of a sorted run of
+ * candidates in turn. Everything before lo is less than the current candidate.
+ * While galloping, step is the distance to the next probe, and once the
+ * candidate has been bracketed step is zero and we binary search [lo, hi).
+ */
+struct probe_stream {
+  candidate *cand, *cand_end;
+  const uint32_t *lo, *hi;
+  size_t step;
+};
+
+/*
+ * Advance the search by one probe, moving on to the next candidate when the
+ * search for the current one is done, and prefetch the next probe so that it
+ * (hopefully) arrives while we work on the other streams. Returns false once
+ * all the candidates in the stream have been searched.
+ */
+HEDLEY_ALWAYS_INLINE
+bool probe_step(probe_stream& s, const uint32_t* end) {
+  const uint32_t x = s.cand->id;
+  if (s.step) {
+    if ((size_t)(end - s.lo) >= s.step && s.lo[s.step - 1] < x) {
+      s.lo += s.step;
+      s.step *= 2;
+    } else {
+      s.hi = (size_t)(end - s.lo) >= s.step ? s.lo + s.step - 1 : end;
+      s.step = 0;
+    }
+  } else {
+    const uint32_t* mid = s.lo + (s.hi - s.lo) / 2;
+    if (*mid < x) {
+      s.lo = mid + 1;
+    } else {
+      s.hi = mid;
+    }
+  }
+
+  if (s.step == 0 && s.lo == s.hi) {
+    // lo is the lower bound for the candidate
+    if (s.lo != end && *s.lo == x) {
+      s.cand->count++;
+    }
+    if (++s.cand == s.cand_end) {
+      return false;
+    }
+    s.step = 1;
+  }
+
+  const uint32_t* next = s.step ? s.lo + std::min(s.step - 1, (size_t)(end - s.lo)) : s.lo + (s.hi - s.lo) / 2;
+  __builtin_prefetch(next);
+  return true;
+}
+
+/* count the candidates which occur in the sorted array [begin, end) */
+HEDLEY_NEVER_INLINE
+void probe_array(const uint32_t* begin, const uint32_t* end, candidate* cands, size_t count) {
+  probe_stream streams[probe_streams];
+  size_t active = std::min(probe_streams, count);
+  for (size_t i = 0; i < active; i++) {
+    streams[i] = {cands + count * i / active, cands + count * (i + 1) / active, begin, end, 1};
+  }
+
+  while (active) {
+    for (size_t i = 0; i < active; ) {
+      if (probe_step(streams[i], end)) {
+        i++;
+      } else {
+        streams[i] = streams[--active];
+      }
+    }
+  }
+}
+
+/* the arrays in increasing order of size, in sorted */
+void by_size(const data_ptrs &data, data_ptrs &sorted) {
+  sorted.assign(data.begin(), data.end());
+  std::sort(sorted.begin(), sorted.end(), [](auto a, auto b){ return a->size() < b->size(); });
+}
+
+/* a random probe costs about this many sequentially scanned elements */
+constexpr size_t probe_weight = 4;
+
+} // namespace
+
+void pigeonhole_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold) {
+  pigeonhole_scratch scratch;
+  pigeonhole_scancount(data, out, threshold, scratch);
+}
+
+void pigeonhole_scancount(const data_ptrs &data, std::vector<uint32_t> &out, uint8_t threshold,
+                          pigeonhole_scratch &scratch) {
+  out.clear();
+  const size_t n = data.size();
+  if (threshold >= n) {
+    return;
+  }
+
+  auto& arrays = scratch.arrays;
+  by_size(data, arrays);
+  const size_t short_count = n - threshold, need = threshold + 1;
+
+  // the candidates are all the elements of the short arrays, so there are at most as
+  // many as they have elements, which cands and merged both have room for, since they
+  // swap roles as we go
+  size_t total = 0;
+  for (size_t i = 0; i < short_count; i++) {
+    total += arrays[i]->size();
+  }
+  auto& cands = scratch.cands;
+  auto& tmp = scratch.tmp;
+  auto& merged = scratch.merged;
+  cands.reserve(total);
+  merged.reserve(total);
+
+  cands.clear();
+  for (auto e : *arrays[0]) {
+    cands.push_back({e, 1});
+  }
+  for (size_t i = 1; i < short_count; i++) {
+    tmp.clear();
+    for (auto e : *arrays[i]) {
+      tmp.push_back({e, 1});
+    }
+    merge_candidates(cands, tmp, merged);
+    cands.swap(merged);
+  }
+
+  for (size_t i = short_count; i <= n; i++) {
+    // drop the candidates which can't reach the threshold in the remaining arrays, and
+    // the ones which are already hits, which don't need to be probed any more
+    const size_t remaining = n - i;
+    size_t kept = 0;
+    for (auto& c : cands) {
+      if (c.count >= need) {
+        out.push_back(c.id);
+      } else if (c.count + remaining >= need) {
+        cands[kept++] = c;
+      }
+    }
+    cands.resize(kept);
+
+    if (cands.empty() || i == n) {
+      break;
+    }
+
+    probe_array(arrays[i]->data(), arrays[i]->data() + arrays[i]->size(), cands.data(), cands.size());
+  }
+
+  std::sort(out.begin(), out.end());
+}
+
+size_t pigeonhole_cost(const data_ptrs &data, uint8_t threshold) {
+  pigeonhole_scratch scratch;
+  return pigeonhole_cost(data, threshold, scratch);
+}
+
+size_t pigeonhole_cost(const data_ptrs &data, uint8_t threshold, pigeonhole_scratch &scratch) {
+  const size_t n = data.size();
+  if (threshold >= n) {
+    return 0;
+  }
+
+  auto& arrays = scratch.arrays;
+  by_size(data, arrays);
+  const size_t short_count = n - threshold;
+
+  size_t candidates = 0;
+  for (size_t i = 0; i < short_count; i++) {
+    candidates += arrays[i]->size();
+  }
+
+  // every candidate is merged once per short array in the worst case and, ignoring
+  // pruning, probed in every long array with a galloping search which takes about
+  // 2 * lg(gap) probes, where gap is the average distance between candidates
+  size_t cost = candidates * short_count;
+  for (size_t i = short_count; i < n && candidates; i++) {
+    size_t gap = arrays[i]->size() / candidates + 1;
+    cost += candidates * (2 * lg2_up(gap) + 1) * probe_weight;
+  }
+  return cost;
+}
+
+bool prefer_pigeonhole(const data_ptrs &data, uint8_t threshold) {
+  pigeonhole_scratch scratch;
+  return prefer_pigeonhole(data, threshold, scratch);
+}
+
+bool prefer_pigeonhole(const data_ptrs &data, uint8_t threshold, pigeonhole_scratch &scratch) {
+  size_t total = 0;
+  for (auto d : data) {
+    total += d->size();
+  }
+  // the scanning engines are fast per element, so only route queries here when they
+  // would touch far fewer elements
+  return pigeonhole_cost(data, threshold, scratch) * 4 < total;
+}
+
+} // namespace fastscancount
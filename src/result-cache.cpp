@@ -0,0 +1,191 @@
+#include "result-cache.hpp"
+
+#include <algorithm>
+#include <assert.h>
+
+namespace fastscancount {
+
+namespace {
+
+/* a rough guess at the overhead of the list node and hash table slot of an entry */
+constexpr size_t entry_overhead = 64;
+
+uint64_t mix(uint64_t h, uint64_t v) {
+  // combine v into the running hash, then scramble it with the splitmix64 finalizer
+  h ^= v + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111eb;
+  h ^= h >> 31;
+  return h;
+}
+
+void encode(const std::vector<uint32_t>& hits, std::vector<uint8_t>& encoded) {
+  encoded.clear();
+  uint32_t prev = 0;
+  for (auto h : hits) {
+    uint32_t delta = h - prev;
+    prev = h;
+    while (delta >= 0x80) {
+      encoded.push_back((delta & 0x7F) | 0x80);
+      delta >>= 7;
+    }
+    encoded.push_back(delta);
+  }
+}
+
+void decode(const std::vector<uint8_t>& encoded, size_t count, std::vector<uint32_t>& out) {
+  out.resize(count);
+  const uint8_t* p = encoded.data();
+  uint32_t prev = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t delta = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      uint8_t b = *p++;
+      delta |= uint32_t(b & 0x7F) << shift;
+      if (b < 0x80) {
+        break;
+      }
+    }
+    prev += delta;
+    out[i] = prev;
+  }
+}
+
+}
+
+size_t result_cache::entry::bytes() const {
+  return sizeof(entry) + entry_overhead + arrays.size() * sizeof(uint32_t) + encoded.size();
+}
+
+result_cache::result_cache(size_t budget_bytes) : budget_bytes{budget_bytes} {}
+
+uint64_t result_cache::make_key(const std::vector<uint32_t>& query, uint8_t threshold) {
+  key.assign(query.begin(), query.end());
+  std::sort(key.begin(), key.end());
+  uint64_t h = mix(0, threshold);
+  for (auto q : key) {
+    h = mix(h, q);
+  }
+  return h;
+}
+
+result_cache::lru_list::iterator result_cache::find(uint64_t hash, uint8_t threshold) {
+  auto i = index.find(hash);
+  if (i == index.end() || i->second->threshold != threshold || i->second->arrays != key) {
+    return lru.end();
+  }
+  return i->second;
+}
+
+bool result_cache::lookup(const std::vector<uint32_t>& query, uint8_t threshold, std::vector<uint32_t>& out) {
+  auto e = find(make_key(query, threshold), threshold);
+  if (e == lru.end()) {
+    misses++;
+    return false;
+  }
+  hits++;
+  lru.splice(lru.begin(), lru, e);
+  decode(e->encoded, e->hit_count, out);
+  return true;
+}
+
+void result_cache::insert(const std::vector<uint32_t>& query, uint8_t threshold,
+                          const std::vector<uint32_t>& result) {
+  assert(std::is_sorted(result.begin(), result.end()));
+  const uint64_t hash = make_key(query, threshold);
+
+  // an existing entry with the same hash is replaced, whether or not it is for the same key
+  auto old = index.find(hash);
+  if (old != index.end()) {
+    used_bytes -= old->second->bytes();
+    lru.erase(old->second);
+    index.erase(old);
+  }
+
+  entry e{hash, threshold, key, {}, result.size()};
+  encode(result, e.encoded);
+  e.encoded.shrink_to_fit();
+  const size_t bytes = e.bytes();
+  if (bytes > budget_bytes) {
+    return;
+  }
+  evict_until(budget_bytes - bytes);
+
+  lru.push_front(std::move(e));
+  index[hash] = lru.begin();
+  used_bytes += bytes;
+}
+
+void result_cache::evict_until(size_t bytes) {
+  while (used_bytes > bytes) {
+    assert(!lru.empty());
+    auto& victim = lru.back();
+    used_bytes -= victim.bytes();
+    index.erase(victim.hash);
+    lru.pop_back();
+    evictions++;
+  }
+}
+
+void result_cache::clear() {
+  lru.clear();
+  index.clear();
+  used_bytes = 0;
+}
+
+result_cache::stats result_cache::get_stats() const {
+  return {hits, misses, evictions, lru.size(), used_bytes};
+}
+
+namespace {
+
+class cached_engine : public engine {
+  std::unique_ptr<engine> inner;
+  result_cache cache;
+
+public:
+  cached_engine(std::unique_ptr<engine> inner, size_t budget_bytes)
+      : inner{std::move(inner)}, cache{budget_bytes} {}
+
+  isa target() const override { return inner->target(); }
+
+  const char* name() const override { return inner->name(); }
+
+  void scancount(const std::vector<uint32_t>& query, uint8_t threshold,
+                 std::vector<uint32_t>& out) override {
+    if (!cache.lookup(query, threshold, out)) {
+      inner->scancount(query, threshold, out);
+      cache.insert(query, threshold, out);
+    }
+  }
+
+  void set_hot_groups(const std::vector<std::vector<uint32_t>>& groups) override {
+    inner->set_hot_groups(groups);
+  }
+
+  tuning get_tuning() const override { return inner->get_tuning(); }
+
+  void set_tuning(const tuning& t) override {
+    inner->set_tuning(t);
+    cache.clear();
+  }
+
+  std::vector<tuning> tuning_candidates() const override { return inner->tuning_candidates(); }
+
+  tuning autotune(const std::vector<std::vector<uint32_t>>& sample, uint8_t threshold) override {
+    // timing cached results would make every candidate look the same
+    tuning ret = inner->autotune(sample, threshold);
+    cache.clear();
+    return ret;
+  }
+};
+
+}
+
+std::unique_ptr<engine> make_cached_engine(std::unique_ptr<engine> inner, size_t budget_bytes) {
+  return std::make_unique<cached_engine>(std::move(inner), budget_bytes);
+}
+
+} // namespace fastscancount
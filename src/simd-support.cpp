@@ -4,6 +4,7 @@
 #include <ostream>
 
 uint8_t g_pack_left_table_uint8_tx3[256 * 3 + 1];
+uint8_t g_expand_table_uint8_tx3[256 * 3 + 1];
 
 u_int32_t get_nth_bits(int a) {
     u_int32_t out = 0;
@@ -18,15 +19,32 @@ u_int32_t get_nth_bits(int a) {
     return out;
 }
 
+/* for each set bit i, the number of set bits below it, in the 3 bits at i * 3 */
+u_int32_t get_expand_bits(int a) {
+    u_int32_t out = 0;
+    int c = 0;
+    for (int i = 0; i < 8; ++i) {
+        auto set = (a >> i) & 1;
+        if (set) {
+            out |= (c << (i * 3));
+            c++;
+        }
+    }
+    return out;
+}
+
 struct BuildPackMask {
     BuildPackMask() {
         for (int i = 0; i < 256; ++i) {
             uint32_t bits = get_nth_bits(i);
             std::memcpy(g_pack_left_table_uint8_tx3 + i * 3, &bits, sizeof(uint32_t));
+            bits = get_expand_bits(i);
+            std::memcpy(g_expand_table_uint8_tx3 + i * 3, &bits, sizeof(uint32_t));
         }
     }
 };
 
+#ifdef __AVX2__
 std::ostream& operator<<(std::ostream& os, __m256i v) {
     auto vec = to_vector(v);
     os << '[';
@@ -39,6 +57,7 @@ std::ostream& operator<<(std::ostream& os, __m256i v) {
     os << ']';
     return os;
 }
+#endif
 
 BuildPackMask builder;
 
@@ -0,0 +1,679 @@
+/*
+ * avx2b-test.cpp
+ *
+ * Tests for the AVX2B algorithm, checked against a naive scancount.
+ */
+
+#ifdef __AVX2__
+
+#include "batch.hpp"
+#include "fastscancount_avx2b.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+/* arrays which each hold about density * domain elements, so that most elements are in most arrays */
+static all_data dense_data(size_t array_count, double density, uint32_t domain, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::bernoulli_distribution keep(density);
+    all_data data(array_count);
+    for (auto& v : data) {
+        for (uint32_t e = 0; e < domain; e++) {
+            if (keep(rng)) {
+                v.push_back(e);
+            }
+        }
+    }
+    return data;
+}
+
+static std::vector<scored_hit> reference_topk(const all_data& data, const vu32& query, size_t k) {
+    vu32 counts;
+    const vu32 hits = reference(data, query, 0, &counts);
+    std::vector<scored_hit> ret;
+    for (size_t i = 0; i < hits.size(); i++) {
+        ret.push_back({hits[i], counts[i]});
+    }
+    std::stable_sort(ret.begin(), ret.end(), [](auto& a, auto& b){ return a.count > b.count; });
+    ret.resize(std::min(ret.size(), k));
+    return ret;
+}
+
+template <typename T, kernel_fn<T> K>
+void check_avx2b(const all_data& data, const vu32& query, uint8_t threshold) {
+    auto aux = implb::get_all_aux<T>(data);
+    vu32 out;
+    fastscancount_avx2b<T, K>({}, out, threshold, aux, query);
+    CHECK(out == reference(data, query, threshold));
+}
+
+TEST_CASE("avx2b-basic") {
+    auto data = random_arrays(20, 5000, 200000, 1);
+    auto query = all_query(data);
+
+    for (uint8_t threshold : {1, 2, 3, 5}) {
+        INFO("threshold " << (int)threshold);
+        check_avx2b<uint32_t, record_hits_c>(data, query, threshold);
+        check_avx2b<uint16_t, record_hits_c>(data, query, threshold);
+        check_avx2b<uint16_t, record_hits_asm_branchy16>(data, query, threshold);
+    }
+
+    // a query over a subset of the arrays
+    vu32 sub{1, 3, 4, 9, 10, 15};
+    check_avx2b<uint16_t, record_hits_asm_branchy16>(data, sub, 1);
+}
+
+#ifdef __AVX512F__
+TEST_CASE("avx2b-avx512-kernel") {
+    // sparse data, where lanes rarely share a counter dword
+    auto sparse = random_arrays(20, 5000, 200000, 1);
+    // dense data, where most lanes share a dword with their neighbours
+    auto dense = dense_data(60, 0.7, 50000, 13);
+
+    for (auto* data : {&sparse, &dense}) {
+        auto query = all_query(*data);
+        for (uint8_t threshold : {1, 5, 40, 50}) {
+            INFO("threshold " << (int)threshold);
+            check_avx2b<uint16_t, record_hits_avx512<uint16_t>>(*data, query, threshold);
+            check_avx2b<uint32_t, record_hits_avx512<uint32_t>>(*data, query, threshold);
+        }
+    }
+}
+#endif
+
+TEST_CASE("avx2b-range") {
+    auto data = random_arrays(20, 20000, 600000, 12);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+    const uint8_t threshold = 3;
+    const auto all = reference(data, query, threshold);
+
+    const uint32_t c = cache_size;
+    std::vector<std::pair<uint32_t, uint32_t>> windows{
+        {0, -1u}, {0, 1000}, {1000, 2000}, {c - 100, c + 100}, {c, 2 * c}, {c + 1, 5 * c - 1},
+        {3 * c + 7, 3 * c + 8}, {250000, 590000}, {590000, 700000}, {700000, 800000}, {5000, 5000}
+    };
+    for (auto w : windows) {
+        INFO("window " << w.first << " " << w.second);
+        vu32 expected;
+        std::copy_if(all.begin(), all.end(), std::back_inserter(expected),
+                [&](uint32_t e){ return e >= w.first && e < w.second; });
+        vu32 out;
+        fastscancount_avx2b_range<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query, w.first, w.second);
+        CHECK(out == expected);
+    }
+}
+
+TEST_CASE("avx2b-chunk-size") {
+    auto data = random_arrays(20, 20000, 300000, 14);
+    auto query = all_query(data);
+    for (size_t chunk_size : {16384, 24576, 32768}) {
+        INFO("chunk size " << chunk_size);
+        auto aux = implb::get_all_aux<uint16_t>(data, chunk_size);
+        REQUIRE(aux.chunk_size == chunk_size);
+        REQUIRE(aux.max_overshoot() < chunk_size);
+        for (uint8_t threshold : {1, 3}) {
+            const auto expected = reference(data, query, threshold);
+            vu32 out;
+            fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b_range<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query,
+                    chunk_size + 5, 5 * chunk_size);
+            CHECK(out == vu32(std::lower_bound(expected.begin(), expected.end(), chunk_size + 5),
+                              std::lower_bound(expected.begin(), expected.end(), 5 * chunk_size)));
+        }
+    }
+    CHECK_THROWS(implb::get_all_aux<uint16_t>(data, 1000));
+    CHECK_THROWS(implb::get_all_aux<uint16_t>(data, 2 * cache_size));
+}
+
+TEST_CASE("avx2b-skip") {
+    // 6 arrays everywhere, 4 which stop after chunk 5 and 10 which stop after chunk 2,
+    // so at higher thresholds the later chunks can't have any hits
+    const uint32_t c = cache_size;
+    auto data = dense_data(6, 0.02, 8 * c, 15);
+    for (auto& v : dense_data(4, 0.05, 6 * c, 16)) {
+        data.push_back(v);
+    }
+    for (auto& v : dense_data(10, 0.05, 3 * c, 17)) {
+        data.push_back(v);
+    }
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+
+    implb::dynamic_aux<uint16_t> dyn_aux(aux, query);
+    CHECK(dyn_aux.chunk_bound == vu32{20, 20, 20, 10, 10, 10, 6, 6});
+
+    for (uint8_t threshold : {0, 5, 6, 9, 10, 12, 19, 20}) {
+        INFO("threshold " << (int)threshold);
+        const auto expected = reference(data, query, threshold);
+        vu32 out, counts;
+        fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query);
+        CHECK(out == expected);
+        fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, counts, threshold, aux, query);
+        CHECK(out == expected);
+        for (uint32_t lo : {2 * c + 1, 4 * c + 1}) {
+            fastscancount_avx2b_range<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query, lo, -1u);
+            CHECK(out == vu32(std::lower_bound(expected.begin(), expected.end(), lo), expected.end()));
+        }
+    }
+}
+
+TEST_CASE("avx2b-gaps") {
+    // arrays which start late, have long gaps, or are so sparse that a block of 16
+    // elements spans several chunks, which all need the last block of a chunk cut short
+    // rather than overshooting, plus an empty array
+    const uint32_t c = cache_size;
+    auto data = dense_data(6, 0.02, 10 * c, 18);
+    for (auto& v : dense_data(3, 0.05, 10 * c, 19)) {
+        v.erase(v.begin(), std::lower_bound(v.begin(), v.end(), 5 * c + 100));
+        data.push_back(v);
+    }
+    for (auto& v : dense_data(3, 0.05, 10 * c, 20)) {
+        v.erase(std::lower_bound(v.begin(), v.end(), 2 * c - 10), std::lower_bound(v.begin(), v.end(), 7 * c));
+        data.push_back(v);
+    }
+    for (auto& v : random_arrays(3, 60, 10 * c, 21)) {
+        data.push_back(v);
+    }
+    data.push_back({});
+    data.push_back({10 * c - 1});
+    auto query = all_query(data);
+
+    for (size_t chunk_size : {16384ul, (size_t)c}) {
+        INFO("chunk size " << chunk_size);
+        auto aux = implb::get_all_aux<uint16_t>(data, chunk_size);
+        auto aux32 = implb::get_all_aux<uint32_t>(data, chunk_size);
+        CHECK(aux.max_overshoot() <= implb::avx2b_aux_t<uint16_t>::overshoot_limit(chunk_size));
+        CHECK(aux32.max_overshoot() < chunk_size);
+
+        for (uint8_t threshold : {0, 1, 2, 5, 8, 12}) {
+            INFO("threshold " << (int)threshold);
+            const auto expected = reference(data, query, threshold);
+            vu32 out, counts, expected_counts;
+            fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, expected_counts, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b<uint16_t, record_hits_asm_branchless16>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b<uint16_t, record_hits_c<uint16_t>>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b<uint32_t, record_hits_asm_branchy32>({}, out, threshold, aux32, query);
+            CHECK(out == expected);
+            fastscancount_avx2b_wide<uint16_t, record_hits_asm_branchy16w>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b_fused<uint16_t, record_hits_asm_fused16>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+
+            out.clear();
+            implb::dynamic_aux<uint16_t> dyn_aux(aux, query);
+            fastscancount_avx2b_fused_chunks<uint16_t, uint8_t, record_hits_asm_fused16>(
+                    dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), default_context(), &counts);
+            CHECK(out == expected);
+            CHECK(counts == expected_counts);
+
+            for (uint32_t lo : {c + 1, 5 * c + 100}) {
+                fastscancount_avx2b_range<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query, lo, -1u);
+                CHECK(out == vu32(std::lower_bound(expected.begin(), expected.end(), lo), expected.end()));
+            }
+        }
+
+        std::vector<scored_hit> top;
+        fastscancount_avx2b_topk<uint16_t, uint8_t, record_hits_asm_branchy16>({}, top, 100, aux, query);
+        CHECK(top == reference_topk(data, query, 100));
+
+        // only the sparse arrays, so most chunks have nothing to count
+        vu32 sparse_query{12, 13, 14, 15, 16}, out;
+        fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, 0, aux, sparse_query);
+        CHECK(out == reference(data, sparse_query, 0));
+    }
+}
+
+TEST_CASE("avx2b-overshoot") {
+    // the last element of the block of 16 overshoots the first chunk by just under the
+    // chunk size, which rounded up to a multiple of 32 would be the whole chunk size, so
+    // the block has to be cut short
+    const size_t chunk_size = 16384;
+    data_array array(15);
+    std::iota(array.begin(), array.end(), 0);
+    array.push_back(32754);
+    const all_data data{array};
+    const vu32 query{0};
+
+    auto aux = implb::get_all_aux<uint16_t>(data, chunk_size);
+    auto aux32 = implb::get_all_aux<uint32_t>(data, chunk_size);
+    CHECK(aux.max_overshoot() <= chunk_size - 32);
+    CHECK(aux32.max_overshoot() <= chunk_size - 32);
+    implb::dynamic_aux<uint16_t> dyn_aux(aux, query);
+    implb::dynamic_aux<uint32_t> dyn_aux32(aux32, query);
+    for (size_t chunk = 0; chunk < dyn_aux.chunk_count(); chunk++) {
+        CHECK(dyn_aux.max_overshoot[chunk] < chunk_size);
+        CHECK(dyn_aux32.max_overshoot[chunk] < chunk_size);
+    }
+
+    vu32 out;
+    fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, 0, aux, query);
+    CHECK(out == array);
+    fastscancount_avx2b<uint32_t, record_hits_asm_branchy32>({}, out, 0, aux32, query);
+    CHECK(out == array);
+    fastscancount_avx2b_fused<uint16_t, record_hits_asm_fused16>({}, out, 0, aux, query);
+    CHECK(out == array);
+}
+
+TEST_CASE("avx2b-dynamic-aux") {
+    // 19 chunks with the smaller chunk size, so there are whole tiles and some left over,
+    // and sparse arrays so many arrays have nothing to count in many chunks
+    const size_t chunk_size = 16384;
+    auto data = random_arrays(10, 3000, 19 * chunk_size, 22);
+    for (auto& v : random_arrays(20, 40, 19 * chunk_size, 23)) {
+        data.push_back(v);
+    }
+    auto aux = implb::get_all_aux<uint16_t>(data, chunk_size);
+    vu32 query{3, 12, 0, 15, 28, 7, 11, 20};
+
+    implb::dynamic_aux<uint16_t> dyn_aux;
+    for (size_t start : {0, 3, 10}) {
+        INFO("start " << start);
+        dyn_aux.build(aux, query, start, SIZE_MAX);
+        REQUIRE(dyn_aux.chunk_count() == 19);
+        for (size_t chunk = start; chunk < dyn_aux.chunk_count(); chunk++) {
+            INFO("chunk " << chunk);
+            std::vector<const uint16_t*> expected;
+            uint32_t maxo = 0, bound = 0, elements = 0;
+            for (auto q : query) {
+                auto& info = aux.aux_data[q].chunks[chunk];
+                if (info.iter_count) {
+                    expected.push_back(info.start_ptr);
+                }
+                maxo = std::max(maxo, info.overshoot);
+                bound += aux.aux_data[q].range_counts[chunk] != 0;
+                elements += aux.aux_data[q].range_counts[chunk];
+            }
+            std::vector<const uint16_t*> actual;
+            for (auto p = dyn_aux.aux_begin(chunk); p != dyn_aux.aux_end(chunk); p++) {
+                CHECK(p->iter_count != 0);
+                actual.push_back(p->start_ptr);
+            }
+            CHECK(actual == expected);
+            CHECK(dyn_aux.have_work(chunk) == !expected.empty());
+            CHECK(dyn_aux.max_overshoot[chunk] == ((maxo + 31) & -32));
+            CHECK(dyn_aux.chunk_bound[chunk] == bound);
+            CHECK(dyn_aux.chunk_elements[chunk] == elements);
+        }
+    }
+}
+
+TEST_CASE("avx2b-arena") {
+    index_arena empty;
+    CHECK(empty.get_backing() == index_arena::backing::none);
+
+    index_arena big{(size_t{5} << 20) + 100};
+    CHECK(big.get_backing() != index_arena::backing::none);
+    CHECK(get_alignment(big.at<char>(0)) >= index_arena::alignment);
+    auto last = big.at<uint32_t>(index_arena::align(big.size() - 64));
+    CHECK(*last == 0);
+    *last = 1;
+
+    auto data = random_arrays(50, 2000, 200000, 31);
+    data.push_back({});
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    const char* begin = aux.arena.at<char>(0);
+    const char* end = begin + aux.arena.size();
+    auto in_arena = [&](const void* p) {
+        auto c = static_cast<const char*>(p);
+        return c >= begin && c <= end;
+    };
+    auto placed = [&](const void* p) {
+        return in_arena(p) && get_alignment(p) >= index_arena::alignment;
+    };
+    for (auto& a : aux.aux_data) {
+        CHECK(placed(a.data));
+        CHECK(placed(a.chunks.begin));
+        CHECK(placed(a.range_counts.begin));
+        CHECK(a.staged_data.empty());
+        for (size_t c = 0; c < a.chunks.size(); c++) {
+            if (a.chunks[c].iter_count) {
+                CHECK(in_arena(a.chunks[c].start_ptr + a.chunks[c].iter_count * unroll - 1));
+            }
+        }
+    }
+
+    // moving the aux data doesn't move the arena
+    auto moved = std::move(aux);
+    CHECK(moved.arena.at<char>(0) == begin);
+    auto query = all_query(data);
+    vu32 out;
+    fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, 4, moved, query);
+    CHECK(out == reference(data, query, 4));
+}
+
+TEST_CASE("avx2b-planes") {
+    // a dense base group which ends early, plus sparser arrays spanning more chunks
+    auto data = dense_data(12, 0.4, 40000, 51);
+    for (auto& v : random_arrays(8, 5000, 100000, 52)) {
+        data.push_back(v);
+    }
+    const vu32 base{0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+    for (size_t chunk_size : {16384ul, 4096ul}) {
+        INFO("chunk size " << chunk_size);
+        auto aux = implb::get_all_aux<uint16_t>(data, chunk_size);
+        std::vector<count_planes> planes;
+        planes.push_back(get_count_planes(data, base, chunk_size));
+        planes.push_back(get_count_planes(data, {0, 1}, chunk_size));
+        CHECK(planes[0].largest == get_largest(all_data(data.begin(), data.begin() + 10)));
+        auto qctx = std::make_unique<query_context>();
+
+        const std::vector<vu32> queries{
+            {12, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 15},
+            {9, 8, 7, 6, 5, 4, 3, 2, 1, 0},
+            {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 9, 10, 11, 13, 14, 16, 17, 18, 19},
+            {0, 1, 19},
+        };
+        for (auto& query : queries) {
+            for (uint8_t threshold : {0, 1, 5, 9, 10, 11}) {
+                INFO("query size " << query.size() << " threshold " << (int)threshold);
+                const auto expected = reference(data, query, threshold);
+                vu32 out;
+                CHECK(fastscancount_avx2b_planes<uint16_t, uint8_t, record_hits_asm_branchy16>(
+                        {}, out, threshold, aux, planes, query, *qctx));
+                CHECK(out == expected);
+                CHECK(fastscancount_avx2b_planes<uint16_t, uint16_t, record_hits_c<uint16_t, uint16_t>>(
+                        {}, out, threshold, aux, planes, query, *qctx));
+                CHECK(out == expected);
+            }
+        }
+
+        vu32 out{42};
+        CHECK(!fastscancount_avx2b_planes<uint16_t, uint8_t, record_hits_asm_branchy16>(
+                {}, out, 1, aux, planes, {1, 2, 3}, *qctx));
+        CHECK(out == vu32{42});
+    }
+
+    CHECK_THROWS(get_count_planes(data, {3}, cache_size));
+    CHECK_THROWS(get_count_planes(data, {3, 20}, cache_size));
+    CHECK_THROWS(get_count_planes(data, base, 1000));
+}
+
+TEST_CASE("avx2b-hot-groups") {
+    std::mt19937_64 rng(53);
+    std::uniform_int_distribution<uint32_t> extra(100, 199);
+    const vu32 base{5, 10, 15, 20, 25, 30};
+    const vu32 other{1, 2, 3, 4};
+    std::vector<vu32> log;
+    for (size_t i = 0; i < 200; i++) {
+        vu32 q;
+        if (i % 4 != 3) {
+            q = base;
+        } else if (i % 8 == 3) {
+            q = other;
+        }
+        for (int j = 0; j < 3; j++) {
+            q.push_back(extra(rng));
+        }
+        std::shuffle(q.begin(), q.end(), rng);
+        log.push_back(q);
+    }
+
+    auto groups = find_hot_groups(log, 0.1, 4);
+    REQUIRE(groups.size() == 2);
+    CHECK(groups[0] == base);
+    CHECK(groups[1] == other);
+    CHECK(find_hot_groups(log, 0.1, 1).size() == 1);
+    CHECK(find_hot_groups(log, 0.9, 4).empty());
+}
+
+TEST_CASE("avx2b-multi") {
+    auto data = random_arrays(40, 20000, 100000, 61);
+    for (auto& v : dense_data(4, 0.3, 30000, 62)) {
+        data.push_back(v);
+    }
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    const vu32 queries[] = {all_query(data), {0, 1, 2, 40, 41, 42, 43}, {5, 5, 6}};
+    const std::vector<uint8_t> thresholds{0, 2, 3, 7, 7, 20};
+
+    for (auto& query : queries) {
+        INFO("query size " << query.size());
+        std::vector<vu32> out{{42}};
+        fastscancount_avx2b_multi<uint16_t, record_hits_asm_branchy16>({}, out, thresholds, aux, query);
+        REQUIRE(out.size() == thresholds.size());
+        for (size_t i = 0; i < thresholds.size(); i++) {
+            INFO("threshold " << (int)thresholds[i]);
+            CHECK(out[i] == reference(data, query, thresholds[i]));
+        }
+
+        fastscancount_avx2b_multi<uint16_t, record_hits_c<uint16_t>>({}, out, {4}, aux, query);
+        REQUIRE(out.size() == 1);
+        CHECK(out[0] == reference(data, query, 4));
+
+        fastscancount_avx2b_multi<uint16_t, record_hits_asm_branchy16>({}, out, {}, aux, query);
+        CHECK(out.empty());
+    }
+
+    std::vector<vu32> out;
+    CHECK_THROWS(fastscancount_avx2b_multi<uint16_t, record_hits_asm_branchy16>({}, out, {3, 1}, aux, queries[1]));
+}
+
+TEST_CASE("avx2b-fused") {
+    // a few hundred elements per chunk, where the fused kernel should win, and dense data
+    // with many hits
+    auto sparse = random_arrays(10, 2000, 1000000, 1);
+    auto dense = dense_data(60, 0.7, 50000, 13);
+
+    for (auto* data : {&sparse, &dense}) {
+        auto aux = implb::get_all_aux<uint16_t>(*data);
+        auto query = all_query(*data);
+        for (uint8_t threshold : {0, 1, 3, 40, 50}) {
+            INFO("threshold " << (int)threshold);
+            const auto expected = reference(*data, query, threshold);
+            vu32 out;
+            fastscancount_avx2b_fused<uint16_t, record_hits_fused_c<uint16_t>>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b_fused<uint16_t, record_hits_asm_fused16>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+            fastscancount_avx2b_auto<uint16_t, record_hits_asm_branchy16, record_hits_asm_fused16>({}, out, threshold, aux, query);
+            CHECK(out == expected);
+
+            vu32 counts, expected_counts;
+            fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, expected_counts, threshold, aux, query);
+            out.clear();
+            implb::dynamic_aux<uint16_t> dyn_aux(aux, query);
+            fastscancount_avx2b_fused_chunks<uint16_t, uint8_t, record_hits_asm_fused16>(
+                    dyn_aux, out, threshold, 0, dyn_aux.chunk_count(), default_context(), &counts);
+            CHECK(out == expected);
+            CHECK(counts == expected_counts);
+
+            // starting part way through, so the first chunk's overshoot has to be counted first
+            out.clear();
+            fastscancount_avx2b_fused_chunks<uint16_t, uint8_t, record_hits_asm_fused16>(
+                    dyn_aux, out, threshold, 1, dyn_aux.chunk_count(), default_context());
+            CHECK(out == vu32(std::lower_bound(expected.begin(), expected.end(), cache_size), expected.end()));
+        }
+    }
+
+    // few hits: the fused kernel is cheaper; many hits: scanning is
+    auto sparse_aux = implb::get_all_aux<uint16_t>(sparse), dense_aux = implb::get_all_aux<uint16_t>(dense);
+    CHECK(prefer_fused(implb::dynamic_aux<uint16_t>(sparse_aux, all_query(sparse)), 3));
+    CHECK_FALSE(prefer_fused(implb::dynamic_aux<uint16_t>(dense_aux, all_query(dense)), 1));
+}
+
+TEST_CASE("avx2b-wide") {
+    // more than 255 arrays, so the counts overflow 8-bit counters
+    auto data = dense_data(300, 0.9, 100000, 5);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+
+    for (uint16_t threshold : {1, 200, 254, 255, 265, 270, 280, 299}) {
+        INFO("threshold " << threshold);
+        vu32 out;
+        fastscancount_avx2b_wide<uint16_t, record_hits_asm_branchy16w>({}, out, threshold, aux, query);
+        CHECK(out == reference(data, query, threshold));
+        fastscancount_avx2b_wide<uint16_t, record_hits_c<uint16_t, uint16_t>>({}, out, threshold, aux, query);
+        CHECK(out == reference(data, query, threshold));
+    }
+
+    // the wide version also works for small queries
+    auto sparse = random_arrays(20, 5000, 200000, 6);
+    auto aux32 = implb::get_all_aux<uint32_t>(sparse);
+    vu32 out;
+    fastscancount_avx2b_wide<uint32_t, record_hits_c<uint32_t, uint16_t>>({}, out, 2, aux32, all_query(sparse));
+    CHECK(out == reference(sparse, all_query(sparse), 2));
+}
+
+TEST_CASE("avx2b-topk") {
+    // half the arrays only have elements in the first few chunks, and most of
+    // the arrays share a dense range, so once the heap fills up the later chunks
+    // can be skipped
+    auto data = random_arrays(20, 3000, 120000, 7);
+    auto rest = random_arrays(20, 8000, 400000, 8);
+    data.insert(data.end(), rest.begin(), rest.end());
+    for (uint32_t i = 0; i < 30; i++) {
+        auto& v = data[i];
+        for (uint32_t e = 100000; e < 100500; e++) {
+            v.push_back(e);
+        }
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+
+    for (size_t k : {0, 1, 10, 100, 1000, 100000, 10000000}) {
+        INFO("k " << k);
+        const auto expected = reference_topk(data, query, k);
+        std::vector<scored_hit> out;
+        fastscancount_avx2b_topk<uint16_t, uint8_t, record_hits_asm_branchy16>({}, out, k, aux, query);
+        CHECK(out == expected);
+        fastscancount_avx2b_topk<uint16_t, uint16_t, record_hits_asm_branchy16w>({}, out, k, aux, query);
+        CHECK(out == expected);
+    }
+
+    vu32 sub{2, 11, 12, 30};
+    std::vector<scored_hit> out;
+    fastscancount_avx2b_topk<uint16_t, uint8_t, record_hits_c<uint16_t>>({}, out, 50, aux, sub);
+    CHECK(out == reference_topk(data, sub, 50));
+}
+
+TEST_CASE("avx2b-topk-wide") {
+    auto data = dense_data(300, 0.9, 100000, 8);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+    std::vector<scored_hit> out;
+    fastscancount_avx2b_topk<uint16_t, uint16_t, record_hits_asm_branchy16w>({}, out, 500, aux, query);
+    CHECK(out == reference_topk(data, query, 500));
+
+    // too many arrays for the 8-bit counters
+    CHECK_THROWS_AS((fastscancount_avx2b_topk<uint16_t, uint8_t, record_hits_asm_branchy16>({}, out, 500, aux, query)),
+                    std::invalid_argument);
+    query.resize(128);
+    CHECK_THROWS_AS((fastscancount_avx2b_topk<uint16_t, uint8_t, record_hits_asm_branchy16>({}, out, 500, aux, query)),
+                    std::invalid_argument);
+    query.resize(127);
+    fastscancount_avx2b_topk<uint16_t, uint8_t, record_hits_asm_branchy16>({}, out, 500, aux, query);
+    CHECK(out == reference_topk(data, query, 500));
+}
+
+TEST_CASE("avx2b-concurrent") {
+    auto data = random_arrays(30, 4000, 300000, 2);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+    const uint8_t threshold = 3;
+    const auto expected = reference(data, query, threshold);
+
+    constexpr size_t thread_count = 4, repeats = 20;
+    std::vector<vu32> results(thread_count);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; t++) {
+        threads.emplace_back([&, t]() {
+            auto ctx = std::make_unique<avx2b_context>();
+            for (size_t r = 0; r < repeats; r++) {
+                vu32 out;
+                fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query, *ctx);
+                if (out != expected) {
+                    return; // leaves the result empty so the check below fails
+                }
+            }
+            results[t] = expected;
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (auto& r : results) {
+        CHECK(r == expected);
+    }
+}
+
+TEST_CASE("avx2b-parallel") {
+    auto data = random_arrays(25, 6000, 500000, 3);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    auto query = all_query(data);
+
+    for (uint8_t threshold : {1, 4}) {
+        const auto expected = reference(data, query, threshold);
+        for (size_t threads : {1, 2, 3, 5, 64}) {
+            INFO("threshold " << (int)threshold << " threads " << threads);
+            vu32 out;
+            fastscancount_avx2b_parallel<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, query, threads);
+            CHECK(out == expected);
+        }
+    }
+
+    // on a pool of our own, with more ranges than workers and a query which doesn't
+    // span the whole domain
+    worker_pool pool(2, false);
+    vu32 sub{1, 2, 3}, out;
+    data[1].erase(std::lower_bound(data[1].begin(), data[1].end(), 100000), data[1].end());
+    data[2].erase(std::lower_bound(data[2].begin(), data[2].end(), 200000), data[2].end());
+    data[3].erase(std::lower_bound(data[3].begin(), data[3].end(), 150000), data[3].end());
+    aux = implb::get_all_aux<uint16_t>(data);
+    for (size_t ranges : {1, 2, 7}) {
+        INFO("ranges " << ranges);
+        fastscancount_avx2b_parallel<uint16_t, record_hits_asm_branchy16>({}, out, 0, aux, sub, ranges, pool);
+        CHECK(out == reference(data, sub, 0));
+        fastscancount_avx2b_parallel<uint16_t, record_hits_asm_branchy16>({}, out, 1, aux, query, ranges, pool);
+        CHECK(out == reference(data, query, 1));
+    }
+}
+
+TEST_CASE("avx2b-batch") {
+    auto data = random_arrays(20, 3000, 250000, 4);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+
+    std::vector<vu32> queries{
+        {0, 1, 2, 3, 4, 5},
+        {5, 4, 3, 2, 1, 0}, // same as the first, in a different order
+        all_query(data),
+        {7, 8, 9, 10, 11, 12, 13, 14},
+        {0, 1, 2, 3, 4, 5},
+        all_query(data),
+    };
+    std::vector<uint8_t> thresholds{1, 1, 3, 2, 2, 3};
+
+    worker_pool pool(3, false);
+    auto engine = avx2b_engine<uint16_t, record_hits_asm_branchy16>(aux);
+    for (int repeat = 0; repeat < 3; repeat++) {
+        auto results = scancount_batch(pool, queries, thresholds, engine);
+        REQUIRE(results.size() == queries.size());
+        for (size_t i = 0; i < queries.size(); i++) {
+            INFO("query " << i);
+            CHECK(results[i] == reference(data, queries[i], thresholds[i]));
+        }
+    }
+
+    CHECK(scancount_batch(pool, {}, {}, engine).empty());
+    CHECK_THROWS(scancount_batch(pool, queries, {1}, engine));
+}
+
+#endif // __AVX2__
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Build the unit tests for baseline x86-64 (MARCH=x86-64), check that the engines' objects
+# share no symbols with objects built for another instruction set, and run the tests,
+# which then cover the scalar engine in a build where nothing else may need more than
+# x86-64. Any arguments are passed to make. Leaves the tree built for x86-64.
+#
+# An inline function or template instantiation defined in two objects built with
+# different flags means the linker keeps whichever copy comes first, so the program
+# would only be right for some link orders, see isa-rename.sh. The typeinfo objects
+# hold no code and are left shared.
+
+set -e -o pipefail
+
+cd "$(dirname "$0")/.."
+
+make clean
+make -j"$(nproc)" MARCH=x86-64 "$@" unit-test
+
+for obj in src/*.o test/*.o; do
+    name=$(basename "$obj" .o)
+    case $name in
+        engine-*|bitscan-*) isa=${name#*-} ;;
+        *)                  isa=march ;;
+    esac
+    nm --defined-only "$obj" |
+        awk -v isa="$isa" '$2 ~ /^[TDBRWV]$/ && $3 !~ /^_ZT[IS]/ && $3 !~ /^DW\.ref\./ { print $3, isa }'
+done | sort -u | awk '
+    { isas[$1] = isas[$1] " " $2; count[$1]++ }
+    END {
+        for (sym in count) {
+            if (count[sym] > 1) {
+                print "defined for" isas[sym] ": " sym
+                shared++
+            }
+        }
+        exit shared > 0
+    }' | c++filt
+
+./unit-test
@@ -0,0 +1,115 @@
+/*
+ * counts-test.cpp
+ *
+ * Tests for the engines which return the count for each hit along with the hits.
+ */
+
+#ifdef __AVX2__
+
+#include "fastscancount_avx2b.h"
+#include "bitscan.hpp"
+#include "fastscancount.h"
+#include "fastscancount_avx2.h"
+#ifdef __AVX512F__
+#include "fastscancount_avx512.h"
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+namespace {
+
+struct counts_fixture {
+    all_data data;
+    data_ptrs ptrs;
+    vu32 query;
+
+    counts_fixture(size_t array_count, size_t array_size, uint32_t domain, uint64_t seed)
+        : data(random_arrays(array_count, array_size, domain, seed)), ptrs(ptrs_of(data)), query(all_query(data)) {}
+
+    /* the expected hits and their counts */
+    std::pair<vu32, vu32> expected(size_t threshold) const {
+        std::pair<vu32, vu32> ret;
+        ret.first = reference(data, query, threshold, &ret.second);
+        return ret;
+    }
+};
+
+/* sort hits and their counts by hit */
+std::pair<vu32, vu32> sorted(const vu32& out, const vu32& counts) {
+    std::vector<std::pair<uint32_t, uint32_t>> pairs;
+    for (size_t i = 0; i < out.size() && i < counts.size(); i++) {
+        pairs.emplace_back(out[i], counts[i]);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    std::pair<vu32, vu32> ret;
+    for (auto& p : pairs) {
+        ret.first.push_back(p.first);
+        ret.second.push_back(p.second);
+    }
+    if (out.size() != counts.size()) {
+        ret.second.push_back(-1); // make sure the check fails
+    }
+    return ret;
+}
+
+}
+
+TEST_CASE("counts") {
+    counts_fixture f(24, 30000, 300000, 9);
+
+    for (uint8_t threshold : {1, 3, 6, 12}) {
+        INFO("threshold " << (int)threshold);
+        const auto expected = f.expected(threshold);
+        vu32 out, counts;
+
+        // the scalar version finds the hits in no particular order
+        fastscancount::fastscancount(f.ptrs, out, counts, threshold);
+        CHECK(sorted(out, counts) == expected);
+
+        fastscancount_avx2(f.ptrs, out, counts, threshold);
+        CHECK(std::make_pair(out, counts) == expected);
+
+        auto aux16 = implb::get_all_aux<uint16_t>(f.data);
+        fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>(f.ptrs, out, counts, threshold, aux16, f.query);
+        CHECK(std::make_pair(out, counts) == expected);
+        fastscancount_avx2b_wide<uint16_t, record_hits_asm_branchy16w>(f.ptrs, out, counts, threshold, aux16, f.query);
+        CHECK(std::make_pair(out, counts) == expected);
+
+        auto bitscan_aux = get_all_aux_bitscan<uint32_t>(f.data);
+        out.clear();
+        bitscan_fake2(f.ptrs, out, counts, threshold, bitscan_aux, f.query);
+        CHECK(std::make_pair(out, counts) == expected);
+
+#ifdef __AVX512F__
+        const uint32_t range_size = 40000;
+        all_data range_ends(f.data.size());
+        data_ptrs range_ptrs;
+        for (size_t i = 0; i < f.data.size(); i++) {
+            auto& v = f.data[i];
+            for (uint32_t start = 0; start <= get_largest(f.data); start += range_size) {
+                range_ends[i].push_back(std::lower_bound(v.begin(), v.end(), start + range_size) - v.begin());
+            }
+            range_ptrs.push_back(&range_ends[i]);
+        }
+        fastscancount_avx512(f.ptrs, out, counts, threshold, range_size, range_ptrs);
+        CHECK(std::make_pair(out, counts) == expected);
+
+        out.clear();
+        bitscan_avx512(f.ptrs, out, counts, threshold, bitscan_aux, f.query);
+        CHECK(std::make_pair(out, counts) == expected);
+        out.clear();
+        bitscan_avx512_asm(f.ptrs, out, counts, threshold, bitscan_aux, f.query);
+        CHECK(std::make_pair(out, counts) == expected);
+#endif
+    }
+}
+
+#endif // __AVX2__
@@ -0,0 +1,209 @@
+/*
+ * dispatch-test.cpp
+ *
+ * Tests for the runtime-dispatched engines.
+ */
+
+#include "dispatch.hpp"
+#include "merge.hpp"
+#include "pigeonhole.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+TEST_CASE("dispatch") {
+    // enough arrays that the AVX2 engine needs its wide counters for the full query
+    auto data = random_arrays(140, 3000, 100000, 9);
+    vu32 all(data.size());
+    std::iota(all.begin(), all.end(), 0);
+    std::vector<vu32> queries{all, {0, 5, 10, 15, 20, 25, 30}, {17}};
+
+    const isa best = detect_isa();
+    INFO("detected " << isa_name(best));
+    CHECK(make_engine(data)->target() == best);
+
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        INFO("isa " << isa_name(target));
+        if (target > best) {
+            CHECK_THROWS(make_engine(data, target));
+            continue;
+        }
+        auto e = make_engine(data, target);
+        CHECK(e->target() == target);
+        for (auto& query : queries) {
+            for (uint8_t threshold : {0, 1, 3, 9}) {
+                INFO("query size " << query.size() << " threshold " << (int)threshold);
+                vu32 out{123}; // engines overwrite any old contents
+                e->scancount(query, threshold, out);
+                CHECK(out == reference(data, query, threshold));
+            }
+        }
+    }
+}
+
+TEST_CASE("dispatch-sparse") {
+    // sparse enough that every engine routes the query to merge_scancount
+    auto data = random_arrays(10, 300, 20000000, 12);
+    vu32 query{0, 4, 7};
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        if (target > detect_isa()) {
+            continue;
+        }
+        INFO("isa " << isa_name(target));
+        auto e = make_engine(data, target);
+        for (uint8_t threshold : {0, 1}) {
+            vu32 out;
+            e->scancount(query, threshold, out);
+            CHECK(out == reference(data, query, threshold));
+        }
+    }
+}
+
+TEST_CASE("dispatch-pigeonhole") {
+    // two short arrays and many long ones at threshold n - 2, so every hit is in one of
+    // the short arrays and every engine routes the query to pigeonhole_scancount
+    auto data = random_arrays(2, 50, 100000, 14);
+    auto longer = random_arrays(20, 300000, 100000, 15);
+    data.insert(data.end(), longer.begin(), longer.end());
+    const vu32 query = all_query(data);
+    const uint8_t threshold = data.size() - 2;
+    const data_ptrs ptrs = ptrs_of(data);
+    REQUIRE(!prefer_merge(ptrs));
+    REQUIRE(prefer_pigeonhole(ptrs, threshold));
+    const auto expected = reference(data, query, threshold);
+    REQUIRE(!expected.empty());
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        if (target > detect_isa()) {
+            continue;
+        }
+        INFO("isa " << isa_name(target));
+        auto e = make_engine(data, target);
+        vu32 out{123};
+        e->scancount(query, threshold, out);
+        CHECK(out == expected);
+    }
+}
+
+TEST_CASE("dispatch-vbmi2") {
+    // sparse enough for the byte bitmaps, but not for merge_scancount
+    auto data = random_arrays(40, 20000, 10000000, 16);
+    const vu32 query = all_query(data);
+    REQUIRE(!prefer_merge(ptrs_of(data)));
+    if (detect_isa() < isa::avx512vbmi2) {
+        return;
+    }
+    auto e = make_engine(data, isa::avx512vbmi2);
+    CHECK(std::string(e->name()) == "bitscan_avx512_vbmi2");
+    for (uint8_t threshold : {0, 1, 3}) {
+        INFO("threshold " << (int)threshold);
+        vu32 out{123};
+        e->scancount(query, threshold, out);
+        CHECK(out == reference(data, query, threshold));
+    }
+}
+
+TEST_CASE("dispatch-edges") {
+    // the largest element is a multiple of the scalar engine's 65536 element range, so
+    // it falls in a range of its own, and there are empty arrays, including a query of
+    // nothing but empty arrays
+    data_array full(65537);
+    std::iota(full.begin(), full.end(), 0);
+    const all_data data{full, {}, full, full, {}};
+    const std::vector<vu32> queries{{0, 2, 3}, {0, 1, 2, 3, 4}, {1, 0}, {1, 4}};
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        if (target > detect_isa()) {
+            continue;
+        }
+        INFO("isa " << isa_name(target));
+        auto e = make_engine(data, target);
+        for (auto& query : queries) {
+            for (uint8_t threshold : {0, 1, 2}) {
+                INFO("query size " << query.size() << " threshold " << (int)threshold);
+                vu32 out{123};
+                e->scancount(query, threshold, out);
+                CHECK(out == reference(data, query, threshold));
+            }
+        }
+        vu32 out;
+        e->scancount({0, 2, 3}, 1, out);
+        CHECK(out.size() == 65537);
+    }
+}
+
+TEST_CASE("dispatch-hot-groups") {
+    auto data = random_arrays(140, 20000, 100000, 13);
+    const std::vector<vu32> groups{{0, 1, 2, 3, 4, 5, 6, 7}, {10, 11, 12}};
+    vu32 all(data.size());
+    std::iota(all.begin(), all.end(), 0);
+    std::vector<vu32> queries{{0, 1, 2, 3, 4, 5, 6, 7, 20, 30}, {12, 11, 10, 50}, {1, 2, 3}, all};
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        if (target > detect_isa()) {
+            continue;
+        }
+        INFO("isa " << isa_name(target));
+        auto e = make_engine(data, target);
+        e->set_hot_groups(groups);
+        for (int pass = 0; pass < 2; pass++) {
+            for (auto& query : queries) {
+                for (uint8_t threshold : {0, 3, 7, 100}) {
+                    INFO("query size " << query.size() << " threshold " << (int)threshold);
+                    vu32 out;
+                    e->scancount(query, threshold, out);
+                    CHECK(out == reference(data, query, threshold));
+                }
+            }
+            // the planes are rebuilt for the new chunk size
+            auto candidates = e->tuning_candidates();
+            e->set_tuning(candidates.back());
+        }
+    }
+}
+
+TEST_CASE("autotune") {
+    auto data = random_arrays(40, 5000, 200000, 10);
+    std::vector<vu32> sample{{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}, {10, 20, 30}, {5, 15, 25, 35, 39}};
+
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        if (target > detect_isa()) {
+            continue;
+        }
+        INFO("isa " << isa_name(target));
+        auto e = make_engine(data, target);
+        auto candidates = e->tuning_candidates();
+        REQUIRE(!candidates.empty());
+
+        auto best = e->autotune(sample, 1);
+        CHECK(e->get_tuning() == best);
+        CHECK(std::find(candidates.begin(), candidates.end(), best) != candidates.end());
+
+        // the results don't depend on the tuning, including the AVX2 engine's kernels
+        // for 16-bit counters, which queries of 128 or more arrays use
+        vu32 wide;
+        for (uint32_t i = 0; i < 130; i++) {
+            wide.push_back(i % data.size());
+        }
+        for (auto& t : candidates) {
+            INFO("chunk size " << t.chunk_size << " prefetch " << t.prefetch_distance);
+            e->set_tuning(t);
+            for (auto& query : sample) {
+                vu32 out;
+                e->scancount(query, 1, out);
+                CHECK(out == reference(data, query, 1));
+            }
+            vu32 out;
+            e->scancount(wide, 5, out);
+            CHECK(out == reference(data, wide, 5));
+        }
+
+        CHECK_THROWS(e->set_tuning({1, 2, 3}));
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * hybrid-test.cpp
+ *
+ * Tests for the hybrid bitscan/AVX2B engine.
+ */
+
+#ifdef __AVX2__
+
+#include "hybrid.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+namespace {
+
+/*
+ * Arrays which are dense in some regions and sparse in the others: region r has
+ * density densities[r % densities.size()].
+ */
+all_data striped_data(size_t array_count, size_t regions, const std::vector<double>& densities, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> dist;
+    all_data data(array_count);
+    for (auto& v : data) {
+        for (uint32_t e = 0; e < regions * hybrid_region_size; e++) {
+            if (dist(rng) < densities[e / hybrid_region_size % densities.size()]) {
+                v.push_back(e);
+            }
+        }
+    }
+    return data;
+}
+
+}
+
+TEST_CASE("hybrid") {
+    // two dense regions then two sparse ones, so both engines run, with runs of each
+    auto data = striped_data(24, 10, {0.3, 0.3, 0.001, 0.001}, 21);
+    // and two arrays which only cover the first region
+    for (uint64_t seed : {31, 32}) {
+        data.push_back(striped_data(1, 1, {0.5}, seed).front());
+    }
+    auto avx2b_aux = implb::get_all_aux<uint16_t>(data);
+    auto bitscan_aux = get_all_aux_bitscan<uint32_t>(data);
+    hybrid_aux<uint16_t> aux(avx2b_aux, bitscan_aux);
+
+    vu32 query(24);
+    std::iota(query.begin(), query.end(), 0);
+
+    using re = region_engine;
+    std::vector<region_engine> plan;
+    hybrid_plan(aux, query, plan);
+    CHECK(plan == std::vector<region_engine>{re::bitscan, re::bitscan, re::avx2b, re::avx2b, re::bitscan,
+                                             re::bitscan, re::avx2b, re::avx2b, re::bitscan, re::bitscan});
+
+    for (uint8_t threshold : {0, 1, 3, 10}) {
+        INFO("threshold " << (int)threshold);
+        const auto expected = reference(data, query, threshold);
+        vu32 out;
+        hybrid_scancount<uint16_t, record_hits_asm_branchy16, bitscan_fake2<uint32_t>>({}, out, threshold, aux, query);
+        CHECK(out == expected);
+#ifdef __AVX512F__
+        hybrid_scancount<uint16_t, record_hits_asm_branchy16, bitscan_avx512<uint32_t>>({}, out, threshold, aux, query);
+        CHECK(out == expected);
+#endif
+        hybrid_scancount<uint16_t, record_hits_asm_branchy16, bitscan_avx2<uint32_t>>({}, out, threshold, aux, query);
+        CHECK(out == expected);
+    }
+
+    // a small query
+    vu32 sub{3, 7}, out;
+    hybrid_scancount<uint16_t, record_hits_asm_branchy16, bitscan_avx2<uint32_t>>({}, out, 1, aux, sub);
+    CHECK(out == reference(data, sub, 1));
+
+    // a query with nothing past the first region
+    vu32 first{24, 25};
+    hybrid_plan(aux, first, plan);
+    CHECK(std::count(plan.begin(), plan.end(), re::skip) == 9);
+    hybrid_scancount<uint16_t, record_hits_asm_branchy16, bitscan_avx2<uint32_t>>({}, out, 1, aux, first);
+    CHECK(out == reference(data, first, 1));
+
+    auto other = get_all_aux_bitscan<uint32_t>(striped_data(3, 1, {0.1}, 22));
+    CHECK_THROWS(hybrid_aux<uint16_t>(avx2b_aux, other));
+}
+
+#endif // __AVX2__
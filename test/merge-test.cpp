@@ -0,0 +1,52 @@
+/*
+ * merge-test.cpp
+ *
+ * Tests for the merge-based engine.
+ */
+
+#include "merge.hpp"
+
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+TEST_CASE("merge") {
+    // a small domain, so that many elements are in most arrays, and a large one
+    for (uint32_t domain : {3000u, 20000000u, 0xffffffffu}) {
+        INFO("domain " << domain);
+        auto data = random_arrays(12, 2000, domain, domain);
+        data.push_back({}); // empty arrays are fine
+        auto ptrs = ptrs_of(data);
+
+        for (uint8_t threshold = 0; threshold <= data.size(); threshold++) {
+            INFO("threshold " << (int)threshold);
+            vu32 expected_counts;
+            const vu32 expected = reference(data, all_query(data), threshold, &expected_counts);
+
+            vu32 out{1, 2, 3}, counts;
+            merge_scancount(ptrs, out, threshold);
+            CHECK(out == expected);
+            merge_scancount(ptrs, out, counts, threshold);
+            CHECK(out == expected);
+            CHECK(counts == expected_counts);
+        }
+    }
+
+    vu32 out;
+    merge_scancount({}, out, 0);
+    CHECK(out.empty());
+}
+
+TEST_CASE("merge-cost") {
+    // a few thousand elements over a large domain
+    auto sparse = random_arrays(10, 300, 20000000, 1);
+    CHECK(prefer_merge(ptrs_of(sparse)));
+    // many elements over the same domain
+    auto dense = random_arrays(10, 500000, 20000000, 2);
+    CHECK_FALSE(prefer_merge(ptrs_of(dense)));
+}
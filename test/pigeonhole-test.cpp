@@ -0,0 +1,76 @@
+/*
+ * pigeonhole-test.cpp
+ *
+ * Tests for the candidate-and-probe engine.
+ */
+
+#include "pigeonhole.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+namespace {
+
+/* arrays of very different sizes, all drawn from the same domain */
+all_data skewed_data(const std::vector<size_t>& sizes, uint32_t domain, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    all_data data;
+    for (auto size : sizes) {
+        data.push_back(random_array(size, domain, rng));
+    }
+    return data;
+}
+
+}
+
+TEST_CASE("pigeonhole") {
+    // a couple of short arrays and many long ones, dense enough that many
+    // elements are in most arrays
+    std::vector<size_t> sizes{500, 2000, 9000};
+    for (int i = 0; i < 9; i++) {
+        sizes.push_back(60000 + i * 5000);
+    }
+    auto data = skewed_data(sizes, 100000, 10);
+    auto ptrs = ptrs_of(data);
+
+    for (uint8_t threshold = 0; threshold <= data.size(); threshold++) {
+        INFO("threshold " << (int)threshold);
+        vu32 out;
+        pigeonhole_scancount(ptrs, out, threshold);
+        CHECK(out == reference(data, all_query(data), threshold));
+    }
+
+    // the order of the arrays doesn't matter
+    std::reverse(ptrs.begin(), ptrs.end());
+    vu32 out;
+    pigeonhole_scancount(ptrs, out, 9);
+    CHECK(out == reference(data, all_query(data), 9));
+
+    pigeonhole_scancount({}, out, 0);
+    CHECK(out.empty());
+}
+
+TEST_CASE("pigeonhole-cost") {
+    std::vector<size_t> sizes{100, 200};
+    for (int i = 0; i < 10; i++) {
+        sizes.push_back(200000);
+    }
+    auto data = skewed_data(sizes, 10000000, 11);
+    auto ptrs = ptrs_of(data);
+    const uint8_t n = data.size();
+
+    // with a high threshold the candidates come from the tiny arrays
+    CHECK(prefer_pigeonhole(ptrs, n - 2));
+    CHECK(pigeonhole_cost(ptrs, n - 2) < pigeonhole_cost(ptrs, n - 5));
+    // with a low threshold most of the data are candidates
+    CHECK_FALSE(prefer_pigeonhole(ptrs, 1));
+    CHECK(pigeonhole_cost(ptrs, n) == 0);
+}
@@ -0,0 +1,219 @@
+/*
+ * query-context-test.cpp
+ *
+ * Tests that the engines and the functions taking scratch memory don't allocate
+ * once they have warmed up. This replaces the global operator new to count the
+ * allocations made by the whole binary.
+ */
+
+#include "dispatch.hpp"
+#include "merge.hpp"
+#include "pigeonhole.hpp"
+#ifdef __AVX2__
+#include "hybrid.hpp"
+#include "query-context.hpp"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+namespace {
+std::atomic<size_t> allocations{0};
+}
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+TEST_CASE("query-context-engines") {
+    auto data = random_arrays(140, 3000, 100000, 21);
+    // a few sparse arrays over a large domain, which are routed to merge_scancount
+    auto sparse = random_arrays(10, 300, 20000000, 22);
+    std::move(sparse.begin(), sparse.end(), std::back_inserter(data));
+
+    vu32 all(140);
+    std::iota(all.begin(), all.end(), 0);
+    const std::vector<vu32> queries{all, {0, 5, 10, 15, 20, 25, 30}, {140, 141, 142, 143, 144, 145}, {17}};
+    const uint8_t thresholds[] = {0, 2, 5};
+
+    std::vector<vu32> expected;
+    for (auto& query : queries) {
+        for (auto threshold : thresholds) {
+            expected.push_back(reference(data, query, threshold));
+        }
+    }
+
+    for (isa target : {isa::scalar, isa::avx2, isa::avx512, isa::avx512vbmi2}) {
+        if (target > detect_isa()) {
+            continue;
+        }
+        INFO("isa " << isa_name(target));
+        auto e = make_engine(data, target);
+        vu32 out;
+        // the first pass grows the scratch memory and out, after which nothing should allocate
+        for (int pass = 0; pass < 2; pass++) {
+            INFO("pass " << pass);
+            size_t i = 0;
+            const size_t before = allocations;
+            for (auto& query : queries) {
+                for (auto threshold : thresholds) {
+                    e->scancount(query, threshold, out);
+                    REQUIRE(out == expected.at(i++));
+                }
+            }
+            if (pass > 0) {
+                CHECK(allocations == before);
+            }
+        }
+    }
+}
+
+TEST_CASE("query-context-merge") {
+    auto data = random_arrays(20, 500, 20000000, 23);
+    data_ptrs ptrs;
+    for (auto& d : data) {
+        ptrs.push_back(&d);
+    }
+    vu32 all(data.size());
+    std::iota(all.begin(), all.end(), 0);
+    auto expected = reference(data, all, 1);
+
+    merge_scratch scratch;
+    vu32 out, counts;
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t before = allocations;
+        merge_scancount(ptrs, out, 1, scratch);
+        REQUIRE(out == expected);
+        merge_scancount(ptrs, out, counts, 1, scratch);
+        REQUIRE(out == expected);
+        if (pass > 0) {
+            CHECK(allocations == before);
+        }
+    }
+}
+
+TEST_CASE("query-context-pigeonhole") {
+    // a few short arrays and many long ones, at a threshold where the short ones
+    // supply the candidates
+    auto data = random_arrays(3, 500, 1000, 25);
+    auto longer = random_arrays(5, 900, 1000, 26);
+    data.insert(data.end(), longer.begin(), longer.end());
+    data_ptrs ptrs = ptrs_of(data);
+    const auto all = all_query(data);
+    const uint8_t threshold = data.size() - 2;
+    auto expected = reference(data, all, threshold);
+    REQUIRE(!expected.empty());
+
+    pigeonhole_scratch scratch;
+    vu32 out;
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t before = allocations;
+        pigeonhole_scancount(ptrs, out, threshold, scratch);
+        REQUIRE(out == expected);
+        if (pass > 0) {
+            CHECK(allocations == before);
+        }
+    }
+}
+
+#ifdef __AVX2__
+
+TEST_CASE("query-context-avx2b") {
+    auto data = random_arrays(140, 3000, 100000, 24);
+    auto aux = implb::get_all_aux<uint16_t>(data);
+    vu32 all(data.size());
+    std::iota(all.begin(), all.end(), 0);
+    const vu32 small{1, 2, 3, 5, 8, 13, 21, 34};
+
+    const uint8_t thresholds[] = {1, 3};
+    std::vector<vu32> small_expected, all_expected;
+    for (auto threshold : thresholds) {
+        small_expected.push_back(reference(data, small, threshold));
+        all_expected.push_back(reference(data, all, threshold));
+    }
+
+    const std::vector<uint8_t> multi_thresholds(std::begin(thresholds), std::end(thresholds));
+    std::vector<vu32> multi_out;
+
+    auto qctx = std::make_unique<query_context>();
+    auto& out = qctx->out;
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t before = allocations;
+        fastscancount_avx2b_multi<uint16_t, record_hits_asm_branchy16>({}, multi_out, multi_thresholds,
+                                                                       aux, small, *qctx);
+        REQUIRE(multi_out == small_expected);
+        for (size_t t = 0; t < 2; t++) {
+            const uint8_t threshold = thresholds[t];
+            fastscancount_avx2b<uint16_t, record_hits_asm_branchy16>({}, out, threshold, aux, small, *qctx);
+            REQUIRE(out == small_expected[t]);
+            fastscancount_avx2b_fused<uint16_t, record_hits_asm_fused16>({}, out, threshold, aux, small, *qctx);
+            REQUIRE(out == small_expected[t]);
+            fastscancount_avx2b_auto<uint16_t, record_hits_asm_branchy16, record_hits_asm_fused16>(
+                {}, out, threshold, aux, small, *qctx);
+            REQUIRE(out == small_expected[t]);
+            fastscancount_avx2b_wide<uint16_t, record_hits_asm_branchy16w>({}, out, threshold, aux, all, *qctx);
+            REQUIRE(out == all_expected[t]);
+        }
+        if (pass > 0) {
+            CHECK(allocations == before);
+        }
+    }
+}
+
+TEST_CASE("query-context-hybrid") {
+    // dense in the first two regions and sparse after that, so both engines run
+    auto data = random_arrays(20, 40000, 2 * hybrid_region_size, 25);
+    for (auto& v : random_arrays(20, 50, 6 * hybrid_region_size, 26)) {
+        data.push_back(v);
+    }
+    auto avx2b_aux = implb::get_all_aux<uint16_t>(data);
+    auto bitscan_aux = get_all_aux_bitscan<uint32_t>(data);
+    hybrid_aux<uint16_t> aux(avx2b_aux, bitscan_aux);
+    vu32 query(data.size());
+    std::iota(query.begin(), query.end(), 0);
+    const uint8_t threshold = 2;
+    const auto expected = reference(data, query, threshold);
+
+    hybrid_scratch<uint16_t> scratch;
+    auto ctx = std::make_unique<avx2b_context>();
+    vu32 out;
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t before = allocations;
+        hybrid_scancount<uint16_t, record_hits_asm_branchy16, bitscan_avx2<uint32_t>>(
+            {}, out, threshold, aux, query, scratch, *ctx);
+        REQUIRE(out == expected);
+        if (pass > 0) {
+            CHECK(allocations == before);
+        }
+    }
+    auto& plan = scratch.plan;
+    CHECK(std::count(plan.begin(), plan.end(), region_engine::bitscan) > 0);
+    CHECK(std::count(plan.begin(), plan.end(), region_engine::avx2b) > 0);
+}
+
+#endif
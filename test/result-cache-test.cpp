@@ -0,0 +1,106 @@
+/*
+ * result-cache-test.cpp
+ *
+ * Tests for the query result cache and the cached engine.
+ */
+
+#include "result-cache.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include "catch.hpp"
+#include "test-data.hpp"
+
+using namespace fastscancount;
+
+using vu32 = std::vector<uint32_t>;
+
+TEST_CASE("result-cache") {
+    result_cache cache{1 << 20};
+    const vu32 hits{0, 1, 127, 128, 300, 16383, 16384, 2097151, 2097152, 0xFFFFFFFF};
+    vu32 out{42};
+
+    CHECK(!cache.lookup({3, 1, 2}, 2, out));
+    CHECK(out == vu32{42});
+    cache.insert({3, 1, 2}, 2, hits);
+
+    // the order of the arrays doesn't matter, but the threshold does
+    CHECK(cache.lookup({1, 2, 3}, 2, out));
+    CHECK(out == hits);
+    CHECK(!cache.lookup({1, 2, 3}, 1, out));
+    CHECK(!cache.lookup({1, 2}, 2, out));
+    CHECK(!cache.lookup({1, 2, 3, 3}, 2, out));
+
+    cache.insert({1, 2}, 0, {});
+    CHECK(cache.lookup({2, 1}, 0, out));
+    CHECK(out.empty());
+
+    auto stats = cache.get_stats();
+    CHECK(stats.hits == 2);
+    CHECK(stats.misses == 4);
+    CHECK(stats.entries == 2);
+    CHECK(stats.bytes <= cache.budget());
+
+    cache.clear();
+    CHECK(!cache.lookup({1, 2, 3}, 2, out));
+    CHECK(cache.get_stats().entries == 0);
+    CHECK(cache.get_stats().bytes == 0);
+}
+
+TEST_CASE("result-cache-eviction") {
+    vu32 hits(1000);
+    std::iota(hits.begin(), hits.end(), 5);
+    result_cache big{1 << 20};
+    big.insert({0}, 0, hits);
+    const size_t entry_bytes = big.get_stats().bytes;
+    // the consecutive hits take a byte each
+    CHECK(entry_bytes < hits.size() * 2);
+
+    // room for three entries
+    result_cache cache{entry_bytes * 3 + entry_bytes / 2};
+    vu32 out;
+    for (uint32_t q = 0; q < 3; q++) {
+        cache.insert({q}, 0, hits);
+    }
+    CHECK(cache.lookup({0}, 0, out)); // now the most recently used
+    cache.insert({3}, 0, hits);       // so this evicts {1}
+    CHECK(cache.get_stats().evictions == 1);
+    CHECK(cache.get_stats().entries == 3);
+    CHECK(cache.get_stats().bytes <= cache.budget());
+    CHECK(!cache.lookup({1}, 0, out));
+    CHECK(cache.lookup({0}, 0, out));
+    CHECK(cache.lookup({2}, 0, out));
+    CHECK(cache.lookup({3}, 0, out));
+    CHECK(out == hits);
+
+    // results larger than the whole budget aren't cached
+    result_cache tiny{entry_bytes / 2};
+    tiny.insert({0}, 0, hits);
+    CHECK(!tiny.lookup({0}, 0, out));
+    CHECK(tiny.get_stats().bytes == 0);
+}
+
+TEST_CASE("result-cache-engine") {
+    auto data = random_arrays(20, 3000, 100000, 41);
+    const std::vector<vu32> queries{{0, 1, 2, 3, 4, 5}, {5, 4, 3, 2, 1, 0}, {7, 9, 11}, {0, 1, 2, 3, 4, 5}};
+
+    auto e = make_cached_engine(make_engine(data), 1 << 20);
+    CHECK(e->target() == detect_isa());
+    for (int pass = 0; pass < 2; pass++) {
+        for (auto& query : queries) {
+            for (uint8_t threshold : {0, 2}) {
+                vu32 out{123};
+                e->scancount(query, threshold, out);
+                CHECK(out == reference(data, query, threshold));
+            }
+        }
+    }
+
+    // changing the tuning clears the cache, and gives the same results
+    e->set_tuning(e->get_tuning());
+    vu32 out;
+    e->scancount(queries[2], 1, out);
+    CHECK(out == reference(data, queries[2], 1));
+}
@@ -37,6 +37,7 @@ vu32 scalar_pack(const vu32& values, const vu32& mask) {
     return ret;
 }
 
+#ifdef __AVX2__
 TEST_CASE("to_vector") {
     CHECK(to_vector(to_simd<__m256i>(vu32{1, 2, 3, 4, 5, 6, 7, 8})) == vu32{1, 2, 3, 4, 5, 6, 7, 8});
 }
@@ -87,6 +88,7 @@ TEST_CASE("pack-left") {
         compare(frog_pack_adapt, v, {x, x, x, x, x, x, x, x});
     }
 }
+#endif // __AVX2__
 
 template <typename T = uint32_t>
 std::vector<T> iota_vec(T start = 0) {
@@ -103,6 +105,7 @@ TEST_CASE("iota_vec") {
 }
 
 
+#ifdef __AVX2__
 vu8 sll_ref(const vu8& v, int n) {
     vu8 ret(32);
     REQUIRE(n >= 0);
@@ -129,3 +132,4 @@ TEST_CASE("ss_mm256_sllx_si256") {
     vu8 v = iota_vec<uint8_t>();
     check_all_sll(v, std::make_integer_sequence<int, 32>());
 }
+#endif // __AVX2__
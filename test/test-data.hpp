@@ -0,0 +1,110 @@
+/*
+ * test-data.hpp
+ *
+ * Random test data, and the naive scancount which the tests check the engines
+ * against.
+ */
+
+#ifndef TEST_DATA_H_
+#define TEST_DATA_H_
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+
+/* a sorted array of up to size distinct elements drawn uniformly from [0, domain) */
+inline data_array random_array(size_t size, uint32_t domain, std::mt19937_64& rng) {
+    std::uniform_int_distribution<uint32_t> dist(0, domain - 1);
+    data_array v;
+    for (size_t i = 0; i < size; i++) {
+        v.push_back(dist(rng));
+    }
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+    return v;
+}
+
+/* array_count random arrays, see random_array */
+inline all_data random_arrays(size_t array_count, size_t array_size, uint32_t domain, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    all_data data;
+    for (size_t a = 0; a < array_count; a++) {
+        data.push_back(random_array(array_size, domain, rng));
+    }
+    return data;
+}
+
+/* a query for all the arrays of data, in order */
+inline std::vector<uint32_t> all_query(const all_data& data) {
+    std::vector<uint32_t> query(data.size());
+    std::iota(query.begin(), query.end(), 0);
+    return query;
+}
+
+inline data_ptrs ptrs_of(const all_data& data) {
+    data_ptrs ret;
+    for (auto& v : data) {
+        ret.push_back(&v);
+    }
+    return ret;
+}
+
+/*
+ * The elements which occur in more than threshold of the arrays of the query, in
+ * increasing order, and if counts isn't null, the number of arrays each occurs in.
+ * Arrays the query has more than once count each time.
+ */
+inline std::vector<uint32_t> reference(const all_data& data, const std::vector<uint32_t>& query,
+                                       size_t threshold, std::vector<uint32_t>* counts = nullptr) {
+    std::vector<uint32_t> ret;
+    if (counts) {
+        counts->clear();
+    }
+    auto add = [&](uint32_t e, size_t count) {
+        if (count > threshold) {
+            ret.push_back(e);
+            if (counts) {
+                counts->push_back(count);
+            }
+        }
+    };
+
+    uint32_t largest = 0;
+    size_t total = 0;
+    for (auto q : query) {
+        auto& v = data.at(q);
+        largest = v.empty() ? largest : std::max(largest, v.back());
+        total += v.size();
+    }
+    if (largest < (1u << 25)) {
+        std::vector<uint32_t> counters(total ? largest + 1 : 0);
+        for (auto q : query) {
+            for (auto e : data[q]) {
+                counters[e]++;
+            }
+        }
+        for (uint32_t e = 0; e < counters.size(); e++) {
+            add(e, counters[e]);
+        }
+    } else {
+        // too sparse for a counter per element
+        std::vector<uint32_t> all;
+        for (auto q : query) {
+            all.insert(all.end(), data[q].begin(), data[q].end());
+        }
+        std::sort(all.begin(), all.end());
+        for (auto i = all.begin(); i != all.end();) {
+            auto j = std::upper_bound(i, all.end(), *i);
+            add(*i, j - i);
+            i = j;
+        }
+    }
+    return ret;
+}
+
+#endif
@@ -7,6 +7,9 @@
 #include "catch.hpp"
 #include "compressed-bitmap.hpp"
 
+#include <algorithm>
+#include <iterator>
+#include <numeric>
 #include <random>
 
 using vst = std::vector<size_t>;
@@ -33,6 +36,11 @@ TEST_CASE( "compressed-bitmap-indices" ) {
     REQUIRE(cb32({1, 2}).indices()   == vst{1, 2});
     REQUIRE(cb32({1, 35}).indices()  == vst{1, 35});
     REQUIRE(cb32({1, 550}).indices() == vst{1, 550});
+
+    // empty, given the largest element of the other arrays
+    cb32 empty({}, 1000);
+    REQUIRE(empty.chunk_count() == 2);
+    REQUIRE(empty.indices().empty());
 }
 
 TEST_CASE( "compressed-bitmap-chunk" ) {
@@ -59,8 +67,259 @@ TEST_CASE( "compressed-bitmap-chunk" ) {
     REQUIRE(chunk.test(3));
 }
 
+TEST_CASE( "compressed-bitmap-offsets" ) {
+    std::mt19937_64 gen(0x1234);
+    std::uniform_int_distribution<uint32_t> dist(0, 200000);
+    std::vector<uint32_t> array;
+    for (int i = 0; i < 5000; i++) {
+        array.push_back(dist(gen));
+    }
+    std::sort(array.begin(), array.end());
+    array.erase(std::unique(array.begin(), array.end()), array.end());
+
+    cb32 cb(array);
+    size_t offset = 0;
+    for (size_t c = 0; c < cb.chunk_count(); c++) {
+        REQUIRE(cb.element_offset(c) == offset);
+        offset += __builtin_popcount(cb.control[c]);
+    }
+    REQUIRE(offset == cb.elements.size());
+}
+
+TEST_CASE( "compressed-bitmap-bytes" ) {
+    using cb8 = compressed_bitmap<uint8_t>;
+
+    REQUIRE(cb8({1}).indices()        == vst{1});
+    REQUIRE(cb8({1, 7, 8}).indices()  == vst{1, 7, 8});
+    REQUIRE(cb8({3, 550}).indices()   == vst{3, 550});
+
+    cb8 cb({1, 3});
+    CHECK(cb.byte_size() == 9); // one 8-byte control and one element
+    cb = cb8({513, 1000});
+    CHECK(cb.byte_size() == 18);
+
+    // sparse data, where most non-empty 32-bit subchunks have a single bit
+    std::mt19937_64 gen(0x4321);
+    std::uniform_int_distribution<uint32_t> dist(0, 2000000);
+    std::vector<uint32_t> array;
+    for (int i = 0; i < 10000; i++) {
+        array.push_back(dist(gen));
+    }
+    std::sort(array.begin(), array.end());
+    array.erase(std::unique(array.begin(), array.end()), array.end());
+
+    cb8 sparse8(array);
+    cb32 sparse32(array);
+    CHECK(sparse8.indices() == vst(array.begin(), array.end()));
+    CHECK(sparse8.byte_size() < sparse32.byte_size());
+    for (size_t c = 0; c < sparse8.chunk_count(); c += 37) {
+        const uint8_t* eptr = sparse8.elements.data() + sparse8.element_offset(c);
+        auto chunk = sparse8.expand(c, eptr);
+        CHECK(eptr == sparse8.elements.data() + (c + 1 < sparse8.chunk_count() ?
+                sparse8.element_offset(c + 1) : sparse8.elements.size()));
+#ifdef __AVX512F__
+        eptr = sparse8.elements.data() + sparse8.element_offset(c);
+        auto chunk512 = fastscancount::to_bitset(sparse8.expand512(c, eptr));
+        CHECK(to_string(chunk512) == to_string(chunk));
+#endif
+    }
+}
+
 using namespace fastscancount;
 
+TEST_CASE( "bitscan-bytes" ) {
+    std::mt19937_64 gen(0x2468);
+    std::uniform_int_distribution<uint32_t> dist(0, 300000);
+    all_data data(21);
+    for (auto& v : data) {
+        for (int i = 0; i < 30000; i++) {
+            v.push_back(dist(gen));
+        }
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+    std::vector<uint32_t> query(data.size());
+    std::iota(query.begin(), query.end(), 0);
+    auto aux32 = get_all_aux_bitscan<uint32_t>(data);
+    auto aux8  = get_all_aux_bitscan<uint8_t>(data);
+
+    for (uint8_t threshold : {0, 2, 5}) {
+        INFO("threshold " << (int)threshold);
+        std::vector<uint32_t> expected, expected_counts, out, counts;
+        bitscan_fake2({}, expected, expected_counts, threshold, aux32, query);
+        REQUIRE(!expected.empty());
+
+        bitscan_fake2({}, out, counts, threshold, aux8, query);
+        CHECK(out == expected);
+        CHECK(counts == expected_counts);
+#ifdef __AVX512F__
+        out.clear();
+        bitscan_avx512({}, out, threshold, aux8, query);
+        CHECK(out == expected);
+        out.clear();
+        bitscan_avx512({}, out, counts, threshold, aux8, query);
+        CHECK(out == expected);
+        CHECK(counts == expected_counts);
+        out.clear();
+        bitscan_avx512({}, out, threshold, aux8, query, 1000, 250000);
+        CHECK(out == std::vector<uint32_t>(std::lower_bound(expected.begin(), expected.end(), 1000),
+                                           std::lower_bound(expected.begin(), expected.end(), 250000)));
+#endif
+    }
+}
+
+TEST_CASE( "bitscan-range" ) {
+    std::mt19937_64 gen(0x5678);
+    std::uniform_int_distribution<uint32_t> dist(0, 100000);
+    all_data data(12);
+    for (auto& v : data) {
+        for (int i = 0; i < 20000; i++) {
+            v.push_back(dist(gen));
+        }
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+    std::vector<uint32_t> query(data.size());
+    std::iota(query.begin(), query.end(), 0);
+    auto aux = get_all_aux_bitscan<uint32_t>(data);
+
+    const uint8_t threshold = 4;
+    std::vector<uint32_t> all;
+    bitscan_fake2({}, all, threshold, aux, query);
+
+    for (auto w : std::vector<std::pair<uint32_t, uint32_t>>{
+            {0, -1u}, {0, 511}, {511, 513}, {512, 1024}, {700, 70000}, {40000, 200000}, {300, 300}}) {
+        INFO("window " << w.first << " " << w.second);
+        std::vector<uint32_t> expected, out;
+        std::copy_if(all.begin(), all.end(), std::back_inserter(expected),
+                [&](uint32_t e){ return e >= w.first && e < w.second; });
+        bitscan_fake2({}, out, threshold, aux, query, w.first, w.second);
+        CHECK(out == expected);
+#ifdef __AVX512F__
+        out.clear();
+        bitscan_avx512({}, out, threshold, aux, query, w.first, w.second);
+        CHECK(out == expected);
+#endif
+    }
+
+    // the tuning knobs don't change the results, including passes which don't divide the range
+    for (size_t pass : {1, 7, 2048}) {
+        INFO("chunks per pass " << pass);
+        aux.chunks_per_pass = pass;
+        aux.prefetch_distance = pass * 64;
+        std::vector<uint32_t> out;
+        bitscan_fake2({}, out, threshold, aux, query);
+        CHECK(out == all);
+        out.clear();
+        bitscan_fake2({}, out, threshold, aux, query, 700, 70000);
+        CHECK(out == std::vector<uint32_t>(std::lower_bound(all.begin(), all.end(), 700),
+                                           std::lower_bound(all.begin(), all.end(), 70000)));
+    }
+}
+
+#ifdef __AVX2__
+TEST_CASE( "expand-epi32" ) {
+    auto values = _mm256_setr_epi32(11, 12, 13, 14, 15, 16, 17, 18);
+    for (uint32_t mask = 0; mask < 256; mask++) {
+        std::vector<uint32_t> expected(8);
+        for (uint32_t i = 0, next = 11; i < 8; i++) {
+            if (mask & (1u << i)) {
+                expected[i] = next++;
+            }
+        }
+        REQUIRE(to_vector(expand_epi32(values, mask)) == expected);
+    }
+}
+
+TEST_CASE( "bitscan-avx2" ) {
+    std::mt19937_64 gen(0x1357);
+    std::uniform_int_distribution<uint32_t> dist(0, 150000);
+    all_data data(19);
+    for (auto& v : data) {
+        for (int i = 0; i < 40000; i++) {
+            v.push_back(dist(gen));
+        }
+        std::sort(v.begin(), v.end());
+        v.erase(std::unique(v.begin(), v.end()), v.end());
+    }
+    std::vector<uint32_t> query(data.size());
+    std::iota(query.begin(), query.end(), 0);
+    auto aux = get_all_aux_bitscan<uint32_t>(data);
+
+    for (uint8_t threshold : {0, 3, 8, 12}) {
+        INFO("threshold " << (int)threshold);
+        std::vector<uint32_t> expected, expected_counts, out, counts;
+        bitscan_fake2({}, expected, expected_counts, threshold, aux, query);
+
+        bitscan_avx2({}, out, threshold, aux, query);
+        CHECK(out == expected);
+        out.clear();
+        bitscan_avx2({}, out, counts, threshold, aux, query);
+        CHECK(out == expected);
+        CHECK(counts == expected_counts);
+        out.clear();
+        bitscan_avx2({}, out, threshold, aux, query, 777, 100000);
+        CHECK(out == std::vector<uint32_t>(std::lower_bound(expected.begin(), expected.end(), 777),
+                                           std::lower_bound(expected.begin(), expected.end(), 100000)));
+    }
+}
+#endif
+
+TEST_CASE( "bitscan-thresholds" ) {
+    // enough dense arrays that most elements reach the larger thresholds
+    std::mt19937_64 gen(0x9abc);
+    std::bernoulli_distribution keep(0.6);
+    all_data data(160);
+    for (auto& v : data) {
+        for (uint32_t e = 0; e < 20000; e++) {
+            if (keep(gen)) {
+                v.push_back(e);
+            }
+        }
+    }
+    std::vector<uint32_t> query(data.size());
+    std::iota(query.begin(), query.end(), 0);
+    auto aux = get_all_aux_bitscan<uint32_t>(data);
+
+    std::vector<uint32_t> counters(get_largest(data) + 1);
+    for (auto& v : data) {
+        for (auto e : v) {
+            counters[e]++;
+        }
+    }
+
+    for (uint8_t threshold : {0, 1, 15, 16, 40, 96, 100, 127, 128, 200, 254}) {
+        INFO("threshold " << (int)threshold);
+        std::vector<uint32_t> expected, expected_counts;
+        for (uint32_t e = 0; e < counters.size(); e++) {
+            if (counters[e] > threshold) {
+                expected.push_back(e);
+                expected_counts.push_back(counters[e]);
+            }
+        }
+
+        std::vector<uint32_t> out, counts;
+        bitscan_fake2({}, out, threshold, aux, query);
+        CHECK(out == expected);
+        out.clear();
+        bitscan_fake2({}, out, counts, threshold, aux, query);
+        CHECK(out == expected);
+        CHECK(counts == expected_counts);
+#ifdef __AVX512F__
+        out.clear();
+        bitscan_avx512({}, out, threshold, aux, query);
+        CHECK(out == expected);
+        out.clear();
+        bitscan_avx512({}, out, counts, threshold, aux, query);
+        CHECK(out == expected);
+        CHECK(counts == expected_counts);
+        out.clear();
+        bitscan_avx512_asm({}, out, threshold, aux, query);
+        CHECK(out == expected);
+#endif
+    }
+}
+
 template <size_t used_bits = 1>
 struct int_traits : default_traits<uint32_t> {
 